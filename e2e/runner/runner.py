@@ -9,15 +9,41 @@ import pandas as pd
 import yaml
 
 
-def compute_accuracy(gt_labels, pred_fname):
+# Top-1 from a preds.out in the runner's output-format; top-k rows are (uint32 class, float prob)
+# pairs that start with the best class
+def compute_accuracy(gt_labels, pred_fname, output_format='fp32', top_k=5):
     nb_classes = len(set(gt_labels))
-    probs = np.fromfile(pred_fname, dtype=np.float32).reshape((-1, nb_classes))
-    probs = probs[0:len(gt_labels)]
-    preds = np.argmax(probs, axis=1)
+    if output_format == 'top-k':
+        records = np.fromfile(pred_fname, dtype=np.uint32).reshape((-1, top_k * 2))
+        preds = records[0:len(gt_labels), 0]
+    elif output_format in ('fp32', 'fp16'):
+        dtype = np.float32 if output_format == 'fp32' else np.float16
+        probs = np.fromfile(pred_fname, dtype=dtype).reshape((-1, nb_classes))
+        probs = probs[0:len(gt_labels)]
+        preds = np.argmax(probs, axis=1)
+    else:
+        raise ValueError('Output format wrong: {}'.format(output_format))
     nb_correct = (preds == np.array(gt_labels)).sum()
     return float(nb_correct) / len(gt_labels) * 100
 
 
+# The runner scores its own predictions with compute-accuracy, without needing write-out
+def read_accuracy(stderr_fname):
+    with open(stderr_fname, 'r') as f:
+        lines = [x for x in f.readlines() if x.startswith('Top-1 accuracy:')]
+    if not lines:
+        return 0.
+    return float(lines[-1].split(',')[0].split(' ')[-1])
+
+
+# Per trial totals of an in-process multi-trial run, summing the stages of sequential cascades
+def read_trials(stderr_fname):
+    with open(stderr_fname, 'r') as f:
+        lines = [x for x in f.readlines() if x.startswith('Trial runtimes:')]
+    stages = [[float(t) for t in x.split(':')[1].split()] for x in lines]
+    return [sum(times) for times in zip(*stages)]
+
+
 def run_single(executable, cfg_path, out_dir, NB_TRIALS=5):
     print('Running single experiment with:')
     print('  executable:', executable)
@@ -41,7 +67,8 @@ def run_single(executable, cfg_path, out_dir, NB_TRIALS=5):
         shutil.rmtree(out_dir)
     os.makedirs(out_dir)
     cfg = yaml.safe_load(open(cfg_path, 'r').read())
-    do_compute_acc = cfg['experiment-config']['write-out']
+    do_runner_acc = cfg['experiment-config'].get('compute-accuracy', False)
+    do_compute_acc = cfg['experiment-config']['write-out'] and not do_runner_acc
     # Doesn't matter which one
     data_path = cfg['model-config']['model-single']['data-path']
     classes = sorted(os.listdir(data_path))
@@ -62,13 +89,20 @@ def run_single(executable, cfg_path, out_dir, NB_TRIALS=5):
     print('Generated model file and outputs')
     if do_compute_acc:
         shutil.copy(pred_fname, os.path.join(out_dir, 'preds.out'))
-        acc = compute_accuracy(gt_labels, os.path.join(out_dir, 'preds.out'))
+        acc = compute_accuracy(gt_labels, os.path.join(out_dir, 'preds.out'),
+                               cfg['experiment-config'].get('output-format', 'fp32'),
+                               cfg['experiment-config'].get('output-top-k', 5))
+        print('Accuracy:', acc)
+    elif do_runner_acc:
+        acc = read_accuracy(stderr_fname)
         print('Accuracy:', acc)
     else:
         acc = 0.
 
-    all_times = []
-    for i in range(NB_TRIALS):
+    # The runner times its own trials after a single load and warmup, so one launch is enough
+    nb_runner_trials = cfg['experiment-config'].get('trials', 1)
+    all_times = read_trials(stderr_fname) if nb_runner_trials > 1 else []
+    for i in range(NB_TRIALS if nb_runner_trials <= 1 else 0):
         print('Starting trial {}'.format(i))
         stdout_fname = os.path.join(out_dir, '{}.stdout'.format(i))
         stderr_fname = os.path.join(out_dir, '{}.stderr'.format(i))
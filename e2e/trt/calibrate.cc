@@ -0,0 +1,63 @@
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "yaml-cpp/yaml.h"
+
+#include "include/criterion.h"
+#include "include/output_sink.h"
+
+// Picks a cascade cutoff from the preds.out of each stage run alone on a labeled subset.
+//
+// data-path: "/path/to/calib"  # pytorch style, the label is the index of the class directory
+// nb-classes: 1000
+// small-preds: "preds_small.out"
+// big-preds: "preds_big.out"
+// preds-format: "fp32"  # the runs' output-format, fp32 or fp16; top-k keeps too little
+// target-accuracy: 0.76
+// criterion:
+//   name: "margin"  # max, margin, entropy or temperature
+//   temperature: 1.5  # only for temperature
+
+int main(int argc, char *argv[]) {
+  assert(argc == 2);
+  YAML::Node cfg = YAML::LoadFile(argv[1]);
+  std::cout << "Using config file: " << argv[1] << std::endl;
+
+  const auto kLabels = GetLabels(cfg["data-path"].as<std::string>());
+  const size_t kNbClasses = cfg["nb-classes"].as<size_t>();
+  const OutputFormat kFormat = ParseOutputFormat(cfg["preds-format"] ?
+      cfg["preds-format"].as<std::string>() : "fp32");
+  // Runs with a multiplier repeat the images after the first kLabels.size() rows
+  const auto kSmall = ReadOutputs(cfg["small-preds"].as<std::string>(), kLabels.size(),
+                                  kNbClasses, kFormat);
+  const auto kBig = ReadOutputs(cfg["big-preds"].as<std::string>(), kLabels.size(),
+                                kNbClasses, kFormat);
+  const float kTargetAcc = cfg["target-accuracy"].as<float>();
+
+  // The cutoff is what we are looking for
+  std::unique_ptr<ThresholdCriterion> criterion;
+  auto crit_string = cfg["criterion"]["name"].as<std::string>();
+  if (crit_string == "max") {
+    criterion.reset(new MaxCriterion(0));
+  } else if (crit_string == "margin") {
+    criterion.reset(new MarginCriterion(0));
+  } else if (crit_string == "entropy") {
+    criterion.reset(new EntropyCriterion(0));
+  } else if (crit_string == "temperature") {
+    criterion.reset(new TemperatureCriterion(0, cfg["criterion"]["temperature"].as<float>()));
+  } else {
+    throw std::invalid_argument("Criterion wrong");
+  }
+
+  const Calibration kCalib = CalibrateCutoff(*criterion, kSmall, kBig, kLabels, kTargetAcc);
+  std::cout << "Images: " << kLabels.size() << std::endl;
+  std::cout << "Cutoff: " << kCalib.cutoff << std::endl;
+  std::cout << "Forwarded: " << kCalib.nb_forwarded << " ("
+            << (float) kCalib.nb_forwarded / kLabels.size() << ")" << std::endl;
+  std::cout << "Accuracy: " << kCalib.accuracy << std::endl;
+  return 0;
+}
@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+
+#include "omp.h"
+#include "yaml-cpp/yaml.h"
+
+#include "jpeglib.h"
+#include "png.h"
+
+#define __STDC_CONSTANT_MACROS
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+#include "libavutil/opt.h"
+#include "libswscale/swscale.h"
+}
+
+// Writes a deterministic synthetic dataset, laid out as the runners' GetFileNames expect, so
+// benchmarks don't need ImageNet or BlazeIt on disk. The same config and seed always give the
+// same pixels, whatever the number of threads.
+//
+// output-dir: "/tmp/synth"
+// seed: 0
+// texture: 0.5  # 0 is smooth gradients only, 1 adds strong fine detail
+// noise: 8  # stddev of per-pixel noise, which the encoders can't remove
+// images:  # <output-dir>/images/<class>/<image>
+//   nb-classes: 10
+//   images-per-class: 100
+//   format: "jpeg"  # or png
+//   sizes: "imagenet"  # or [width, height] for every image
+//   jpeg-quality: 90
+//   chroma-subsampling: "420"  # 444, 422 or 420
+//   restart-rows: 0  # restart marker every this many MCU rows, 0 for none
+//   png-filter: "all"  # none, sub, up, avg, paeth, or all for libpng's adaptive choice
+//   png-interlace: false  # Adam7
+//   png-compression: 6
+// video:  # <output-dir>/video/<segment>.mp4, numbered as video_runner sorts them
+//   nb-segments: 8
+//   width: 1280
+//   height: 720
+//   fps: 30
+//   # The video loaders decode exactly 150 frames per file and video_runner runs each file as
+//   # one batch, so other frame counts only suit other readers
+//   gop: 150
+//   frames: 150
+//   motion: 2  # pixels per frame the scene pans
+//   bitrate-kbps: 0  # 0 keeps the encoder's rate control
+//   preset: "medium"  # passed to the encoder if it has the option
+
+// splitmix64, so every file and pixel gets an independent stream from one seed
+static uint64_t Mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+struct Scene {
+  // Per channel low frequency color fields, in cycles per image
+  float base_freq[3][2], base_phase[3];
+  // Fine detail, in cycles per pixel
+  float detail_freq[2][2], detail_phase[2];
+};
+
+static Scene MakeScene(const uint64_t kSeed) {
+  std::mt19937_64 gen(kSeed);
+  std::uniform_real_distribution<float> low(0.3, 2.5), high(0.05, 0.3), phase(0, 2 * M_PI);
+  Scene scene;
+  for (size_t c = 0; c < 3; c++) {
+    scene.base_freq[c][0] = low(gen);
+    scene.base_freq[c][1] = low(gen);
+    scene.base_phase[c] = phase(gen);
+  }
+  for (size_t d = 0; d < 2; d++) {
+    scene.detail_freq[d][0] = high(gen);
+    scene.detail_freq[d][1] = high(gen);
+    scene.detail_phase[d] = phase(gen);
+  }
+  return scene;
+}
+
+// Interleaved RGB. kShift pans the scene, and kNoiseSeed picks the noise.
+static void RenderScene(const Scene& kScene, const size_t kWidth, const size_t kHeight,
+                        const float kShift, const float kTexture, const float kNoise,
+                        const uint64_t kNoiseSeed, uint8_t *rgb) {
+  const float kTwoPi = 2 * M_PI;
+  // Uniform noise of stddev kNoise, from 21 bits per channel
+  const float kNoiseScale = kNoise * std::sqrt(12.f) / (1 << 21);
+  for (size_t y = 0; y < kHeight; y++) {
+    for (size_t x = 0; x < kWidth; x++) {
+      const float kX = x + kShift;
+      const float kDetail = kTexture * 48 *
+          std::sin(kTwoPi * (kScene.detail_freq[0][0] * kX + kScene.detail_freq[0][1] * y) +
+                   kScene.detail_phase[0]) *
+          std::sin(kTwoPi * (kScene.detail_freq[1][0] * kX + kScene.detail_freq[1][1] * y) +
+                   kScene.detail_phase[1]);
+      const uint64_t kBits = Mix(kNoiseSeed ^ (y * kWidth + x));
+      for (size_t c = 0; c < 3; c++) {
+        const float kBase = 128 + 64 * std::sin(
+            kTwoPi * (kScene.base_freq[c][0] * kX / kWidth +
+                      kScene.base_freq[c][1] * y / kHeight) + kScene.base_phase[c]);
+        const float kNoiseVal = ((kBits >> (c * 21)) & 0x1fffff) * kNoiseScale -
+            kNoise * std::sqrt(3.f);
+        rgb[(y * kWidth + x) * 3 + c] =
+            (uint8_t) std::min(255.f, std::max(0.f, kBase + kDetail + kNoiseVal + 0.5f));
+      }
+    }
+  }
+}
+
+// Approximates ImageNet: most images are 500 on the long side, mostly 4:3 or 3:2 landscape, with
+// a tail of larger photos
+static std::pair<size_t, size_t> ImageNetSize(std::mt19937_64 *gen) {
+  std::uniform_real_distribution<float> unif(0, 1);
+  const float kDraw = unif(*gen);
+  if (kDraw < 0.45)
+    return std::make_pair(500, 375);
+  if (kDraw < 0.60)
+    return std::make_pair(500, 333);
+  if (kDraw < 0.70)
+    return std::make_pair(375, 500);
+  if (kDraw < 0.75)
+    return std::make_pair(333, 500);
+  if (kDraw < 0.80)
+    return std::make_pair(500, 500);
+  if (kDraw < 0.92) {
+    const size_t kShort = 200 + unif(*gen) * 300;
+    return unif(*gen) < 0.7 ? std::make_pair((size_t) 500, kShort) :
+        std::make_pair(kShort, (size_t) 500);
+  }
+  const size_t kLong = 600 * std::pow(4.f, unif(*gen));
+  return std::make_pair(kLong, kLong * 3 / 4);
+}
+
+static void WriteJPEG(const std::string& kPath, const uint8_t *kRGB, const size_t kWidth,
+                      const size_t kHeight, const int kQuality, const std::string& kSubsampling,
+                      const int kRestartRows) {
+  FILE *file = fopen(kPath.c_str(), "wb");
+  if (file == NULL)
+    throw std::runtime_error("Couldn't open " + kPath);
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, file);
+  cinfo.image_width = kWidth;
+  cinfo.image_height = kHeight;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, kQuality, TRUE);
+  // Luma sampling factors, chroma stays at 1x1
+  cinfo.comp_info[0].h_samp_factor = kSubsampling == "444" ? 1 : 2;
+  cinfo.comp_info[0].v_samp_factor = kSubsampling == "420" ? 2 : 1;
+  cinfo.restart_in_rows = kRestartRows;
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row = (JSAMPROW) kRGB + cinfo.next_scanline * kWidth * 3;
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  fclose(file);
+}
+
+static int GetPNGFilter(const std::string& kName) {
+  if (kName == "none")
+    return PNG_FILTER_NONE;
+  else if (kName == "sub")
+    return PNG_FILTER_SUB;
+  else if (kName == "up")
+    return PNG_FILTER_UP;
+  else if (kName == "avg")
+    return PNG_FILTER_AVG;
+  else if (kName == "paeth")
+    return PNG_FILTER_PAETH;
+  else if (kName == "all")
+    return PNG_ALL_FILTERS;
+  throw std::invalid_argument("Wrong png-filter: " + kName);
+}
+
+static void WritePNG(const std::string& kPath, const uint8_t *kRGB, const size_t kWidth,
+                     const size_t kHeight, const int kFilter, const bool kInterlace,
+                     const int kCompression) {
+  FILE *file = fopen(kPath.c_str(), "wb");
+  if (file == NULL)
+    throw std::runtime_error("Couldn't open " + kPath);
+  std::vector<png_bytep> rows(kHeight);
+  for (size_t y = 0; y < kHeight; y++)
+    rows[y] = (png_bytep) kRGB + y * kWidth * 3;
+  png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info = png_create_info_struct(png);
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_write_struct(&png, &info);
+    fclose(file);
+    throw std::runtime_error("Couldn't encode " + kPath);
+  }
+  png_init_io(png, file);
+  png_set_IHDR(png, info, kWidth, kHeight, 8, PNG_COLOR_TYPE_RGB,
+               kInterlace ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_set_filter(png, PNG_FILTER_TYPE_BASE, kFilter);
+  png_set_compression_level(png, kCompression);
+  png_write_info(png, info);
+  png_write_image(png, rows.data());
+  png_write_end(png, NULL);
+  png_destroy_write_struct(&png, &info);
+  fclose(file);
+}
+
+static std::string ZeroPad(const size_t kValue, const size_t kWidth) {
+  std::ostringstream ss;
+  ss << std::setw(kWidth) << std::setfill('0') << kValue;
+  return ss.str();
+}
+
+static void GenerateImages(const YAML::Node& kCfg, const std::string& kDir, const uint64_t kSeed,
+                           const float kTexture, const float kNoise) {
+  namespace fs = std::experimental::filesystem;
+  const size_t kNbClasses = kCfg["nb-classes"] ? kCfg["nb-classes"].as<size_t>() : 10;
+  const size_t kPerClass = kCfg["images-per-class"] ? kCfg["images-per-class"].as<size_t>() : 100;
+  const std::string kFormat = kCfg["format"] ? kCfg["format"].as<std::string>() : "jpeg";
+  const int kQuality = kCfg["jpeg-quality"] ? kCfg["jpeg-quality"].as<int>() : 90;
+  const std::string kSubsampling = kCfg["chroma-subsampling"] ?
+      kCfg["chroma-subsampling"].as<std::string>() : "420";
+  const int kRestartRows = kCfg["restart-rows"] ? kCfg["restart-rows"].as<int>() : 0;
+  const int kPNGFilter = GetPNGFilter(kCfg["png-filter"] ?
+      kCfg["png-filter"].as<std::string>() : "all");
+  const bool kInterlace = kCfg["png-interlace"] ? kCfg["png-interlace"].as<bool>() : false;
+  const int kCompression = kCfg["png-compression"] ? kCfg["png-compression"].as<int>() : 6;
+  const bool kImageNetSizes = !kCfg["sizes"] || kCfg["sizes"].IsScalar();
+  if (kImageNetSizes && kCfg["sizes"] && kCfg["sizes"].as<std::string>() != "imagenet")
+    throw std::invalid_argument("sizes must be imagenet or [width, height]");
+  if (kFormat != "jpeg" && kFormat != "png")
+    throw std::invalid_argument("Wrong image format: " + kFormat);
+  if (kSubsampling != "444" && kSubsampling != "422" && kSubsampling != "420")
+    throw std::invalid_argument("Wrong chroma-subsampling: " + kSubsampling);
+
+  for (size_t c = 0; c < kNbClasses; c++)
+    fs::create_directories(kDir + "/" + ZeroPad(c, 4));
+
+  // Exceptions can't leave the parallel loop, so the first failure is thrown after it
+  std::string error;
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < kNbClasses * kPerClass; i++) {
+    const size_t kClass = i / kPerClass;
+    const uint64_t kFileSeed = Mix(kSeed ^ Mix(i));
+    std::mt19937_64 gen(kFileSeed);
+    std::pair<size_t, size_t> size = kImageNetSizes ? ImageNetSize(&gen) :
+        std::make_pair(kCfg["sizes"][0].as<size_t>(), kCfg["sizes"][1].as<size_t>());
+    std::vector<uint8_t> rgb(size.first * size.second * 3);
+    RenderScene(MakeScene(kFileSeed), size.first, size.second, 0, kTexture, kNoise,
+                Mix(kFileSeed), rgb.data());
+
+    const std::string kPath = kDir + "/" + ZeroPad(kClass, 4) + "/" + ZeroPad(i % kPerClass, 6);
+    try {
+      if (kFormat == "jpeg")
+        WriteJPEG(kPath + ".jpg", rgb.data(), size.first, size.second, kQuality, kSubsampling,
+                  kRestartRows);
+      else
+        WritePNG(kPath + ".png", rgb.data(), size.first, size.second, kPNGFilter, kInterlace,
+                 kCompression);
+    } catch (const std::exception& e) {
+      #pragma omp critical
+      if (error.empty())
+        error = e.what();
+    }
+  }
+  if (!error.empty())
+    throw std::runtime_error(error);
+  std::cout << "Wrote " << kNbClasses * kPerClass << " images to " << kDir << std::endl;
+}
+
+static void WritePackets(AVFormatContext *fmt_ctx, AVCodecContext *ctx, AVStream *stream,
+                         AVPacket *pkt) {
+  while (avcodec_receive_packet(ctx, pkt) == 0) {
+    av_packet_rescale_ts(pkt, ctx->time_base, stream->time_base);
+    pkt->stream_index = stream->index;
+    if (av_interleaved_write_frame(fmt_ctx, pkt) < 0)
+      throw std::runtime_error("Couldn't write a packet");
+  }
+}
+
+static void WriteSegment(const std::string& kPath, const YAML::Node& kCfg, const uint64_t kSeed,
+                         const float kTexture, const float kNoise) {
+  const int kWidth = kCfg["width"] ? kCfg["width"].as<int>() : 1280;
+  const int kHeight = kCfg["height"] ? kCfg["height"].as<int>() : 720;
+  const int kFPS = kCfg["fps"] ? kCfg["fps"].as<int>() : 30;
+  const int kGOP = kCfg["gop"] ? kCfg["gop"].as<int>() : 150;
+  const size_t kNbFrames = kCfg["frames"] ? kCfg["frames"].as<size_t>() : 150;
+  const float kMotion = kCfg["motion"] ? kCfg["motion"].as<float>() : 2;
+  const size_t kBitrate = kCfg["bitrate-kbps"] ? kCfg["bitrate-kbps"].as<size_t>() : 0;
+
+  const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if (codec == NULL)
+    throw std::runtime_error("This libavcodec has no H.264 encoder");
+  AVFormatContext *fmt_ctx = NULL;
+  if (avformat_alloc_output_context2(&fmt_ctx, NULL, NULL, kPath.c_str()) < 0)
+    throw std::runtime_error("Couldn't pick a container for " + kPath);
+  AVStream *stream = avformat_new_stream(fmt_ctx, NULL);
+  AVCodecContext *ctx = avcodec_alloc_context3(codec);
+  ctx->width = kWidth;
+  ctx->height = kHeight;
+  ctx->time_base = AVRational{1, kFPS};
+  ctx->framerate = AVRational{kFPS, 1};
+  ctx->gop_size = kGOP;
+  ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  if (kBitrate > 0)
+    ctx->bit_rate = kBitrate * 1000;
+  if (kCfg["preset"])
+    av_opt_set(ctx->priv_data, "preset", kCfg["preset"].as<std::string>().c_str(), 0);
+  if (fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  if (avcodec_open2(ctx, codec, NULL) < 0)
+    throw std::runtime_error("Couldn't open the H.264 encoder");
+  avcodec_parameters_from_context(stream->codecpar, ctx);
+  stream->time_base = ctx->time_base;
+  if (avio_open(&fmt_ctx->pb, kPath.c_str(), AVIO_FLAG_WRITE) < 0)
+    throw std::runtime_error("Couldn't open " + kPath);
+  if (avformat_write_header(fmt_ctx, NULL) < 0)
+    throw std::runtime_error("Couldn't write the header of " + kPath);
+
+  AVFrame *frame = av_frame_alloc();
+  frame->format = ctx->pix_fmt;
+  frame->width = kWidth;
+  frame->height = kHeight;
+  av_frame_get_buffer(frame, 0);
+  AVPacket *pkt = av_packet_alloc();
+  SwsContext *sws = sws_getContext(kWidth, kHeight, AV_PIX_FMT_RGB24, kWidth, kHeight,
+                                   AV_PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+  const Scene kScene = MakeScene(kSeed);
+  std::vector<uint8_t> rgb(kWidth * kHeight * 3);
+  for (size_t f = 0; f < kNbFrames; f++) {
+    RenderScene(kScene, kWidth, kHeight, f * kMotion, kTexture, kNoise, Mix(kSeed ^ Mix(f)),
+                rgb.data());
+    av_frame_make_writable(frame);
+    const uint8_t *kSrc[1] = {rgb.data()};
+    const int kSrcStride[1] = {kWidth * 3};
+    sws_scale(sws, kSrc, kSrcStride, 0, kHeight, frame->data, frame->linesize);
+    frame->pts = f;
+    if (avcodec_send_frame(ctx, frame) < 0)
+      throw std::runtime_error("Couldn't encode a frame");
+    WritePackets(fmt_ctx, ctx, stream, pkt);
+  }
+  avcodec_send_frame(ctx, NULL);
+  WritePackets(fmt_ctx, ctx, stream, pkt);
+  av_write_trailer(fmt_ctx);
+
+  sws_freeContext(sws);
+  av_packet_free(&pkt);
+  av_frame_free(&frame);
+  avcodec_free_context(&ctx);
+  avio_closep(&fmt_ctx->pb);
+  avformat_free_context(fmt_ctx);
+}
+
+static void GenerateVideo(const YAML::Node& kCfg, const std::string& kDir, const uint64_t kSeed,
+                          const float kTexture, const float kNoise) {
+  namespace fs = std::experimental::filesystem;
+  const size_t kNbSegments = kCfg["nb-segments"] ? kCfg["nb-segments"].as<size_t>() : 8;
+  fs::create_directories(kDir);
+  // Encoders are multithreaded already
+  for (size_t s = 0; s < kNbSegments; s++)
+    WriteSegment(kDir + "/" + std::to_string(s) + ".mp4", kCfg, Mix(kSeed ^ Mix(~s)), kTexture,
+                 kNoise);
+  std::cout << "Wrote " << kNbSegments << " segments to " << kDir << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  assert(argc == 2);
+  YAML::Node cfg = YAML::LoadFile(argv[1]);
+  std::cout << "Using config file: " << argv[1] << std::endl;
+
+  const std::string kOutputDir = cfg["output-dir"].as<std::string>();
+  const uint64_t kSeed = cfg["seed"] ? cfg["seed"].as<uint64_t>() : 0;
+  const float kTexture = cfg["texture"] ? cfg["texture"].as<float>() : 0.5;
+  const float kNoise = cfg["noise"] ? cfg["noise"].as<float>() : 8;
+  if (kTexture < 0 || kTexture > 1 || kNoise < 0)
+    throw std::invalid_argument("texture must be in [0, 1] and noise non-negative");
+  if (!cfg["images"] && !cfg["video"])
+    throw std::invalid_argument("Nothing to generate, add an images or video block");
+
+  if (cfg["images"])
+    GenerateImages(cfg["images"], kOutputDir + "/images", kSeed, kTexture, kNoise);
+  if (cfg["video"])
+    GenerateVideo(cfg["video"], kOutputDir + "/video", Mix(kSeed), kTexture, kNoise);
+  return 0;
+}
@@ -93,7 +93,7 @@ class ImageCalibrator : public BaseCalibrator {
                   const std::vector<CompressedImage>& kCompressedImages,
                   const size_t kBatchSize) :
       kLoader_(kLoader), kCompressedImages_(kCompressedImages),
-      BaseCalibrator(kBatchSize, 3 * kLoader->GetResol() * kLoader->GetResol()) {}
+      BaseCalibrator(kBatchSize, kLoader->GetImSize()) {}
 
   void fillInpData() {
     #pragma omp parallel for
@@ -121,7 +121,7 @@ class VideoCalibrator : public BaseCalibrator {
                   const size_t kBatchSize) :
       kLoader_(kLoader), kFileNames_(kFileNames),
       // hack due to Image
-      BaseCalibrator(1, 3 * kBatchSize * kLoader->GetResol() * kLoader->GetResol()) {}
+      BaseCalibrator(1, kBatchSize * kLoader->GetImSize()) {}
 
   void fillInpData() {
     kLoader_->DecodeAndPreprocessGOP(kFileNames_[counter_], inp_data_.data());
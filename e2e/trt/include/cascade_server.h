@@ -0,0 +1,94 @@
+#ifndef CASCADE_SERVER_H_
+#define CASCADE_SERVER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "folly/MPMCQueue.h"
+#include "omp.h"
+
+#include "common.h"
+#include "criterion.h"
+#include "data_loader.h"
+#include "image_cache.h"
+#include "inference_server.h"
+#include "output_sink.h"
+#include "queue_monitor.h"
+#include "result_cache.h"
+
+struct CascadeStage {
+  const DataLoader *loader;
+  InferenceServer *infer;
+  size_t batch_size;
+  // One entry per image, in the same order for every stage
+  const std::vector<CompressedImage> *compressed;
+  // Picks the images for the next stage. NULL, or on the last stage, every image exits here.
+  const Criterion *criterion;
+  // Rows for content this stage already ran on, checked before decoding. May be NULL.
+  ResultCache *results;
+};
+
+// Runs all stages of a cascade at once. Every finished batch is scored right away and the images
+// its stage is least confident about, as the criterion picks them, are queued for the next stage,
+// so later stages start while earlier ones are still running. The decode threads always prefer
+// work from the latest stage.
+class CascadeServer {
+ private:
+  struct Work {
+    size_t stage;
+    std::vector<size_t> indices;
+    std::vector<float> output;
+    // With a result cache: the key of every image, and the positions in indices that weren't
+    // cached, whose rows are run into run_output
+    std::vector<uint64_t> keys;
+    std::vector<size_t> misses;
+    std::vector<float> run_output;
+  };
+
+  const std::vector<CascadeStage> kStages_;
+  const size_t kNbImages_;
+  const size_t kOutputSingle_;
+  std::vector<std::unique_ptr<folly::MPMCQueue<Batch> > > batch_queues_;
+  std::vector<std::unique_ptr<QueueRegistration> > queue_registrations_;
+  // Stage 0 decodes, kept for the later stages that can preprocess them directly
+  ImageCache *cache_;
+  std::vector<bool> reuse_decode_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  size_t next_image_;
+  // Per stage: images waiting for a full batch, batches ready to decode, batches decoding or
+  // running, and whether the stage has no more work coming
+  std::vector<std::vector<size_t> > pending_;
+  std::vector<std::deque<std::vector<size_t> > > ready_;
+  std::vector<size_t> in_flight_;
+  std::vector<bool> finished_;
+  std::vector<size_t> nb_processed_;
+  // Either may be NULL
+  std::vector<float> *output_;
+  OutputSink *sink_;
+
+  std::unique_ptr<Work> NextWork();
+  void DecodeAndPreproc(const size_t kStageIdx, const std::vector<size_t>& kIndices,
+                        float *output_buf);
+  void RunWork(std::unique_ptr<Work> work);
+  void FinishWork(Work *work);
+  void UpdateFinished();
+
+ public:
+  CascadeServer(const std::vector<CascadeStage>& kStages, ImageCache *cache = NULL);
+
+  // Every stage writes its rows to output and sink, so the last stage that saw an image wins
+  void RunInferenceOnCompressed(std::vector<float> *output, OutputSink *sink = NULL);
+  std::pair<float, std::vector<float> > TimeNoLoad();
+  // Never holds all the outputs at once
+  float TimeNoLoad(OutputSink *sink);
+
+  // Number of images that went through each stage in the last run
+  std::vector<size_t> GetNbProcessed() const { return nb_processed_; }
+};
+
+#endif // CASCADE_SERVER_H_
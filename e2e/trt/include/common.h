@@ -8,11 +8,38 @@
 
 #include "folly/MPMCQueue.h"
 
+#include "memory_stats.h"
+
 // Due to weird JPEG fuckery, the JPEG routines free the compressed image files (???)
 // As a result, pass the raw pointers, not anything smarter
 typedef std::pair<uint8_t *, size_t> CompressedImage;
+// Pinned host memory, charged to the batch pool
+template <typename T>
+class CountedPinnedAllocator : public thrust::system::cuda::experimental::pinned_allocator<T> {
+ private:
+  typedef thrust::system::cuda::experimental::pinned_allocator<T> Base;
+
+ public:
+  template <typename U>
+  struct rebind { typedef CountedPinnedAllocator<U> other; };
+
+  CountedPinnedAllocator() = default;
+  template <typename U>
+  CountedPinnedAllocator(const CountedPinnedAllocator<U>&) {}
+
+  T *allocate(const size_t kCount) {
+    T *ptr = Base::allocate(kCount);
+    MemoryStats::Charge(MemoryOwner::BatchPool, kCount * sizeof(T));
+    return ptr;
+  }
+  void deallocate(T *ptr, const size_t kCount) {
+    Base::deallocate(ptr, kCount);
+    MemoryStats::Charge(MemoryOwner::BatchPool, -(int64_t) (kCount * sizeof(T)));
+  }
+};
+
 // typedef std::unique_ptr<std::vector<float> > Batch;
-typedef std::vector<float, thrust::system::cuda::experimental::pinned_allocator<float> > BatchBase;
+typedef std::vector<float, CountedPinnedAllocator<float> > BatchBase;
 typedef std::unique_ptr<BatchBase> Batch;
 typedef std::tuple<
     Batch, size_t,
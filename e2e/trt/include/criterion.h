@@ -1,68 +1,104 @@
 #ifndef CRITERION_H_
 #define CRITERION_H_
 
-#include <algorithm>
-#include <cmath>
-#include <iterator>
-#include <functional>
-#include <numeric>
-#include <type_traits>
+#include <stddef.h>
 #include <vector>
 
+// What the criteria need from one row of logits, from a single pass over it. With
+// z = (x - max) * inv_temp, sum_exp = sum(exp(z)) and sum_xexp = sum(z * exp(z)).
+struct LogitStats {
+  float max, second, inv_temp, sum_exp, sum_xexp;
 
-// Adapted from
-// https://codereview.stackexchange.com/questions/177973/softmax-function-implementation
-// Note that this implicitly assumes dest and beg have the same type, can be changed
-template <typename It>
-static void softmax(It beg, It end, It dest) {
-  using VType = typename std::iterator_traits<It>::value_type;
-
-  /*VType max_el = -10000, exp_tot = 0.;
-  for (auto beg_cpy = beg, dest_cpy = dest; beg_cpy < end; beg_cpy++, dest_cpy++) {
-    max_el = std::max(max_el, *beg_cpy);
-  }
-
-  for (auto beg_cpy = beg, dest_cpy = dest; beg_cpy < end; beg_cpy++, dest_cpy++) {
-    *dest_cpy = std::exp(*beg_cpy - max_el);
-    exp_tot += *dest_cpy;
-  }
-
-  for (auto beg_cpy = beg, dest_cpy = dest; beg_cpy < end; beg_cpy++, dest_cpy++) {
-    *dest_cpy /= exp_tot;
-  }*/
-
-  auto dest_start = dest;
-  auto beg_cpy = beg, end_cpy = end;
-  auto const kMaxEl { *std::max_element(beg_cpy, end_cpy) };
-
-  beg_cpy = beg; end_cpy = end;
-  VType exptot = 0;
-  std::transform(
-      beg_cpy, end_cpy, dest,
-      [&](VType x){
-        auto ex = std::exp(x - kMaxEl);
-        exptot += ex;
-        return ex;
-      });
-
-  std::transform(
-      dest_start, dest_start + (end - beg), dest_start,
-      std::bind2nd(std::divides<VType>(), exptot));
-}
+  // Of the softmax at temperature 1 / inv_temp
+  float MaxProb() const { return 1 / sum_exp; }
+  float Margin() const;
+  float Entropy() const;
+};
+
+LogitStats ComputeLogitStats(const float *kLogits, const size_t kNbClasses,
+                             const float kInvTemp = 1);
+
+// out may alias kIn
+void softmax(const float *kIn, const size_t kNbClasses, float *out);
 
 class Criterion {
  public:
-  virtual std::vector<bool> filter(const size_t kNbEl, std::vector<float> data) const = 0;
+  // Sets selected[i] for the rows of the kNbEl x kNbClasses logits that go to the next stage.
+  // Works on any slice of the outputs, so it can run on every batch as it lands.
+  virtual void FilterBatch(
+      const float *kLogits, const size_t kNbEl, const size_t kNbClasses, bool *selected) const = 0;
+
+  std::vector<bool> filter(const size_t kNbEl, const std::vector<float>& data) const;
 };
 
-class MaxCriterion : public Criterion {
- private:
+// Forwards the images whose score is >= the cutoff, or < the cutoff if !kForwardAbove. Every
+// criterion forwards the images the stage is least sure about.
+class ThresholdCriterion : public Criterion {
+ protected:
   const float kCutoff_;
+  const bool kForwardAbove_;
+
+ public:
+  ThresholdCriterion(const float kCutoff, const bool kForwardAbove) :
+      kCutoff_(kCutoff), kForwardAbove_(kForwardAbove) {}
+
+  virtual float Score(const LogitStats& kStats) const = 0;
+  virtual float GetInvTemp() const { return 1; }
+  bool ForwardsAbove() const { return kForwardAbove_; }
+
+  void Scores(const float *kLogits, const size_t kNbEl, const size_t kNbClasses,
+              float *scores) const;
+  void FilterBatch(
+      const float *kLogits, const size_t kNbEl, const size_t kNbClasses, bool *selected) const;
+};
+
+// Forwards the images whose max probability is below the cutoff
+class MaxCriterion : public ThresholdCriterion {
+ public:
+  MaxCriterion(const float kCutoff) : ThresholdCriterion(kCutoff, false) {} ;
+
+  float Score(const LogitStats& kStats) const { return kStats.MaxProb(); }
+};
 
+// Forwards the images whose top-1 minus top-2 probability is below the cutoff
+class MarginCriterion : public ThresholdCriterion {
  public:
-  MaxCriterion(const float kCutoff) : kCutoff_(kCutoff) {} ;
+  MarginCriterion(const float kCutoff) : ThresholdCriterion(kCutoff, false) {}
 
-  std::vector<bool> filter(const size_t kNbEl, std::vector<float> data) const;
+  float Score(const LogitStats& kStats) const { return kStats.Margin(); }
 };
 
+// Forwards the images whose softmax entropy (in nats) is at least the cutoff
+class EntropyCriterion : public ThresholdCriterion {
+ public:
+  EntropyCriterion(const float kCutoff) : ThresholdCriterion(kCutoff, true) {}
+
+  float Score(const LogitStats& kStats) const { return kStats.Entropy(); }
+};
+
+// Forwards the images whose max probability at the given temperature is below the cutoff
+class TemperatureCriterion : public ThresholdCriterion {
+ private:
+  const float kInvTemp_;
+
+ public:
+  TemperatureCriterion(const float kCutoff, const float kTemperature);
+
+  float Score(const LogitStats& kStats) const { return kStats.MaxProb(); }
+  float GetInvTemp() const { return kInvTemp_; }
+};
+
+struct Calibration {
+  float cutoff;
+  size_t nb_forwarded;
+  float accuracy;
+};
+
+// Picks the cutoff for kCriterion that forwards the fewest images while the two stage cascade
+// stays at kTargetAcc top-1 accuracy. kSmall and kBig hold the logits of each stage on every
+// image. Throws if even forwarding everything misses the target.
+Calibration CalibrateCutoff(const ThresholdCriterion& kCriterion,
+                            const std::vector<float>& kSmall, const std::vector<float>& kBig,
+                            const std::vector<size_t>& kLabels, const float kTargetAcc);
+
 #endif // CRITERION_H_
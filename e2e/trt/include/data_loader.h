@@ -1,9 +1,11 @@
 #ifndef DATA_LOADER_H_
 #define DATA_LOADER_H_
 
+#include <cmath>
 #include <memory>
 #include <stdint.h>
 #include <string>
+#include <typeinfo>
 #include <vector>
 
 #include "opencv2/core/core.hpp"
@@ -12,6 +14,7 @@
 
 #include "common.h"
 
+struct jpeg_decompress_struct;
 
 class DataLoader {
  protected:
@@ -20,6 +23,15 @@ class DataLoader {
   const bool kDoResize_;
   const LoaderCondition kCondition_;
 
+  // Same loader type cropping the same fraction of the image, up to rounding of the dims
+  // (e.g. 64/73 and 224/256)
+  bool SameCrop(const DataLoader& kOther) const {
+    const float kFrac = kModelInputDim_ / (float) kResizeDim_;
+    const float kOtherFrac = kOther.kModelInputDim_ / (float) kOther.kResizeDim_;
+    return typeid(*this) == typeid(kOther) && kDoResize_ == kOther.kDoResize_ &&
+        std::abs(kFrac - kOtherFrac) <= 0.01 * kFrac;
+  }
+
  public:
   DataLoader(const size_t kResizeDim, const size_t kModelInputDim,
              const bool kDoResize, const LoaderCondition cond) :
@@ -28,6 +40,15 @@ class DataLoader {
   ~DataLoader() {}
 
   size_t GetResol() const { return kModelInputDim_; }
+  size_t GetResizeDim() const { return kResizeDim_; }
+  // Planes written per image by PreprocessImage
+  virtual size_t GetNbChannels() const { return 3; }
+  size_t GetImSize() const { return GetNbChannels() * kModelInputDim_ * kModelInputDim_; }
+  // Whether kOther.DecodeImage output can go straight into this loader's PreprocessImage.
+  // By default decodes may be reduced for kResizeDim_, so only larger ones are reused.
+  virtual bool SharesDecode(const DataLoader& kOther) const {
+    return SameCrop(kOther) && kResizeDim_ <= kOther.kResizeDim_;
+  }
 
   CompressedImage LoadCompressedImageFromFile(const std::string& kFileName) const;
   virtual cv::Mat DecodeImage(CompressedImage kCompressedBuf) const = 0;
@@ -35,6 +56,10 @@ class DataLoader {
 
   void DecodeAndPreproc(CompressedImage kCompressed, float *output_buf) const;
   void LoadAndPreproc(const std::string& kFileName, float *output_buf) const;
+  // Decodes and preprocesses kNbImages consecutive images into consecutive slots of output_buf.
+  // Loaders that can amortize work across a batch override this.
+  virtual void DecodeAndPreprocBatch(
+      const CompressedImage *kCompressed, const size_t kNbImages, float *output_buf) const;
 };
 
 
@@ -51,6 +76,9 @@ class OptimizedDataLoader : public DataLoader {
  private:
   float map_[3][256];
 
+ protected:
+  cv::Mat DecodeCenterCrop(CompressedImage kCompressedBuf, const bool kGray) const;
+
  public:
   OptimizedDataLoader(const size_t kResizeDim, const size_t kModelInputDim,
                       const bool kDoResize, LoaderCondition cond) :
@@ -64,11 +92,90 @@ class OptimizedDataLoader : public DataLoader {
     }
   }
 
+  // The center crop is decoded at full resolution whatever kResizeDim_ is
+  bool SharesDecode(const DataLoader& kOther) const { return SameCrop(kOther); }
+  cv::Mat DecodeImage(CompressedImage kCompressedBuf) const;
+  void PreprocessImage(const cv::Mat& kRawImage, float *output_buf) const;
+};
+
+
+// For single-channel models: decodes only the luma of the center crop and writes one plane
+class GrayJPEGDataLoader : public OptimizedDataLoader {
+ private:
+  float gray_map_[256];
+
+ public:
+  GrayJPEGDataLoader(const size_t kResizeDim, const size_t kModelInputDim,
+                     const bool kDoResize, LoaderCondition cond) :
+      OptimizedDataLoader(kResizeDim, kModelInputDim, kDoResize, cond) {
+    // Averages of the RGB means and stds
+    const float kMean = 0.449, kStd = 0.226;
+    for (size_t j = 0; j < 256; j++)
+      gray_map_[j] = (j / 255.0 - kMean) / kStd;
+  }
+
+  size_t GetNbChannels() const { return 1; }
   cv::Mat DecodeImage(CompressedImage kCompressedBuf) const;
   void PreprocessImage(const cv::Mat& kRawImage, float *output_buf) const;
 };
 
 
+// For tiny models: builds the center crop straight from the DCT coefficients, one pixel per block
+// from the DC term (1/8 scale) or 2x2 pixels per block from DC and the first AC terms (1/4 scale),
+// without IDCT, upsampling or libjpeg color conversion
+class DCJPEGDataLoader : public OptimizedDataLoader {
+ private:
+  const size_t kNbTerms_;
+
+ public:
+  DCJPEGDataLoader(const size_t kResizeDim, const size_t kModelInputDim,
+                   const bool kDoResize, LoaderCondition cond, const size_t kNbTerms = 1) :
+      OptimizedDataLoader(kResizeDim, kModelInputDim, kDoResize, cond),
+      kNbTerms_(kNbTerms) {
+    assert(kDoResize_ == true);
+    if (kNbTerms_ != 1 && kNbTerms_ != 2)
+      throw std::invalid_argument("dct-terms must be 1 or 2");
+  }
+
+  // The decode's scale depends on kNbTerms_, so only loaders with the same count share one
+  bool SharesDecode(const DataLoader& kOther) const {
+    return SameCrop(kOther) &&
+        kNbTerms_ == static_cast<const DCJPEGDataLoader&>(kOther).kNbTerms_;
+  }
+  cv::Mat DecodeImage(CompressedImage kCompressedBuf) const;
+};
+
+
+// For tiny thumbnails: reuses one decompressor for a whole batch, decodes at the smallest DCT
+// scale that covers kResizeDim, and normalizes the batch in a single vectorizable pass. Each image
+// is still entropy decoded with its own Huffman tables and IDCT'd on its own; libjpeg has no API
+// to share either across images.
+class BatchedJPEGDataLoader : public DataLoader {
+ private:
+  float scale_[3], bias_[3];
+
+  cv::Mat DecodeWith(struct jpeg_decompress_struct *cinfo, CompressedImage kCompressedBuf) const;
+  void CropResize(const cv::Mat& kRawImage, cv::Mat *output) const;
+
+ public:
+  BatchedJPEGDataLoader(const size_t kResizeDim, const size_t kModelInputDim,
+                        const bool kDoResize, LoaderCondition cond) :
+      DataLoader(kResizeDim, kModelInputDim, kDoResize, cond) {
+    float means[3] = {0.485, 0.456, 0.406};
+    float stds[3] = {0.229, 0.224, 0.225};
+    for (size_t i = 0; i < 3; i++) {
+      scale_[i] = 1 / (255.0 * stds[i]);
+      bias_[i] = -means[i] / stds[i];
+    }
+  }
+
+  cv::Mat DecodeImage(CompressedImage kCompressedBuf) const;
+  void PreprocessImage(const cv::Mat& kRawImage, float *output_buf) const;
+  void DecodeAndPreprocBatch(
+      const CompressedImage *kCompressed, const size_t kNbImages, float *output_buf) const;
+};
+
+
 class PNGDataLoader : public DataLoader {
  public:
   using DataLoader::DataLoader;
@@ -107,6 +214,29 @@ class OptResizePNGDataLoader : public OptPNGDataLoader {
 };
 
 
+// Decodes each image once and preprocesses it for several loaders, e.g. models with different
+// input dims on the same data. The decode comes from the loader with the largest kResizeDim,
+// which all the others must be able to share (SharesDecode).
+class FanOutLoader {
+ private:
+  const std::vector<const DataLoader *> kTargets_;
+  const DataLoader *kDecoder_;
+
+  static const DataLoader *PickDecoder(const std::vector<const DataLoader *>& kTargets);
+
+ public:
+  FanOutLoader(const std::vector<const DataLoader *>& kTargets) :
+      kTargets_(kTargets), kDecoder_(PickDecoder(kTargets)) {}
+
+  size_t GetNbOutputs() const { return kTargets_.size(); }
+
+  // output_bufs[i] receives the preprocessed image for kTargets[i]
+  void DecodeAndPreproc(CompressedImage kCompressed, float *const *output_bufs) const;
+  void DecodeAndPreprocBatch(
+      const CompressedImage *kCompressed, const size_t kNbImages, float *const *output_bufs) const;
+};
+
+
 // TODO: probably should return cv::Size for named
 static std::pair<size_t, size_t> RatioPreservingResize(
     const size_t kResizeDim, const size_t kOrigWidth, const size_t kOrigHeight) {
@@ -1,6 +1,8 @@
 #ifndef EXPERIMENT_SERVER_H_
 #define EXPERIMENT_SERVER_H_
 
+#include <chrono>
+
 #include <thrust/system/cuda/experimental/pinned_allocator.h>
 
 #include "folly/MPMCQueue.h"
@@ -9,6 +11,20 @@
 #include "data_loader.h"
 #include "inference_server.h"
 #include "common.h"
+#include "queue_monitor.h"
+#include "result_cache.h"
+#include "stage_timer.h"
+
+// Per image latencies of an online run, in nanoseconds since the image's arrival
+struct ServingStats {
+  size_t nb_requests;
+  // Seconds from the start of the arrivals to the last output
+  float runtime;
+  // Until its batch starts decoding
+  LatencyHistogram queue;
+  // Until its output is on the host
+  LatencyHistogram total;
+};
 
 class ExperimentServer {
  private:
@@ -18,22 +34,31 @@ class ExperimentServer {
   const size_t kImSize_;
   const size_t kOutputSingle_;
   folly::MPMCQueue<Batch> batch_queue_;
+  const QueueRegistration kBatchQueueRegistration_;
 
   const bool kRunInfer_;
+  // The cascade stage its images count toward in the live metrics
+  const size_t kStage_;
+
+  typedef std::chrono::steady_clock Clock;
+  struct OnlineRequest {
+    size_t idx;
+    Clock::time_point arrival;
+  };
+  static const size_t kNoRequest_ = SIZE_MAX;
 
  public:
   ExperimentServer(
       const DataLoader& kLoader, InferenceServer *kInfer,
-      const size_t kBatchSize, const bool kRunInfer) :
+      const size_t kBatchSize, const bool kRunInfer, const size_t kStage = 0) :
       kLoader_(kLoader), kInfer_(kInfer), kBatchSize_(kBatchSize),
-      kImSize_(3 * kLoader.GetResol() * kLoader.GetResol()),
+      kImSize_(kLoader.GetImSize()),
       kOutputSingle_(kInfer->GetOutputSingle()),
       batch_queue_(omp_get_max_threads() * 3),
-      kRunInfer_(kRunInfer) {
+      kBatchQueueRegistration_(QueueKind::Batch, &batch_queue_),
+      kRunInfer_(kRunInfer), kStage_(kStage) {
     for (size_t i = 0; i < omp_get_max_threads() * 3; i++)
-      batch_queue_.blockingWrite(
-          std::make_unique<std::vector<float, thrust::system::cuda::experimental::pinned_allocator<float> > >(
-              kBatchSize_ * kImSize_));
+      batch_queue_.blockingWrite(std::make_unique<BatchBase>(kBatchSize_ * kImSize_));
   }
 
   std::vector<float> RunInferenceOnFiles(const std::vector<std::string>& kFileNames);
@@ -42,11 +67,24 @@ class ExperimentServer {
   void RunInferenceOnCompressed(
       const std::vector<CompressedImage>& kCompressedImages,
       std::vector<float> *output);
-  std::pair<float, std::vector<float> > TimeNoLoad(const std::vector<CompressedImage>& kCompressedImages);
+  // Only runs content that isn't in results or earlier in kCompressedImages
+  void RunInferenceCached(
+      const std::vector<CompressedImage>& kCompressedImages,
+      ResultCache *results, std::vector<float> *output);
+  std::pair<float, std::vector<float> > TimeNoLoad(
+      const std::vector<CompressedImage>& kCompressedImages, ResultCache *results = NULL);
 
   float TimeInferenceOnly();
 
   float TimeDecodePreprocOnly(const std::vector<CompressedImage>& kCompressedImages);
+
+  // Requests for kCompressedImages in turn arrive as a Poisson process of kArrivalRate images per
+  // second. Each worker batches what arrived until its batch is full or its oldest request has
+  // waited kMaxBatchDelay. output gets one row per request.
+  ServingStats ServeOnline(
+      const std::vector<CompressedImage>& kCompressedImages, const size_t kNbRequests,
+      const double kArrivalRate, const std::chrono::microseconds kMaxBatchDelay,
+      const uint64_t kSeed, std::vector<float> *output);
 };
 
 #endif // EXPERIMENT_SERVER_H_
@@ -0,0 +1,40 @@
+#ifndef FAN_OUT_SERVER_H_
+#define FAN_OUT_SERVER_H_
+
+#include <memory>
+#include <vector>
+
+#include "folly/MPMCQueue.h"
+#include "omp.h"
+
+#include "common.h"
+#include "data_loader.h"
+#include "inference_server.h"
+#include "queue_monitor.h"
+
+// Runs several models over the same images, decoding every image once. All models use the same
+// batch size so each decoded batch feeds one batch of every model.
+class FanOutExperimentServer {
+ private:
+  const FanOutLoader kLoader_;
+  const std::vector<const DataLoader *> kLoaders_;
+  const std::vector<InferenceServer *> kInfers_;
+  const size_t kBatchSize_;
+  std::vector<std::unique_ptr<folly::MPMCQueue<Batch> > > batch_queues_;
+  std::vector<std::unique_ptr<QueueRegistration> > queue_registrations_;
+
+ public:
+  FanOutExperimentServer(
+      const std::vector<const DataLoader *>& kLoaders,
+      const std::vector<InferenceServer *>& kInfers,
+      const size_t kBatchSize);
+
+  // (*outputs)[i] receives the outputs of kInfers[i]
+  void RunInferenceOnCompressed(
+      const std::vector<CompressedImage>& kCompressedImages,
+      std::vector<std::vector<float> > *outputs);
+  std::pair<float, std::vector<std::vector<float> > > TimeNoLoad(
+      const std::vector<CompressedImage>& kCompressedImages);
+};
+
+#endif // FAN_OUT_SERVER_H_
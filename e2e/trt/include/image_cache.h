@@ -0,0 +1,38 @@
+#ifndef IMAGE_CACHE_H_
+#define IMAGE_CACHE_H_
+
+#include <mutex>
+#include <unordered_map>
+
+#include "opencv2/core/core.hpp"
+
+// Decoded images kept between cascade stages, keyed by image index, under a byte budget.
+// Stages consume images roughly in index order, so the oldest entries are the next ones to be
+// used: a full cache drops new images rather than evicting old ones. Images a stage doesn't
+// forward are erased as soon as they are scored.
+class ImageCache {
+ private:
+  const size_t kBudgetBytes_;
+  std::mutex mutex_;
+  std::unordered_map<size_t, cv::Mat> images_;
+  size_t bytes_ = 0;
+  size_t nb_hits_ = 0, nb_misses_ = 0, nb_dropped_ = 0;
+
+  static size_t Footprint(const cv::Mat& kImage) {
+    // ROIs keep their whole parent buffer alive
+    return kImage.dataend - kImage.datastart;
+  }
+
+ public:
+  ImageCache(const size_t kBudgetBytes) : kBudgetBytes_(kBudgetBytes) {}
+
+  void Put(const size_t kIndex, const cv::Mat& kImage);
+  bool Get(const size_t kIndex, cv::Mat *image);
+  void Erase(const size_t kIndex);
+
+  size_t GetNbHits() const { return nb_hits_; }
+  size_t GetNbMisses() const { return nb_misses_; }
+  size_t GetNbDropped() const { return nb_dropped_; }
+};
+
+#endif // IMAGE_CACHE_H_
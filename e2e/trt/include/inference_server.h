@@ -1,6 +1,8 @@
 #ifndef INFERENCE_SERVER_H_
 #define INFERENCE_SERVER_H_
 
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <stdint.h>
 #include <string>
@@ -17,6 +19,7 @@
 #include "common.h"
 #include "data_loader.h"
 #include "calibrator.h"
+#include "queue_monitor.h"
 
 
 // This should possibly be an abstract base class, but we're only using ONNX for now
@@ -24,6 +27,8 @@ class InferenceServer {
  public:
   virtual size_t GetOutputSingle() = 0;
   virtual void RunInference(QueueData data) = 0;
+  // kOnDone is called from an inference thread once the outputs have been copied back
+  virtual void RunInference(QueueData data, std::function<void()> kOnDone) = 0;
   virtual void Sync() = 0;
   virtual std::vector<std::vector<float> > GetResults() = 0;
 };
@@ -43,7 +48,14 @@ class OnnxInferenceServer : public InferenceServer {
   void *bindings[kNbStreams_][2];
   cudawrapper::CudaStream streams[kNbStreams_];
 
-  folly::MPMCQueue<QueueData> queue_;
+  struct InferWork {
+    QueueData data;
+    std::function<void()> on_done;
+    // For the infer-queue-wait timer
+    std::chrono::steady_clock::time_point queued;
+  };
+  folly::MPMCQueue<InferWork> queue_;
+  const QueueRegistration kQueueRegistration_;
   std::vector<std::thread> threads_;
 
 
@@ -59,7 +71,9 @@ class OnnxInferenceServer : public InferenceServer {
 
   void teardown() {
     for (size_t i = 0; i < kNbStreams_; i++) {
-      queue_.blockingWrite(std::make_tuple(nullptr, 0, nullptr, 0, nullptr));
+      queue_.blockingWrite(InferWork{
+          QueueData(nullptr, 0, nullptr, 0, nullptr), std::function<void()>(),
+          std::chrono::steady_clock::now()});
     }
     for (size_t i = 0; i < threads_.size(); i++)
       threads_[i].join();
@@ -100,6 +114,7 @@ class OnnxInferenceServer : public InferenceServer {
   void warmup(const size_t kResol);
 
   void RunInference(QueueData data);
+  void RunInference(QueueData data, std::function<void()> kOnDone);
 
   void Sync();
 
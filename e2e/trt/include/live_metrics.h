@@ -0,0 +1,49 @@
+#ifndef LIVE_METRICS_H_
+#define LIVE_METRICS_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+enum class TimedStage : size_t;
+
+// Progress counters that a local scraper reads while a run is going, from a Unix domain socket.
+// Every connection gets one JSON snapshot and is closed; requests starting with GET get an HTTP
+// response instead, for curl --unix-socket. The snapshot has the images done per cascade stage,
+// images/s over the last 1, 10 and 60 s, the pass-through rate of each cascade stage, the mean
+// number of threads busy in each timed stage over the last 10 s, and the depth of every queue.
+//
+// Counters are per thread and written without locked instructions; the socket's thread sums them
+// on each request and once a second for the windows.
+class LiveMetrics {
+ public:
+  // Cascade stages past the last one count toward it
+  static const size_t kMaxStages = 8;
+
+ private:
+  static std::atomic<bool> enabled_;
+
+  static void RecordImages(const size_t kStage, const uint64_t kNbImages);
+
+ public:
+  // Listens on kPath, replacing whatever is there
+  static void Enable(const std::string& kPath);
+  // Stops listening and removes the socket, which must happen before exit
+  static void Disable();
+  static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  // Images through cascade stage kStage, 0 outside of cascades. Servers count a batch once its
+  // outputs are on the host, or once it's handed to inference when they have no callback.
+  static void AddImages(const size_t kStage, const uint64_t kNbImages) {
+    if (IsEnabled())
+      RecordImages(kStage, kNbImages);
+  }
+  // Time a thread spent in kStage, from the stage timers
+  static void AddBusy(const TimedStage kStage, const uint64_t kNanos);
+
+  // The snapshot every connection gets
+  static std::string GetJson();
+};
+
+#endif // LIVE_METRICS_H_
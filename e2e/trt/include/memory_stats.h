@@ -0,0 +1,87 @@
+#ifndef MEMORY_STATS_H_
+#define MEMORY_STATS_H_
+
+#include <atomic>
+#include <ostream>
+#include <stdint.h>
+
+enum class MemoryOwner : size_t {
+  // Compressed files held in memory, once per file however large the multiplier
+  Compressed,
+  // Every pinned BatchBase, i.e. the batch pools and the inference servers' buffers
+  BatchPool,
+  // Host output rows, either vectors or mapped output files
+  Output,
+  // Heap working set of one decode and preprocess call, summed over the threads
+  Decoder,
+  NbOwners
+};
+
+const char *GetOwnerName(const MemoryOwner kOwner);
+
+struct AllocCounts {
+  uint64_t nb_allocs = 0;
+  uint64_t bytes = 0;
+};
+
+// Bytes held by each owner, and the malloc calls of the whole process. Owners other than the
+// decoder are charged by whoever allocates for them, at any time. Allocations are counted by
+// replacing malloc and friends, only in glibc builds with MALLOC_HOOKS on, and only while
+// enabled; each thread keeps its own counters, which are summed on read.
+class MemoryStats {
+ private:
+  static std::atomic<bool> enabled_;
+
+ public:
+  static void Enable() { enabled_.store(true, std::memory_order_relaxed); }
+  static void Disable() { enabled_.store(false, std::memory_order_relaxed); }
+  static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  // Negative to release
+  static void Charge(const MemoryOwner kOwner, const int64_t kBytes);
+  static uint64_t GetBytes(const MemoryOwner kOwner);
+  static uint64_t GetPeakBytes(const MemoryOwner kOwner);
+
+  // Whether malloc is replaced, which the allocation counts and the decoder owner need
+  static bool CountsAllocs();
+  // Since enabled, over every thread
+  static AllocCounts GetAllocs();
+
+  // Resident set of the process, from /proc/self/statm and getrusage
+  static uint64_t GetRSS();
+  static uint64_t GetPeakRSS();
+
+  // Peak RSS, every owner's current and peak bytes, and the allocations per image
+  static void Print(std::ostream& os, const size_t kNbImages);
+};
+
+// Charges kBytes to kOwner for its lifetime
+class MemoryCharge {
+ private:
+  const MemoryOwner kOwner_;
+  const int64_t kBytes_;
+
+ public:
+  MemoryCharge(const MemoryOwner kOwner, const size_t kBytes) :
+      kOwner_(kOwner), kBytes_(kBytes) {
+    MemoryStats::Charge(kOwner_, kBytes_);
+  }
+  ~MemoryCharge() { MemoryStats::Charge(kOwner_, -kBytes_); }
+  MemoryCharge(const MemoryCharge&) = delete;
+  MemoryCharge& operator=(const MemoryCharge&) = delete;
+};
+
+// Heap bytes the calling thread has live above what it had when the outermost scope opened count
+// toward its decoder peak. Nested scopes are part of the outer one.
+class DecoderMemoryScope {
+ private:
+  const bool kActive_;
+
+ public:
+  DecoderMemoryScope();
+  ~DecoderMemoryScope();
+  DecoderMemoryScope(const DecoderMemoryScope&) = delete;
+  DecoderMemoryScope& operator=(const DecoderMemoryScope&) = delete;
+};
+
+#endif // MEMORY_STATS_H_
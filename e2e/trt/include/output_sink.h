@@ -0,0 +1,106 @@
+#ifndef OUTPUT_SINK_H_
+#define OUTPUT_SINK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "memory_stats.h"
+
+enum class OutputFormat {
+  // kOutputSingle floats per image, the same layout as the old preds.out
+  FP32,
+  // kOutputSingle IEEE halfs per image
+  FP16,
+  // k (uint32 class, float prob) pairs per image, by decreasing probability
+  TopK
+};
+
+// "fp32", "fp16" or "top-k"
+OutputFormat ParseOutputFormat(const std::string& kName);
+
+// The first kNbImages rows of a preds.out as floats. Top-k files don't keep whole rows and are
+// rejected.
+std::vector<float> ReadOutputs(const std::string& kPath, const size_t kNbImages,
+                               const size_t kOutputSingle, const OutputFormat kFormat);
+
+// The index of each image's class directory under a pytorch style val_dir, in the runner's file
+// order
+std::vector<size_t> GetLabels(const std::string& val_dir);
+
+// Where predictions go as batches finish. Rows can arrive in any order and from several threads,
+// and a row written twice keeps the last value, which is what cascades rely on.
+class OutputSink {
+ public:
+  virtual ~OutputSink() {}
+
+  virtual void WriteRow(const size_t kIndex, const float *kLogits) = 0;
+
+  // kNbEl consecutive rows starting at image kFirst
+  void Write(const size_t kFirst, const float *kLogits, const size_t kNbEl,
+             const size_t kOutputSingle) {
+    for (size_t i = 0; i < kNbEl; i++)
+      WriteRow(kFirst + i, kLogits + i * kOutputSingle);
+  }
+};
+
+// Writes row i of the caller to row kIndices[i] of kBase, for callers that only see a subset
+class IndexedOutputSink : public OutputSink {
+ private:
+  OutputSink *kBase_;
+  const std::vector<size_t>& kIndices_;
+
+ public:
+  IndexedOutputSink(OutputSink *kBase, const std::vector<size_t>& kIndices) :
+      kBase_(kBase), kIndices_(kIndices) {}
+
+  void WriteRow(const size_t kIndex, const float *kLogits) {
+    kBase_->WriteRow(kIndices_.at(kIndex), kLogits);
+  }
+};
+
+// Fixed size records in an mmapped file, so nothing is held in memory and rows land in place
+class MmapOutputSink : public OutputSink {
+ private:
+  const size_t kOutputSingle_;
+  const OutputFormat kFormat_;
+  const size_t kTopK_;
+  const size_t kRecordSize_;
+  const size_t kFileSize_;
+  const MemoryCharge kCharge_;
+  int fd_;
+  uint8_t *data_;
+
+ public:
+  MmapOutputSink(const std::string& kPath, const size_t kNbImages, const size_t kOutputSingle,
+                 const OutputFormat kFormat, const size_t kTopK = 5);
+  ~MmapOutputSink();
+
+  void WriteRow(const size_t kIndex, const float *kLogits);
+};
+
+// Scores rows against their labels as they arrive, keeping only the rank of each image's label in
+// its latest row. Rows are passed on to kBase when there is one.
+class AccuracySink : public OutputSink {
+ private:
+  // Image i has label kLabels_[i % kLabels_.size()], which covers the multiplier's copies
+  const std::vector<size_t> kLabels_;
+  const size_t kOutputSingle_;
+  OutputSink *kBase_;
+  // Ranks saturate at kMaxRank_; images without a row keep it
+  static constexpr uint8_t kMaxRank_ = 255;
+  std::vector<uint8_t> ranks_;
+
+ public:
+  AccuracySink(const std::vector<size_t>& kLabels, const size_t kNbImages,
+               const size_t kOutputSingle, OutputSink *kBase = NULL);
+
+  void WriteRow(const size_t kIndex, const float *kLogits);
+
+  // Percent of images whose label is among their kK highest logits, ties going to the lower class
+  // as with an argmax
+  float GetTopK(const size_t kK) const;
+};
+
+#endif // OUTPUT_SINK_H_
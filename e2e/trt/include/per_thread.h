@@ -0,0 +1,54 @@
+#ifndef PER_THREAD_H_
+#define PER_THREAD_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <vector>
+
+// One T per thread, for stats that threads record without taking locks. A thread's T is made on
+// its first Get and outlives the thread, so readers still see what exited threads recorded. There
+// is one registry per T.
+template <typename T>
+class PerThreadRegistry {
+ private:
+  static std::mutex mutex_;
+  static std::vector<std::unique_ptr<T> > entries_;
+  static thread_local T *local_;
+
+ public:
+  // kInit runs on a new T under the lock, with the number of Ts made before it
+  template <typename Init>
+  static T *Get(Init init) {
+    if (local_ == NULL) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      entries_.emplace_back(new T());
+      local_ = entries_.back().get();
+      init(local_, entries_.size() - 1);
+    }
+    return local_;
+  }
+  static T *Get() { return Get([](T *, size_t) {}); }
+
+  // Keeps threads from registering; also guards whatever the caller keeps alongside the Ts
+  static std::unique_lock<std::mutex> Lock() { return std::unique_lock<std::mutex>(mutex_); }
+  // Every T so far, only while holding Lock
+  static const std::vector<std::unique_ptr<T> >& GetAll() { return entries_; }
+};
+
+template <typename T>
+std::mutex PerThreadRegistry<T>::mutex_;
+template <typename T>
+std::vector<std::unique_ptr<T> > PerThreadRegistry<T>::entries_;
+template <typename T>
+thread_local T *PerThreadRegistry<T>::local_ = NULL;
+
+// Adds to a counter that only the calling thread writes, without a locked instruction. Readers on
+// other threads still see whole values.
+template <typename T>
+void Bump(std::atomic<T> *counter, const T kDelta) {
+  counter->store(counter->load(std::memory_order_relaxed) + kDelta, std::memory_order_relaxed);
+}
+
+#endif // PER_THREAD_H_
@@ -0,0 +1,72 @@
+#ifndef PERF_COUNTERS_H_
+#define PERF_COUNTERS_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+enum class PerfCounter : size_t {
+  Cycles,
+  Instructions,
+  // Last level cache, as the kernel's generic cache-misses event
+  LLCMisses,
+  BranchMisses,
+  NbCounters
+};
+
+const char *GetCounterName(const PerfCounter kCounter);
+
+// Raw counts and how long the group was enabled and actually counting. Snapshots are subtracted
+// raw, since scaled snapshots aren't monotonic, and the deltas are scaled.
+struct PerfCounts {
+  uint64_t values[(size_t) PerfCounter::NbCounters] = {};
+  uint64_t time_enabled = 0, time_running = 0;
+
+  uint64_t operator[](const PerfCounter kCounter) const { return values[(size_t) kCounter]; }
+  PerfCounts& operator+=(const PerfCounts& kOther) {
+    for (size_t i = 0; i < (size_t) PerfCounter::NbCounters; i++)
+      values[i] += kOther.values[i];
+    time_enabled += kOther.time_enabled;
+    time_running += kOther.time_running;
+    return *this;
+  }
+  PerfCounts operator-(const PerfCounts& kOther) const {
+    PerfCounts diff;
+    for (size_t i = 0; i < (size_t) PerfCounter::NbCounters; i++)
+      diff.values[i] = values[i] - kOther.values[i];
+    diff.time_enabled = time_enabled - kOther.time_enabled;
+    diff.time_running = time_running - kOther.time_running;
+    return diff;
+  }
+  // Estimated counts had the group run the whole time it was enabled
+  PerfCounts Scaled() const {
+    PerfCounts scaled;
+    scaled.time_enabled = scaled.time_running = time_enabled;
+    if (time_running == 0)
+      return scaled;
+    const double kScale = time_enabled / (double) time_running;
+    for (size_t i = 0; i < (size_t) PerfCounter::NbCounters; i++)
+      scaled.values[i] = values[i] * kScale;
+    return scaled;
+  }
+};
+
+// User space hardware counters of the calling thread, from perf_event_open. Every thread opens its
+// own counter group on its first read and keeps it until it exits, so reads take no locks. Deltas
+// are scaled up when the kernel multiplexes the group.
+class PerfCounters {
+ private:
+  static std::atomic<bool> enabled_;
+
+ public:
+  // Opens the calling thread's counters to check that the kernel allows them (see
+  // perf_event_paranoid); if not, stays disabled and returns why
+  static std::string Enable();
+  static void Disable() { enabled_.store(false, std::memory_order_relaxed); }
+  static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  // Raw, all zeros on threads whose counters couldn't be opened
+  static PerfCounts Read();
+};
+
+#endif // PERF_COUNTERS_H_
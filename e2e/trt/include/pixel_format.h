@@ -7,7 +7,8 @@ extern "C" {
 
 enum class PixelFormat {
  PLANAR_RGB, PLANAR_BGR, PLANAR_YUV,
- PACKED_RGB, PACKED_BGR, PACKED_YUV
+ PACKED_RGB, PACKED_BGR, PACKED_YUV,
+ GRAY
 };
 
 namespace PixFormat {
@@ -28,6 +29,10 @@ static AVPixelFormat GetLibavPixelFormat(PixelFormat pfmt) {
     case PixelFormat::PACKED_BGR:
       return AV_PIX_FMT_BGR24;
 
+    // Only the luma plane is scaled, chroma is never touched
+    case PixelFormat::GRAY:
+      return AV_PIX_FMT_GRAY8;
+
     // FFmpeg doesn't support packed 4:4:4 YUV?
     default:
       throw std::runtime_error("Not implemented");
@@ -39,6 +44,7 @@ static bool IsPlanar(PixelFormat pfmt) {
     case PixelFormat::PLANAR_RGB:
     case PixelFormat::PLANAR_BGR:
     case PixelFormat::PLANAR_YUV:
+    case PixelFormat::GRAY:
       return true;
 
     case PixelFormat::PACKED_RGB:
@@ -50,6 +56,10 @@ static bool IsPlanar(PixelFormat pfmt) {
   }
 }
 
+static size_t NbChannels(PixelFormat pfmt) {
+  return pfmt == PixelFormat::GRAY ? 1 : 3;
+}
+
 } // namespace PixFormat
 
 #endif // PIXEL_FORMAT_
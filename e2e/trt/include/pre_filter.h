@@ -0,0 +1,72 @@
+#ifndef PRE_FILTER_H_
+#define PRE_FILTER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+#include "common.h"
+
+namespace YAML { class Node; }
+
+// An image is dropped if any rule fails. Mean, stddev and sharpness are on the luma in [0, 255].
+struct PreFilterRules {
+  // Too dark or too bright
+  float min_mean = 0, max_mean = 255;
+  // Blank or flat frames
+  float min_stddev = 0;
+  // Variance of the Laplacian, low for blurred frames
+  float min_sharpness = 0;
+  // Frames whose color histogram is this close to the reference (in [0, 1]) are dropped
+  float min_hist_distance = 0;
+  // Dropped images predict this class
+  size_t default_class = 0;
+};
+
+struct ImageStats {
+  float mean, stddev, sharpness, hist_distance;
+};
+
+// Cheap CPU statistics on a small decode, to keep images that can't be classified from reaching
+// the model
+class PreFilter {
+ private:
+  const PreFilterRules kRules_;
+  // 1, 2, 4 or 8: compressed images are decoded at this fraction of their size
+  const size_t kThumbnailScale_;
+  // kHistBins_ bins per R, G, B channel; empty without a reference
+  static const size_t kHistBins_ = 8;
+  std::vector<float> ref_hist_;
+
+  // Normalized per channel. Single channel images count as R = G = B.
+  std::vector<float> ColorHistogram(
+      const uint8_t *const *kRGB, const size_t kNbChannels, const size_t kStep,
+      const size_t kNbPixels) const;
+
+ public:
+  PreFilter(const PreFilterRules& kRules, const std::string& kReferencePath = "",
+            const size_t kThumbnailScale = 4);
+
+  // kRGB holds the R, G and B channels, or a single gray one, each with kStep bytes between
+  // pixels and no padding between rows
+  ImageStats ComputeStats(
+      const uint8_t *const *kRGB, const size_t kNbChannels, const size_t kStep,
+      const size_t kWidth, const size_t kHeight) const;
+  bool Accept(const ImageStats& kStats) const;
+
+  // BGR or gray, as decoded by OpenCV
+  bool AcceptImage(const cv::Mat& kImage) const;
+  // Decodes a thumbnail of every image in parallel
+  std::vector<bool> FilterCompressed(const std::vector<CompressedImage>& kImages) const;
+
+  // The prediction written for dropped images
+  void FillDefault(float *output, const size_t kOutputSingle) const;
+};
+
+// A runner's optional pre-filter block, NULL without one; every rule defaults to accepting
+// everything
+const PreFilter *ParsePreFilter(const YAML::Node& kCfg);
+
+#endif // PRE_FILTER_H_
@@ -0,0 +1,135 @@
+#ifndef QUEUE_MONITOR_H_
+#define QUEUE_MONITOR_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+#include "folly/MPMCQueue.h"
+
+// Batch queues hold the free pinned batches, so an empty one means every batch is waiting for or
+// in inference. The inference queue holds filled batches, so an empty one means the streams are
+// waiting on preprocessing.
+enum class QueueKind : size_t {
+  Batch,
+  Infer,
+  NbKinds
+};
+
+const char *GetQueueName(const QueueKind kKind);
+
+struct QueueStats {
+  uint64_t nb_reads = 0, nb_writes = 0;
+  // Reads that found the queue empty and writes that found it full, i.e. a starved consumer and
+  // a blocked producer, and how long they waited
+  uint64_t nb_starved_reads = 0, nb_blocked_writes = 0;
+  uint64_t read_wait_ns = 0, write_wait_ns = 0;
+
+  QueueStats& operator+=(const QueueStats& kOther) {
+    nb_reads += kOther.nb_reads;
+    nb_writes += kOther.nb_writes;
+    nb_starved_reads += kOther.nb_starved_reads;
+    nb_blocked_writes += kOther.nb_blocked_writes;
+    read_wait_ns += kOther.read_wait_ns;
+    write_wait_ns += kOther.write_wait_ns;
+    return *this;
+  }
+};
+
+struct QueueDepth {
+  size_t id;
+  QueueKind kind;
+  size_t capacity;
+  ssize_t depth;
+};
+
+// Reads and writes of each kind of queue, counted per thread so that recording takes no locks,
+// and the depth of every registered queue, sampled by a background thread. Both happen only while
+// enabled, and are reported once the threads are idle.
+class QueueMonitor {
+ private:
+  static std::atomic<bool> enabled_;
+
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  // Starts sampling every kPeriod, dropping earlier samples and counts. The time series keeps its
+  // first kMaxSamples samples; the depth summary covers all of them.
+  static void Enable(const std::chrono::microseconds kPeriod, const size_t kMaxSamples);
+  // Stops the sampler, which must happen before exit
+  static void Disable();
+  static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  static size_t Register(const QueueKind kKind, std::function<ssize_t()> depth,
+                         const size_t kCapacity);
+  static void Unregister(const size_t kId);
+
+  static void RecordRead(const QueueKind kKind, const bool kStarved, const uint64_t kWaitNanos);
+  static void RecordWrite(const QueueKind kKind, const bool kBlocked, const uint64_t kWaitNanos);
+  static QueueStats GetMerged(const QueueKind kKind);
+
+  // The current depth of every registered queue, enabled or not
+  static std::vector<QueueDepth> GetDepths();
+
+  // Per kind, how often reads starved and writes blocked, for how long, and the sampled depth
+  static void PrintSummary(std::ostream& os);
+  // The summary per queue and per kind, and every sample as [ms since Enable, queue id, depth]
+  static void WriteJson(const std::string& kPath);
+};
+
+// Samples kQueue for the registration's lifetime, so it must be destroyed before the queue
+class QueueRegistration {
+ private:
+  const size_t kId_;
+
+ public:
+  template <typename T>
+  QueueRegistration(const QueueKind kKind, const folly::MPMCQueue<T> *kQueue) :
+      kId_(QueueMonitor::Register(kKind, [kQueue]() { return kQueue->sizeGuess(); },
+                                  kQueue->capacity())) {}
+  ~QueueRegistration() { QueueMonitor::Unregister(kId_); }
+  QueueRegistration(const QueueRegistration&) = delete;
+  QueueRegistration& operator=(const QueueRegistration&) = delete;
+};
+
+// blockingRead, counting the reads that had to wait
+template <typename T>
+void MonitoredRead(folly::MPMCQueue<T> *queue, T& item, const QueueKind kKind) {
+  if (!QueueMonitor::IsEnabled()) {
+    queue->blockingRead(item);
+    return;
+  }
+  if (queue->read(item)) {
+    QueueMonitor::RecordRead(kKind, false, 0);
+    return;
+  }
+  const QueueMonitor::Clock::time_point kStart = QueueMonitor::Clock::now();
+  queue->blockingRead(item);
+  QueueMonitor::RecordRead(kKind, true, std::chrono::duration_cast<std::chrono::nanoseconds>(
+      QueueMonitor::Clock::now() - kStart).count());
+}
+
+// blockingWrite, counting the writes that had to wait. A failed write leaves item alone.
+template <typename T, typename U>
+void MonitoredWrite(folly::MPMCQueue<T> *queue, U&& item, const QueueKind kKind) {
+  if (!QueueMonitor::IsEnabled()) {
+    queue->blockingWrite(std::forward<U>(item));
+    return;
+  }
+  if (queue->write(std::forward<U>(item))) {
+    QueueMonitor::RecordWrite(kKind, false, 0);
+    return;
+  }
+  const QueueMonitor::Clock::time_point kStart = QueueMonitor::Clock::now();
+  queue->blockingWrite(std::forward<U>(item));
+  QueueMonitor::RecordWrite(kKind, true, std::chrono::duration_cast<std::chrono::nanoseconds>(
+      QueueMonitor::Clock::now() - kStart).count());
+}
+
+#endif // QUEUE_MONITOR_H_
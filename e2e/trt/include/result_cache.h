@@ -0,0 +1,64 @@
+#ifndef RESULT_CACHE_H_
+#define RESULT_CACHE_H_
+
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+// Output rows of one model, keyed by a hash of the compressed bytes and a config ID, so repeated
+// content skips decode and inference. Recently used rows stay in memory; with a disk path every
+// row is also written to a direct mapped table in an mmapped file that outlives the run.
+class ResultCache {
+ private:
+  struct DiskHeader {
+    uint64_t magic, config_id, output_single, nb_slots;
+  };
+
+  const size_t kOutputSingle_;
+  // Everything besides the bytes that changes the output: model, loader, resolution
+  const uint64_t kConfigId_;
+  const size_t kMemEntries_;
+
+  std::mutex mutex_;
+  // Most recent first. Rows live in mem_rows_ at entry.second * kOutputSingle_.
+  std::list<std::pair<uint64_t, size_t> > lru_;
+  std::unordered_map<uint64_t, std::list<std::pair<uint64_t, size_t> >::iterator> mem_index_;
+  std::vector<float> mem_rows_;
+
+  // Slot i holds a key, 0 when empty, then kOutputSingle_ floats
+  size_t nb_disk_slots_ = 0;
+  size_t disk_size_ = 0;
+  int fd_ = -1;
+  uint8_t *disk_ = NULL;
+
+  size_t nb_mem_hits_ = 0, nb_disk_hits_ = 0, nb_misses_ = 0;
+
+  uint8_t *DiskSlot(const uint64_t kKey) const;
+  // Must hold mutex_
+  void PutMem(const uint64_t kKey, const float *kOutput);
+
+ public:
+  ResultCache(const size_t kOutputSingle, const uint64_t kConfigId, const size_t kMemEntries,
+              const std::string& kDiskPath = "", const size_t kDiskEntries = 0);
+  ~ResultCache();
+
+  // 64-bit MurmurHash2, 8 bytes at a time
+  static uint64_t Hash(const void *kData, const size_t kLen, const uint64_t kSeed = 0);
+
+  // Never 0
+  uint64_t Key(const CompressedImage& kImage) const;
+  // Copies the row to output on a hit
+  bool Get(const uint64_t kKey, float *output);
+  void Put(const uint64_t kKey, const float *kOutput);
+
+  size_t GetNbMemHits() const { return nb_mem_hits_; }
+  size_t GetNbDiskHits() const { return nb_disk_hits_; }
+  size_t GetNbMisses() const { return nb_misses_; }
+};
+
+#endif // RESULT_CACHE_H_
@@ -340,6 +340,13 @@ SPNG_API int spng_decoded_image_size(spng_ctx *ctx, int fmt, size_t *out);
 
 SPNG_API int spng_decode_image(spng_ctx *ctx, unsigned char *out, size_t out_size, int fmt, int flags);
 
+/* Adam7 partial decodes: stop after pass last_pass (0-6) and emit the
+   image on the grid completed so far, e.g. 1/8 scale after pass 0,
+   1/4 after pass 2 and 1/2 after pass 4. Non-interlaced images are
+   always decoded in full. */
+SPNG_API int spng_decoded_reduced_size(spng_ctx *ctx, int fmt, int last_pass, size_t *out, uint32_t *width, uint32_t *height);
+SPNG_API int spng_decode_image_reduced(spng_ctx *ctx, unsigned char *out, size_t out_size, int fmt, int flags, int last_pass);
+
 SPNG_API int spng_get_ihdr(spng_ctx *ctx, struct spng_ihdr *ihdr);
 SPNG_API int spng_get_plte(spng_ctx *ctx, struct spng_plte *plte);
 SPNG_API int spng_get_trns(spng_ctx *ctx, struct spng_trns *trns);
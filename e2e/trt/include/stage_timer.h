@@ -0,0 +1,139 @@
+#ifndef STAGE_TIMER_H_
+#define STAGE_TIMER_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <stdint.h>
+
+#include "live_metrics.h"
+#include "perf_counters.h"
+#include "tracer.h"
+
+enum class TimedStage : size_t {
+  Read,
+  Decode,
+  // Includes the crop
+  Resize,
+  // Includes the split into planes
+  Normalize,
+  // Decode threads waiting for a free input buffer
+  BatchWait,
+  // Batches queued for an inference stream
+  InferQueueWait,
+  // Copies to and from the device included
+  Infer,
+  NbStages
+};
+
+const char *GetStageName(const TimedStage kStage);
+
+// Log-linear buckets as in HdrHistogram: values below 2^kSubBits_ are exact, and above that every
+// power of two is split into 2^kSubBits_ buckets, so values are kept to within 1/16
+class LatencyHistogram {
+ private:
+  static const size_t kSubBits_ = 4;
+  static const size_t kSubBuckets_ = 1 << kSubBits_;
+  static const size_t kNbBuckets_ = (64 - kSubBits_ + 1) * kSubBuckets_;
+
+  std::array<uint64_t, kNbBuckets_> counts_{};
+  uint64_t count_ = 0, sum_ = 0, min_ = UINT64_MAX, max_ = 0;
+
+  static size_t GetBucket(const uint64_t kValue);
+  static uint64_t GetLowerBound(const size_t kBucket);
+
+ public:
+  void Record(const uint64_t kValue);
+  void Merge(const LatencyHistogram& kOther);
+
+  // kPercentile in [0, 100], as the middle of the bucket that holds it
+  uint64_t GetPercentile(const double kPercentile) const;
+  uint64_t GetCount() const { return count_; }
+  uint64_t GetSum() const { return sum_; }
+  uint64_t GetMin() const { return count_ == 0 ? 0 : min_; }
+  uint64_t GetMax() const { return max_; }
+};
+
+// Nanosecond histograms of every stage, per thread so that recording takes no locks. They are
+// merged when reported, which must happen once the threads are idle.
+class StageTimers {
+ private:
+  static std::atomic<bool> enabled_;
+
+ public:
+  static void Enable(const bool kEnabled) { enabled_.store(kEnabled, std::memory_order_relaxed); }
+  static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  static void Record(const TimedStage kStage, const uint64_t kNanos);
+  // Into the histograms, the trace and the live busy times, whichever are enabled
+  static void RecordSpan(const TimedStage kStage, const Tracer::Clock::time_point kStart,
+                         const Tracer::Clock::time_point kEnd);
+  // Hardware counts of one span, kept per stage while PerfCounters is enabled
+  static void RecordCounts(const TimedStage kStage, const PerfCounts& kCounts);
+  static void Reset();
+  static LatencyHistogram GetMerged(const TimedStage kStage);
+  static PerfCounts GetMergedCounts(const TimedStage kStage);
+  // One object per stage with its count, total and percentiles in microseconds, plus the
+  // hardware counts when they were on
+  static void WriteJson(std::ostream& os);
+  // IPC, and cycles and misses per image, of every stage with counts
+  static void PrintCounters(std::ostream& os, const size_t kNbImages);
+};
+
+// Times consecutive stages of one thread: Next ends the current stage and starts another, and
+// Stop or the destructor ends the last. Does nothing unless StageTimers, the Tracer,
+// PerfCounters or LiveMetrics is enabled.
+class StageTimer {
+ private:
+  typedef Tracer::Clock Clock;
+
+  const bool kCounted_;
+  const bool kEnabled_;
+  TimedStage stage_;
+  Clock::time_point start_;
+  PerfCounts counts_;
+  bool running_;
+
+  void Record(const Clock::time_point kNow, const PerfCounts& kCounts) {
+    StageTimers::RecordSpan(stage_, start_, kNow);
+    if (kCounted_)
+      StageTimers::RecordCounts(stage_, (kCounts - counts_).Scaled());
+  }
+
+ public:
+  explicit StageTimer(const TimedStage kStage) :
+      kCounted_(PerfCounters::IsEnabled()),
+      kEnabled_(kCounted_ || StageTimers::IsEnabled() || Tracer::IsEnabled() ||
+                LiveMetrics::IsEnabled()),
+      stage_(kStage), running_(kEnabled_) {
+    if (kCounted_)
+      counts_ = PerfCounters::Read();
+    if (kEnabled_)
+      start_ = Clock::now();
+  }
+  ~StageTimer() { Stop(); }
+
+  void Stop() {
+    if (!running_)
+      return;
+    const Clock::time_point kNow = Clock::now();
+    Record(kNow, kCounted_ ? PerfCounters::Read() : PerfCounts());
+    running_ = false;
+  }
+
+  void Next(const TimedStage kStage) {
+    if (!kEnabled_)
+      return;
+    const Clock::time_point kNow = Clock::now();
+    const PerfCounts kCounts = kCounted_ ? PerfCounters::Read() : PerfCounts();
+    if (running_)
+      Record(kNow, kCounts);
+    stage_ = kStage;
+    start_ = kNow;
+    counts_ = kCounts;
+    running_ = true;
+  }
+};
+
+#endif // STAGE_TIMER_H_
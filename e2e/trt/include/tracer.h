@@ -0,0 +1,55 @@
+#ifndef TRACER_H_
+#define TRACER_H_
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string>
+
+// Chrome / Perfetto trace of complete events ("ph": "X"). Every thread records into its own ring,
+// so recording takes no locks; a full ring overwrites its oldest events. The rings are read when
+// the trace is written, which must happen once the threads are idle.
+class Tracer {
+ public:
+  typedef std::chrono::steady_clock Clock;
+  static const int64_t kNoArg = -1;
+
+ private:
+  static std::atomic<bool> enabled_;
+
+ public:
+  // Starts a new trace, dropping earlier events
+  static void Enable(const size_t kEventsPerThread);
+  static void Disable() { enabled_.store(false, std::memory_order_relaxed); }
+  static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  // kName must outlive the tracer. kArg shows up as args.n in the trace.
+  static void Record(const char *kName, const Clock::time_point kStart,
+                     const Clock::time_point kEnd, const int64_t kArg = kNoArg);
+  // Defaults to omp-worker-<n> for threads first seen in an OpenMP team, else thread-<n>
+  static void SetThreadName(const std::string& kName);
+
+  static void WriteJson(const std::string& kPath);
+};
+
+// Records its lifetime as one event while the tracer is enabled
+class TraceSpan {
+ private:
+  const char *kName_;
+  const int64_t kArg_;
+  const bool kEnabled_;
+  Tracer::Clock::time_point start_;
+
+ public:
+  explicit TraceSpan(const char *kName, const int64_t kArg = Tracer::kNoArg) :
+      kName_(kName), kArg_(kArg), kEnabled_(Tracer::IsEnabled()) {
+    if (kEnabled_)
+      start_ = Tracer::Clock::now();
+  }
+  ~TraceSpan() {
+    if (kEnabled_)
+      Tracer::Record(kName_, start_, Tracer::Clock::now(), kArg_);
+  }
+};
+
+#endif // TRACER_H_
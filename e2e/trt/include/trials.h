@@ -0,0 +1,39 @@
+#ifndef TRIALS_H_
+#define TRIALS_H_
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Whether timed reads of the input files may hit the OS page cache
+enum class CacheMode {
+  // Whatever earlier reads left behind
+  Any,
+  // Every file is read once before each trial
+  Warm,
+  // Every file is dropped (posix_fadvise DONTNEED) before each trial
+  Cold
+};
+
+CacheMode ParseCacheMode(const std::string& kName);
+
+// Both only touch the clean pages of the files, so no root is needed. Dropping can't evict pages
+// other processes have mapped.
+void DropFromPageCache(const std::vector<std::string>& kPaths);
+void LoadIntoPageCache(const std::vector<std::string>& kPaths);
+
+struct TrialStats {
+  std::vector<float> runtimes;
+  float mean = 0, stddev = 0, min = 0;
+};
+
+// Runs kTrial, which returns its runtime in seconds, kNbTrials times in the same process. kPaths
+// are put in kMode before every trial, outside of its runtime.
+TrialStats RunTrials(const size_t kNbTrials, const CacheMode kMode,
+                     const std::vector<std::string>& kPaths, const std::function<float()>& kTrial);
+
+// Every runtime and their summary; nothing for a single trial, so one-shot runs print as before
+void PrintTrials(std::ostream& os, const TrialStats& kStats);
+
+#endif // TRIALS_H_
@@ -11,9 +11,14 @@
 #include "opencv2/imgproc/imgproc.hpp"
 
 #include "common.h"
+#include "pre_filter.h"
 #include "video_decoder.h"
 
 class VideoDataLoader {
+ public:
+  // Every GOP is decoded as this many frames
+  static const size_t kFramesPerGOP = 150;
+
  protected:
   const size_t kResizeDim_; // WARNING: UNUSED
   const size_t kModelInputDim_;
@@ -22,6 +27,15 @@ class VideoDataLoader {
 
   void InitDecoder() const;
 
+  // Frame layout NormalizeGOP expects from VideoDecoder
+  virtual PixelFormat GetDecodeFormat() const { return PixelFormat::PLANAR_RGB; }
+  // Normalizes kNbFrames decoded frames at kModelInputDim_ into output_buf
+  virtual void NormalizeGOP(const uint8_t *kDecoded, const size_t kNbFrames, float *output_buf) const {
+    throw std::invalid_argument("Loader doesn't support shared decodes");
+  }
+  // Whether NormalizeGOP is implemented
+  virtual bool CanShareDecode() const { return false; }
+
  public:
   VideoDataLoader(const size_t kResizeDim, const size_t kModelInputDim,
                   const CropRegion region, const LoaderCondition cond) :
@@ -30,6 +44,9 @@ class VideoDataLoader {
   ~VideoDataLoader() {}
 
   size_t GetResol() const { return kModelInputDim_; }
+  // Planes written per frame by PreprocessGOP
+  virtual size_t GetNbChannels() const { return 3; }
+  size_t GetImSize() const { return GetNbChannels() * kModelInputDim_ * kModelInputDim_; }
 
   CompressedImage LoadCompressedImageFromFile(const std::string& kFileName) const;
 
@@ -37,6 +54,24 @@ class VideoDataLoader {
   virtual void PreprocessGOP(const std::vector<cv::Mat>& kRawGOP, float *output_buf) const = 0;
 
   virtual void DecodeAndPreprocessGOP(const std::string& kFileName, float *output_buf) const = 0;
+
+  // Like DecodeAndPreprocessGOP, but also runs kFilter on every decoded frame. The GOP isn't
+  // normalized if no frame passes.
+  void FilterAndPreprocessGOP(const std::string& kFileName, float *output_buf,
+                              const PreFilter& kFilter, std::vector<bool> *accepted) const {
+    DecodeAndPreprocessGOPs({this}, kFileName, &output_buf, &kFilter, accepted);
+  }
+
+  // Decodes kFileName once and scales each frame to every loader's resolution, then preprocesses
+  // for kLoaders[i] into output_bufs[i]. The loaders must share the crop, condition and decode
+  // format, which callers check once with CheckSharedDecode. With a filter, accepted gets one flag
+  // per frame, computed at kLoaders[0]'s resolution.
+  static void DecodeAndPreprocessGOPs(
+      const std::vector<const VideoDataLoader *>& kLoaders, const std::string& kFileName,
+      float *const *output_bufs, const PreFilter *kFilter = NULL,
+      std::vector<bool> *accepted = NULL);
+  // Throws unless kLoaders can go through DecodeAndPreprocessGOPs together
+  static void CheckSharedDecode(const std::vector<const VideoDataLoader *>& kLoaders);
 };
 
 
@@ -45,6 +80,10 @@ class OptimizedVidDataLoader : public VideoDataLoader {
  private:
   float map_[3][256];
 
+ protected:
+  void NormalizeGOP(const uint8_t *kDecoded, const size_t kNbFrames, float *output_buf) const;
+  bool CanShareDecode() const { return true; }
+
  public:
   OptimizedVidDataLoader(
       const size_t kResizeDim, const size_t kModelInputDim,
@@ -65,6 +104,35 @@ class OptimizedVidDataLoader : public VideoDataLoader {
   void DecodeAndPreprocessGOP(const std::string& kFileName, float *output_buf) const;
 };
 
+// Scales only the luma plane of each frame and writes one normalized plane per frame
+class GrayVidDataLoader : public VideoDataLoader {
+ private:
+  float map_[256];
+
+ protected:
+  PixelFormat GetDecodeFormat() const { return PixelFormat::GRAY; }
+  void NormalizeGOP(const uint8_t *kDecoded, const size_t kNbFrames, float *output_buf) const;
+  bool CanShareDecode() const { return true; }
+
+ public:
+  GrayVidDataLoader(
+      const size_t kResizeDim, const size_t kModelInputDim,
+      const CropRegion region, const LoaderCondition cond) :
+      VideoDataLoader(kResizeDim, kModelInputDim, region, cond) {
+    // Averages of the RGB means and stds
+    const float kMean = 0.449, kStd = 0.226;
+    for (size_t j = 0; j < 256; j++)
+      map_[j] = (j / 255.0 - kMean) / kStd;
+  }
+
+  size_t GetNbChannels() const { return 1; }
+
+  std::vector<cv::Mat> DecodeGOP(const std::string& kFileName) const;
+  void PreprocessGOP(const std::vector<cv::Mat>& kRawGOP, float *output_buf) const;
+
+  void DecodeAndPreprocessGOP(const std::string& kFileName, float *output_buf) const;
+};
+
 class NaiveVidDataLoader : public VideoDataLoader {
  public:
   using VideoDataLoader::VideoDataLoader;
@@ -45,8 +45,10 @@ class VideoDecoder {
 
   const enum AVPixelFormat dst_pix_fmt_;
   const bool kPlanar_;
-  const int kOutWidth_, kOutHeight_;
-  struct SwsContext *sws_ctx_ = NULL;
+  const size_t kNbChannels_;
+  // Every output resolution is scaled from the same decoded and cropped frame
+  const std::vector<int> kOutResols_;
+  std::vector<struct SwsContext *> sws_ctxs_;
 
  public:
   // IMPORTANT: The caller is responsible for all the files to have the same
@@ -56,12 +58,21 @@ class VideoDecoder {
       const size_t kOutputResol, const size_t kNbFrames,
       CropRegion region, LoaderCondition cond,
       const bool kDoResize = true);
+  VideoDecoder(
+      const std::string& kFname, const enum PixelFormat dst_pfmt,
+      const std::vector<size_t>& kOutputResols, const size_t kNbFrames,
+      CropRegion region, LoaderCondition cond,
+      const bool kDoResize = true);
   ~VideoDecoder();
   void InitLookup();
 
-  void ProcessFrame(cv::Mat *converted);
-  void DecodePacket(AVPacket *pkt, std::vector<cv::Mat> &return_frames);
+  // converted[i] receives the frame at kOutputResols[i]
+  void ProcessFrame(const std::vector<cv::Mat *>& converted);
+  // return_frames[i][frame]
+  void DecodePacket(AVPacket *pkt, std::vector<std::vector<cv::Mat> > &return_frames);
   void DecodeAll(uint8_t *output);
+  // outputs[i] receives kNbFrames frames at kOutputResols[i]
+  void DecodeAll(const std::vector<uint8_t *>& outputs);
 };
 
 #endif // VIDEO_DECODER_H_
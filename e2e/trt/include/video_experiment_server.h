@@ -1,12 +1,17 @@
 #ifndef VIDEO_EXPERIMENT_SERVER_H_
 #define VIDEO_EXPERIMENT_SERVER_H_
 
+#include <atomic>
+
 #include "folly/MPMCQueue.h"
 #include "omp.h"
 
 #include "video_data_loader.h"
 #include "inference_server.h"
+#include "output_sink.h"
+#include "pre_filter.h"
 #include "common.h"
+#include "queue_monitor.h"
 
 class VideoExperimentServer {
  private:
@@ -16,27 +21,39 @@ class VideoExperimentServer {
   const size_t kImSize_;
   const size_t kOutputSingle_;
   folly::MPMCQueue<Batch> batch_queue_;
+  const QueueRegistration kBatchQueueRegistration_;
 
   const bool kRunInfer_;
+  // Frames it drops get its default prediction, and GOPs with no frame left skip inference
+  const PreFilter *kPreFilter_;
+  std::atomic<size_t> nb_dropped_;
 
  public:
   VideoExperimentServer(const VideoDataLoader& kLoader, InferenceServer *kInfer,
-                        const size_t kBatchSize, const bool kRunInfer) :
+                        const size_t kBatchSize, const bool kRunInfer,
+                        const PreFilter *kPreFilter = NULL) :
       kLoader_(kLoader), kInfer_(kInfer), kBatchSize_(kBatchSize),
-      kImSize_(3 * kLoader.GetResol() * kLoader.GetResol()),
+      kImSize_(kLoader.GetImSize()),
       kOutputSingle_(kInfer->GetOutputSingle()),
       batch_queue_(omp_get_max_threads() * 3),
-      kRunInfer_(kRunInfer) {
+      kBatchQueueRegistration_(QueueKind::Batch, &batch_queue_),
+      kRunInfer_(kRunInfer), kPreFilter_(kPreFilter), nb_dropped_(0) {
     for (size_t i = 0; i < omp_get_max_threads() * 3; i++) {
       batch_queue_.blockingWrite(
           std::make_unique<BatchBase>(kBatchSize_ * kImSize_));
     }
   }
 
+  // With a sink, each GOP's rows go to it once the batch is done and output may be NULL;
+  // otherwise output must hold every GOP's rows
   void RunInferenceOnFiles(
       const std::vector<std::string>& kFileNames,
-      std::vector<float> *output);
+      std::vector<float> *output, OutputSink *sink = NULL);
   std::pair<float, std::vector<float> > TimeEndToEnd(const std::vector<std::string>& kFileNames);
+  float TimeEndToEnd(const std::vector<std::string>& kFileNames, OutputSink *sink);
+
+  // Frames dropped by the pre-filter so far
+  size_t GetNbDropped() const { return nb_dropped_; }
 };
 
 #endif // VIDEO_EXPERIMENT_SERVER_H_
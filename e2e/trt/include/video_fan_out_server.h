@@ -0,0 +1,41 @@
+#ifndef VIDEO_FAN_OUT_SERVER_H_
+#define VIDEO_FAN_OUT_SERVER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "folly/MPMCQueue.h"
+#include "omp.h"
+
+#include "common.h"
+#include "inference_server.h"
+#include "queue_monitor.h"
+#include "video_data_loader.h"
+
+// Runs several models over the same videos, decoding every GOP once and scaling its frames to
+// each model's resolution. Every model's batch is one GOP.
+class VideoFanOutServer {
+ private:
+  const std::vector<const VideoDataLoader *> kLoaders_;
+  const std::vector<InferenceServer *> kInfers_;
+  const size_t kBatchSize_;
+  const bool kRunInfer_;
+  std::vector<std::unique_ptr<folly::MPMCQueue<Batch> > > batch_queues_;
+  std::vector<std::unique_ptr<QueueRegistration> > queue_registrations_;
+
+ public:
+  VideoFanOutServer(
+      const std::vector<const VideoDataLoader *>& kLoaders,
+      const std::vector<InferenceServer *>& kInfers,
+      const size_t kBatchSize, const bool kRunInfer);
+
+  // (*outputs)[i] receives the outputs of kInfers[i]
+  void RunInferenceOnFiles(
+      const std::vector<std::string>& kFileNames,
+      std::vector<std::vector<float> > *outputs);
+  std::pair<float, std::vector<std::vector<float> > > TimeEndToEnd(
+      const std::vector<std::string>& kFileNames);
+};
+
+#endif // VIDEO_FAN_OUT_SERVER_H_
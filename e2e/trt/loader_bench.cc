@@ -0,0 +1,370 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+
+#include "omp.h"
+#include "yaml-cpp/yaml.h"
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "include/data_loader.h"
+#include "include/video_data_loader.h"
+#include "include/stage_timer.h"
+
+// Times every loader on synthetic images, without engines or the runner. Every key is optional.
+//
+// sizes: [256, 512, 1024]  # short side of the generated 4:3 images
+// jpeg-qualities: [75, 95]
+// loaders: ["naive", "opt-jpg", "png"]  # default: all image loaders
+// conditions: ["decode-only", "all"]  # default: all but decode-crop
+// threads: [1, 4, 16]  # default: powers of two up to the OpenMP max, and the max
+// nb-images: 64
+// batch-size: 16
+// iterations: 5  # timed passes after a warmup, the median is reported
+// resize-dim: 256
+// input-dim: 224
+// output: "loader_bench.json"
+// baseline: "loader_bench_base.json"  # an earlier output to compare against
+// max-regression: 0.05  # fails when throughput drops by more than this fraction
+// video:  # only runs with this block
+//   data-path: "/path/to/gops"
+//   frames-per-gop: 150  # optional, the loaders always decode VideoDataLoader::kFramesPerGOP
+//   nb-files: 16
+//   loaders: ["opt", "naive", "gray"]
+//   crop: {xmin: 0, ymin: 0, xmax: 1280, ymax: 720}
+
+struct BenchResult {
+  std::string name;
+  std::string loader, format, condition;
+  size_t size, threads;
+  double images_per_s, pixels_per_s;
+  // Summed over threads, so it is CPU time per pixel
+  double stage_ns_per_pixel[(size_t) TimedStage::NbStages];
+};
+
+static const char *kImageLoaders[] = {
+  "naive", "opt-jpg", "gray-jpg", "dc-jpg", "batch-jpg", "png", "opt-png"
+};
+
+static bool IsPNGLoader(const std::string& kType) {
+  return kType == "png" || kType == "opt-png";
+}
+
+// Same names and loaders as the runner's data-loader key
+static DataLoader *MakeLoader(const std::string& kType, const size_t kResizeDim,
+                              const size_t kModelInputDim, const LoaderCondition cond) {
+  if (kType == "naive")
+    return new NaiveDataLoader(kResizeDim, kModelInputDim, true, cond);
+  else if (kType == "opt-jpg")
+    return new OptimizedDataLoader(kResizeDim, kModelInputDim, true, cond);
+  else if (kType == "gray-jpg")
+    return new GrayJPEGDataLoader(kResizeDim, kModelInputDim, true, cond);
+  else if (kType == "dc-jpg")
+    return new DCJPEGDataLoader(kResizeDim, kModelInputDim, true, cond);
+  else if (kType == "batch-jpg")
+    return new BatchedJPEGDataLoader(kResizeDim, kModelInputDim, true, cond);
+  else if (kType == "png")
+    return new PNGDataLoader(kResizeDim, kModelInputDim, true, cond);
+  else if (kType == "opt-png")
+    return new OptResizePNGDataLoader(kResizeDim, kModelInputDim, true, cond);
+  throw std::invalid_argument("Wrong loader type: " + kType);
+}
+
+static VideoDataLoader *MakeVideoLoader(const std::string& kType, const size_t kModelInputDim,
+                                        const CropRegion region, const LoaderCondition cond) {
+  if (kType == "opt")
+    return new OptimizedVidDataLoader(256, kModelInputDim, region, cond);
+  else if (kType == "naive")
+    return new NaiveVidDataLoader(256, kModelInputDim, region, cond);
+  else if (kType == "gray")
+    return new GrayVidDataLoader(256, kModelInputDim, region, cond);
+  throw std::invalid_argument("Wrong video loader type: " + kType);
+}
+
+// Smooth gradients with some noise, so the encoders see something like a photo
+static std::vector<uint8_t> MakeImage(const size_t kShortSide, const size_t kSeed,
+                                      const std::string& kExt, const int kQuality) {
+  const int kHeight = kShortSide, kWidth = kShortSide * 4 / 3;
+  cv::Mat image(kHeight, kWidth, CV_8UC3);
+  for (int y = 0; y < kHeight; y++) {
+    for (int x = 0; x < kWidth; x++) {
+      image.at<cv::Vec3b>(y, x) = cv::Vec3b(
+          (x * 255 / kWidth + kSeed * 37) % 256, (y * 255 / kHeight) % 256,
+          ((x + y) * 127 / kHeight + kSeed * 11) % 256);
+    }
+  }
+  cv::Mat noise(kHeight, kWidth, CV_8UC3);
+  cv::RNG rng(kSeed);
+  rng.fill(noise, cv::RNG::UNIFORM, 0, 24);
+  cv::GaussianBlur(noise, noise, cv::Size(3, 3), 0);
+  image += noise;
+
+  std::vector<uint8_t> encoded;
+  std::vector<int> params;
+  if (kExt == ".jpg")
+    params = {cv::IMWRITE_JPEG_QUALITY, kQuality};
+  cv::imencode(kExt, image, encoded, params);
+  return encoded;
+}
+
+static std::vector<size_t> GetThreadCounts(const YAML::Node& kCfg) {
+  if (kCfg)
+    return kCfg.as<std::vector<size_t> >();
+  const size_t kMax = omp_get_max_threads();
+  std::vector<size_t> threads;
+  for (size_t t = 1; t < kMax; t *= 2)
+    threads.push_back(t);
+  threads.push_back(kMax);
+  return threads;
+}
+
+// Runs kRun once untimed, kIterations times for the median wall time, then once more with the
+// stage timers on. Timers add two clock reads per stage, so they stay off in the timed passes.
+template <typename F>
+static BenchResult Measure(const F& kRun, const size_t kIterations, const size_t kNbImages,
+                           const double kPixels) {
+  kRun();
+  std::vector<double> times;
+  for (size_t i = 0; i < kIterations; i++) {
+    auto start = std::chrono::high_resolution_clock::now();
+    kRun();
+    auto end = std::chrono::high_resolution_clock::now();
+    times.push_back(std::chrono::duration<double>(end - start).count());
+  }
+  std::sort(times.begin(), times.end());
+  const double kTime = times[times.size() / 2];
+
+  StageTimers::Reset();
+  StageTimers::Enable(true);
+  kRun();
+  StageTimers::Enable(false);
+
+  BenchResult result;
+  result.images_per_s = kNbImages / kTime;
+  result.pixels_per_s = kPixels / kTime;
+  for (size_t s = 0; s < (size_t) TimedStage::NbStages; s++)
+    result.stage_ns_per_pixel[s] = StageTimers::GetMerged((TimedStage) s).GetSum() / kPixels;
+  return result;
+}
+
+static void WriteResults(const std::vector<BenchResult>& kResults, std::ostream& os) {
+  os << "{\"results\": [";
+  for (size_t i = 0; i < kResults.size(); i++) {
+    const BenchResult& kResult = kResults[i];
+    os << (i == 0 ? "" : ",") << "\n  {\"name\": \"" << kResult.name << "\""
+       << ", \"loader\": \"" << kResult.loader << "\""
+       << ", \"format\": \"" << kResult.format << "\""
+       << ", \"size\": " << kResult.size
+       << ", \"condition\": \"" << kResult.condition << "\""
+       << ", \"threads\": " << kResult.threads
+       << ", \"images-per-s\": " << kResult.images_per_s
+       << ", \"pixels-per-s\": " << kResult.pixels_per_s
+       << ", \"ns-per-pixel\": {";
+    bool first = true;
+    for (size_t s = 0; s < (size_t) TimedStage::NbStages; s++) {
+      if (kResult.stage_ns_per_pixel[s] == 0)
+        continue;
+      os << (first ? "" : ", ") << "\"" << GetStageName((TimedStage) s) << "\": "
+         << kResult.stage_ns_per_pixel[s];
+      first = false;
+    }
+    os << "}}";
+  }
+  os << "\n]}\n";
+}
+
+// JSON is YAML, so the baseline goes through the same parser as the config. Returns the number
+// of results more than kMaxRegression slower than the baseline.
+static size_t CompareToBaseline(const std::vector<BenchResult>& kResults,
+                                const std::string& kPath, const double kMaxRegression) {
+  const YAML::Node kBaseline = YAML::LoadFile(kPath)["results"];
+  std::map<std::string, double> baseline;
+  for (size_t i = 0; i < kBaseline.size(); i++)
+    baseline[kBaseline[i]["name"].as<std::string>()] = kBaseline[i]["images-per-s"].as<double>();
+
+  size_t nb_regressions = 0;
+  for (const BenchResult& kResult : kResults) {
+    auto it = baseline.find(kResult.name);
+    if (it == baseline.end())
+      continue;
+    const double kRatio = kResult.images_per_s / it->second;
+    const bool kRegressed = kRatio < 1 - kMaxRegression;
+    nb_regressions += kRegressed;
+    std::cout << (kRegressed ? "REGRESSION " : "") << kResult.name << ": "
+              << it->second << " -> " << kResult.images_per_s << " im/s (x" << kRatio << ")"
+              << std::endl;
+  }
+  return nb_regressions;
+}
+
+static std::vector<BenchResult> BenchImages(const YAML::Node& kCfg) {
+  const std::vector<size_t> kSizes = kCfg["sizes"] ?
+      kCfg["sizes"].as<std::vector<size_t> >() : std::vector<size_t>{256, 512, 1024};
+  const std::vector<int> kQualities = kCfg["jpeg-qualities"] ?
+      kCfg["jpeg-qualities"].as<std::vector<int> >() : std::vector<int>{75, 95};
+  const std::vector<std::string> kLoaders = kCfg["loaders"] ?
+      kCfg["loaders"].as<std::vector<std::string> >() :
+      std::vector<std::string>(std::begin(kImageLoaders), std::end(kImageLoaders));
+  const std::vector<std::string> kConditions = kCfg["conditions"] ?
+      kCfg["conditions"].as<std::vector<std::string> >() :
+      std::vector<std::string>{"decode-only", "decode-resize", "decode-resize-norm", "all"};
+  const std::vector<size_t> kThreads = GetThreadCounts(kCfg["threads"]);
+  const size_t kNbImages = kCfg["nb-images"] ? kCfg["nb-images"].as<size_t>() : 64;
+  const size_t kBatchSize = kCfg["batch-size"] ? kCfg["batch-size"].as<size_t>() : 16;
+  const size_t kIterations = kCfg["iterations"] ? kCfg["iterations"].as<size_t>() : 5;
+  const size_t kResizeDim = kCfg["resize-dim"] ? kCfg["resize-dim"].as<size_t>() : 256;
+  const size_t kModelInputDim = kCfg["input-dim"] ? kCfg["input-dim"].as<size_t>() : 224;
+
+  // PNG has no quality, and naive decodes either format
+  std::vector<std::pair<std::string, int> > formats;
+  for (const int kQuality : kQualities)
+    formats.emplace_back("jpeg-q" + std::to_string(kQuality), kQuality);
+  formats.emplace_back("png", 0);
+
+  std::vector<BenchResult> results;
+  for (const size_t kSize : kSizes) {
+    const double kPixels = kNbImages * (double) kSize * (kSize * 4 / 3);
+    for (const auto& kFormat : formats) {
+      const bool kIsPNG = kFormat.second == 0;
+      std::vector<std::vector<uint8_t> > encoded(kNbImages);
+      #pragma omp parallel for
+      for (size_t i = 0; i < kNbImages; i++)
+        encoded[i] = MakeImage(kSize, i, kIsPNG ? ".png" : ".jpg", kFormat.second);
+      std::vector<CompressedImage> compressed(kNbImages);
+      for (size_t i = 0; i < kNbImages; i++)
+        compressed[i] = CompressedImage(encoded[i].data(), encoded[i].size());
+
+      for (const std::string& kLoaderType : kLoaders) {
+        if (kLoaderType != "naive" && IsPNGLoader(kLoaderType) != kIsPNG)
+          continue;
+        for (const std::string& kCondition : kConditions) {
+          std::unique_ptr<DataLoader> loader(MakeLoader(
+              kLoaderType, kResizeDim, kModelInputDim, LoaderCondition::GetVal(kCondition)));
+          const size_t kImSize = loader->GetImSize();
+          for (const size_t kNbThreads : kThreads) {
+            std::vector<std::vector<float> > bufs(kNbThreads,
+                                                  std::vector<float>(kBatchSize * kImSize));
+            auto run = [&]() {
+              #pragma omp parallel for num_threads(kNbThreads)
+              for (size_t i = 0; i < kNbImages; i += kBatchSize) {
+                loader->DecodeAndPreprocBatch(compressed.data() + i,
+                                              std::min(kNbImages - i, kBatchSize),
+                                              bufs[omp_get_thread_num()].data());
+              }
+            };
+            BenchResult result = Measure(run, kIterations, kNbImages, kPixels);
+            result.loader = kLoaderType;
+            result.format = kFormat.first;
+            result.size = kSize;
+            result.condition = kCondition;
+            result.threads = kNbThreads;
+            result.name = kLoaderType + "/" + kFormat.first + "/" + std::to_string(kSize) + "/" +
+                kCondition + "/" + std::to_string(kNbThreads) + "t";
+            std::cout << result.name << ": " << result.images_per_s << " im/s, "
+                      << result.pixels_per_s / 1e6 << " Mpx/s" << std::endl;
+            results.push_back(result);
+          }
+        }
+      }
+    }
+  }
+  return results;
+}
+
+// GOP sizes aren't known up front, so pixels here are the frames written at input-dim
+static std::vector<BenchResult> BenchVideo(const YAML::Node& kCfg, const YAML::Node& kVideoCfg) {
+  namespace fs = std::experimental::filesystem;
+  const std::vector<std::string> kLoaders = kVideoCfg["loaders"] ?
+      kVideoCfg["loaders"].as<std::vector<std::string> >() :
+      std::vector<std::string>{"opt", "naive", "gray"};
+  const std::vector<std::string> kConditions = kCfg["conditions"] ?
+      kCfg["conditions"].as<std::vector<std::string> >() :
+      std::vector<std::string>{"decode-only", "decode-crop", "decode-resize", "all"};
+  const std::vector<size_t> kThreads = GetThreadCounts(kCfg["threads"]);
+  const size_t kIterations = kCfg["iterations"] ? kCfg["iterations"].as<size_t>() : 5;
+  const size_t kModelInputDim = kCfg["input-dim"] ? kCfg["input-dim"].as<size_t>() : 224;
+  const size_t kFramesPerGOP = VideoDataLoader::kFramesPerGOP;
+  if (kVideoCfg["frames-per-gop"] && kVideoCfg["frames-per-gop"].as<size_t>() != kFramesPerGOP)
+    throw std::invalid_argument("Video loaders decode " + std::to_string(kFramesPerGOP) +
+                                " frames per GOP");
+  const auto kCropCfg = kVideoCfg["crop"];
+  const CropRegion region(kCropCfg["xmin"].as<size_t>(), kCropCfg["ymin"].as<size_t>(),
+                          kCropCfg["xmax"].as<size_t>(), kCropCfg["ymax"].as<size_t>());
+
+  std::vector<std::string> paths;
+  for (const auto& kEntry : fs::directory_iterator(kVideoCfg["data-path"].as<std::string>()))
+    paths.push_back(kEntry.path().string());
+  std::sort(paths.begin(), paths.end());
+  if (kVideoCfg["nb-files"])
+    paths.resize(std::min(paths.size(), kVideoCfg["nb-files"].as<size_t>()));
+  if (paths.empty())
+    throw std::invalid_argument("No videos in video.data-path");
+  const double kPixels = paths.size() * kFramesPerGOP * (double) kModelInputDim * kModelInputDim;
+
+  std::vector<BenchResult> results;
+  for (const std::string& kLoaderType : kLoaders) {
+    for (const std::string& kCondition : kConditions) {
+      std::unique_ptr<VideoDataLoader> loader(MakeVideoLoader(
+          kLoaderType, kModelInputDim, region, LoaderCondition::GetVal(kCondition)));
+      for (const size_t kNbThreads : kThreads) {
+        std::vector<std::vector<float> > bufs(
+            kNbThreads, std::vector<float>(kFramesPerGOP * loader->GetImSize()));
+        auto run = [&]() {
+          #pragma omp parallel for num_threads(kNbThreads)
+          for (size_t i = 0; i < paths.size(); i++)
+            loader->DecodeAndPreprocessGOP(paths[i], bufs[omp_get_thread_num()].data());
+        };
+        BenchResult result = Measure(run, kIterations, paths.size() * kFramesPerGOP, kPixels);
+        result.loader = "video-" + kLoaderType;
+        result.format = "video";
+        result.size = kModelInputDim;
+        result.condition = kCondition;
+        result.threads = kNbThreads;
+        result.name = result.loader + "/video/" + kCondition + "/" + std::to_string(kNbThreads) + "t";
+        std::cout << result.name << ": " << result.images_per_s << " frames/s" << std::endl;
+        results.push_back(result);
+      }
+    }
+  }
+  return results;
+}
+
+int main(int argc, char *argv[]) {
+  assert(argc == 2);
+  YAML::Node cfg = YAML::LoadFile(argv[1]);
+  std::cout << "Using config file: " << argv[1] << std::endl;
+
+  std::vector<BenchResult> results = BenchImages(cfg);
+  if (cfg["video"]) {
+    auto video_results = BenchVideo(cfg, cfg["video"]);
+    results.insert(results.end(), video_results.begin(), video_results.end());
+  }
+
+  const std::string kOutputPath = cfg["output"] ?
+      cfg["output"].as<std::string>() : "loader_bench.json";
+  std::ofstream fout(kOutputPath);
+  WriteResults(results, fout);
+  fout.close();
+  std::cout << "Wrote " << results.size() << " results to " << kOutputPath << std::endl;
+
+  if (cfg["baseline"]) {
+    const double kMaxRegression = cfg["max-regression"] ?
+        cfg["max-regression"].as<double>() : 0.05;
+    const size_t kNbRegressions = CompareToBaseline(
+        results, cfg["baseline"].as<std::string>(), kMaxRegression);
+    std::cout << kNbRegressions << " regressions against " << cfg["baseline"].as<std::string>()
+              << std::endl;
+    return kNbRegressions == 0 ? 0 : 1;
+  }
+  return 0;
+}
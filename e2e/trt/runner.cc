@@ -1,5 +1,8 @@
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <fstream>
+#include <numeric>
 #include <string>
 #include <tuple>
 #include <utility>
@@ -12,6 +15,17 @@
 #include "include/inference_server.h"
 #include "include/experiment_server.h"
 #include "include/criterion.h"
+#include "include/cascade_server.h"
+#include "include/image_cache.h"
+#include "include/live_metrics.h"
+#include "include/memory_stats.h"
+#include "include/fan_out_server.h"
+#include "include/pre_filter.h"
+#include "include/queue_monitor.h"
+#include "include/output_sink.h"
+#include "include/result_cache.h"
+#include "include/stage_timer.h"
+#include "include/trials.h"
 
 // Expects a validation directory as in pytorch
 std::vector<std::string> GetFileNames(const std::string& val_dir) {
@@ -46,6 +60,11 @@ std::vector<CompressedImage> GetCompressed(
   for (size_t i = 0; i < file_paths.size(); i++) {
     ret[i] = loader.LoadCompressedImageFromFile(file_paths[i]);
   }
+  // The multiplier's copies share the buffers
+  size_t bytes = 0;
+  for (const auto& kCompressed : ret)
+    bytes += kCompressed.second;
+  MemoryStats::Charge(MemoryOwner::Compressed, bytes);
   for (size_t k = 0; k < kMult - 1; k++) {
     for (size_t i = 0; i < file_paths.size(); i++)
       ret.push_back(ret[i]);
@@ -53,6 +72,65 @@ std::vector<CompressedImage> GetCompressed(
   return ret;
 }
 
+static void PrintAccuracy(const AccuracySink& kAccuracy, const std::string& kName = "") {
+  std::cerr << kName << "Top-1 accuracy: " << kAccuracy.GetTopK(1)
+            << ", top-5 accuracy: " << kAccuracy.GetTopK(5) << std::endl;
+}
+
+// Everything in a model's config that changes its outputs, plus the engine's mtime so a rebuilt
+// engine doesn't reuse old rows
+static uint64_t GetConfigId(const YAML::Node& kCfg, const std::string& kCond) {
+  namespace fs = std::experimental::filesystem;
+  std::string id = kCond;
+  for (const char *kKey : {"engine-path", "data-loader", "resize-dim", "input-dim", "do-resize",
+                           "do-int8", "dct-terms"}) {
+    if (kCfg[kKey])
+      id += std::string("|") + kKey + "=" + YAML::Dump(kCfg[kKey]);
+  }
+  const std::string kEnginePath = kCfg["engine-path"].as<std::string>();
+  if (fs::exists(kEnginePath))
+    id += "|" + std::to_string(fs::last_write_time(kEnginePath).time_since_epoch().count());
+  return ResultCache::Hash(id.data(), id.size());
+}
+
+static void PrintResultCache(const ResultCache *kResults, const size_t kStage) {
+  if (kResults == NULL)
+    return;
+  std::cerr << "Stage " << kStage << " result cache memory hits: " << kResults->GetNbMemHits()
+            << ", disk hits: " << kResults->GetNbDiskHits()
+            << ", misses: " << kResults->GetNbMisses() << std::endl;
+}
+
+// Milliseconds, for each latency of an online run
+static void PrintLatency(const LatencyHistogram& kHist, const std::string& kName) {
+  std::cerr << kName << " latency p50: " << kHist.GetPercentile(50) / 1e6
+            << ", p95: " << kHist.GetPercentile(95) / 1e6
+            << ", p99: " << kHist.GetPercentile(99) / 1e6
+            << ", p99.9: " << kHist.GetPercentile(99.9) / 1e6 << std::endl;
+}
+
+// Stage timings, the trace, the hardware counters, the memory use and the queue telemetry of
+// everything since they were enabled. The live metrics stop here.
+static void WriteTimings(const std::string& kPath, const std::string& kTracePath,
+                         const std::string& kQueuePath, const size_t kNbImages) {
+  LiveMetrics::Disable();
+  if (PerfCounters::IsEnabled())
+    StageTimers::PrintCounters(std::cerr, kNbImages);
+  if (MemoryStats::IsEnabled())
+    MemoryStats::Print(std::cerr, kNbImages);
+  if (!kPath.empty()) {
+    std::ofstream fout(kPath);
+    StageTimers::WriteJson(fout);
+  }
+  if (!kTracePath.empty())
+    Tracer::WriteJson(kTracePath);
+  if (QueueMonitor::IsEnabled()) {
+    QueueMonitor::Disable();
+    QueueMonitor::PrintSummary(std::cerr);
+    QueueMonitor::WriteJson(kQueuePath);
+  }
+}
+
 class InferenceConfig {
  public:
   std::string kDataPath_;
@@ -88,6 +166,7 @@ class InferenceConfig {
           kDoINT8, !kDoResize);
       for (size_t i = 0; i < compressed.size(); i++) {
         free(compressed[i].first);
+        MemoryStats::Charge(MemoryOwner::Compressed, -(int64_t) compressed[i].second);
       }
       compressed.erase(compressed.begin(), compressed.end());
     }
@@ -114,6 +193,110 @@ static std::vector<size_t> MaskToIndMap(const std::vector<bool>& mask) {
   return ret;
 }
 
+// The images kPreFilter keeps. Its decodes are part of the run, so every trial's runtime
+// includes *time, in seconds.
+static std::vector<size_t> RunPreFilter(const PreFilter& kPreFilter,
+                                        const std::vector<CompressedImage>& kImages,
+                                        float *time) {
+  const auto kStart = std::chrono::steady_clock::now();
+  std::vector<size_t> kept = MaskToIndMap(kPreFilter.FilterCompressed(kImages));
+  *time = std::chrono::duration<float>(std::chrono::steady_clock::now() - kStart).count();
+  std::cerr << "Pre-filter runtime: " << *time << std::endl;
+  return kept;
+}
+
+// NULL for "none", which ends the cascade at that stage
+static const Criterion *ParseCriterion(const YAML::Node& kCfg) {
+  auto crit_string = kCfg["name"].as<std::string>();
+  if (crit_string == "max") {
+    return new MaxCriterion(kCfg["param"].as<float>());
+  } else if (crit_string == "margin") {
+    return new MarginCriterion(kCfg["param"].as<float>());
+  } else if (crit_string == "entropy") {
+    return new EntropyCriterion(kCfg["param"].as<float>());
+  } else if (crit_string == "temperature") {
+    return new TemperatureCriterion(kCfg["param"].as<float>(), kCfg["temperature"].as<float>());
+  } else if (crit_string == "none") {
+    return NULL;
+  } else {
+    throw std::invalid_argument("Criterion wrong");
+  }
+}
+
+static void RunStreamingCascade(
+    const std::vector<InferenceConfig>& configs, const std::vector<const Criterion *>& kCriteria,
+    const std::vector<ResultCache *>& kResults, const size_t kMult, const size_t kCacheBytes,
+    const PreFilter *kPreFilter, const size_t kNbTrials, OutputSink *sink) {
+  // The stages can't be filtered ahead of time, so every stage loads every image. Stages on the
+  // same data share the compressed images, which also lets them share decodes.
+  std::vector<std::vector<CompressedImage> > compressed(configs.size());
+  std::vector<size_t> srcs(configs.size(), 0);
+  for (size_t i = 0; i < configs.size(); i++) {
+    while (srcs[i] < i && configs[srcs[i]].kDataPath_ != configs[i].kDataPath_)
+      srcs[i]++;
+    if (srcs[i] == i)
+      compressed[i] = GetCompressed(GetFileNames(configs[i].kDataPath_), *configs[i].loader, kMult);
+  }
+  std::cerr << "Loaded files from disk\n";
+
+  // Only the images that pass the pre-filter enter the cascade
+  const size_t kNbImages = compressed[0].size();
+  std::vector<size_t> kept;
+  std::unique_ptr<OutputSink> kept_sink;
+  float filter_time = 0;
+  if (kPreFilter != NULL) {
+    kept = RunPreFilter(*kPreFilter, compressed[0], &filter_time);
+    if (sink != NULL) {
+      const size_t kOutputSingle = configs[0].infer->GetOutputSingle();
+      std::vector<float> default_output(kOutputSingle);
+      kPreFilter->FillDefault(default_output.data(), kOutputSingle);
+      for (size_t k = 0; k < kNbImages; k++)
+        sink->WriteRow(k, default_output.data());
+      kept_sink.reset(new IndexedOutputSink(sink, kept));
+      sink = kept_sink.get();
+    }
+    std::cerr << "Pre-filter dropped images: " << kNbImages - kept.size() << std::endl;
+    for (auto& stage_compressed : compressed) {
+      if (stage_compressed.empty())
+        continue;
+      std::vector<CompressedImage> selected;
+      for (const size_t kIdx : kept)
+        selected.push_back(stage_compressed[kIdx]);
+      stage_compressed = std::move(selected);
+    }
+  }
+
+  std::vector<CascadeStage> stages;
+  for (size_t i = 0; i < configs.size(); i++) {
+    stages.push_back(CascadeStage{
+        configs[i].loader, configs[i].infer, configs[i].kBatchSize_, &compressed[srcs[i]],
+        kCriteria[i], kResults[i]});
+  }
+
+  // Every trial starts from an empty decode cache; the counts are the last trial's
+  std::unique_ptr<ImageCache> cache;
+  std::unique_ptr<CascadeServer> server;
+  const TrialStats kTrials = RunTrials(kNbTrials, CacheMode::Any, {}, [&]() {
+    server.reset();
+    if (kCacheBytes > 0)
+      cache.reset(new ImageCache(kCacheBytes));
+    server.reset(new CascadeServer(stages, cache.get()));
+    return server->TimeNoLoad(sink) + filter_time;
+  });
+  PrintTrials(std::cerr, kTrials);
+  std::cerr << "Runtime: " << kTrials.mean << std::endl;
+  const auto kNbProcessed = server->GetNbProcessed();
+  for (size_t i = 0; i < kNbProcessed.size(); i++) {
+    std::cerr << "Stage " << i << " images: " << kNbProcessed[i] << std::endl;
+    PrintResultCache(kResults[i], i);
+  }
+  if (cache) {
+    std::cerr << "Decode cache hits: " << cache->GetNbHits()
+              << ", misses: " << cache->GetNbMisses()
+              << ", dropped: " << cache->GetNbDropped() << std::endl;
+  }
+}
+
 int main(int argc, char *argv[]) {
   // auto paths = GetFileNames("/lfs/1/ddkang/vision-inf/data/imagenet/val/");
   // auto paths = GetFileNames("/lfs/1/ddkang/vision-inf/data/in-small-jpeg-75/val/");
@@ -132,7 +315,59 @@ int main(int argc, char *argv[]) {
   const bool kRunInfer = cfg["experiment-config"]["run-infer"].as<bool>();
   const bool kDoMemcpy = cfg["infer-config"]["do-memcpy"].as<bool>();
   const size_t kMult = cfg["experiment-config"]["multiplier"].as<size_t>();
+  const bool kStreamingCascade = cfg["experiment-config"]["streaming-cascade"] ?
+      cfg["experiment-config"]["streaming-cascade"].as<bool>() : false;
+  // Budget for stage 0 decodes kept for later stages, 0 disables the cache
+  const size_t kCacheBytes = cfg["experiment-config"]["decode-cache-mb"] ?
+      cfg["experiment-config"]["decode-cache-mb"].as<size_t>() << 20 : 0;
+  // Scores the final predictions against the data directory's classes
+  const bool kComputeAcc = cfg["experiment-config"]["compute-accuracy"] ?
+      cfg["experiment-config"]["compute-accuracy"].as<bool>() : false;
+  // Rows of content a model already ran on, in memory and optionally in one file per model
+  const YAML::Node kResultCfg = cfg["experiment-config"]["result-cache"];
+  // Per stage histograms, written as JSON at the end of the run
+  const std::string kTimingPath = cfg["experiment-config"]["timing-json"] ?
+      cfg["experiment-config"]["timing-json"].as<std::string>() : "";
+  // Chrome trace of every timed stage and batch, keeping the latest events of each thread
+  const std::string kTracePath = cfg["experiment-config"]["trace-json"] ?
+      cfg["experiment-config"]["trace-json"].as<std::string>() : "";
+  const size_t kTraceEvents = cfg["experiment-config"]["trace-events-per-thread"] ?
+      cfg["experiment-config"]["trace-events-per-thread"].as<size_t>() : 1 << 16;
+  // Cycles, instructions, LLC and branch misses per stage, from perf_event_open
+  const bool kPerfCounters = cfg["experiment-config"]["perf-counters"] ?
+      cfg["experiment-config"]["perf-counters"].as<bool>() : false;
+  // Occupancy of the batch and inference queues sampled every queue-sample-us, and how often
+  // their reads starved and writes blocked
+  const std::string kQueuePath = cfg["experiment-config"]["queue-json"] ?
+      cfg["experiment-config"]["queue-json"].as<std::string>() : "";
+  const std::chrono::microseconds kQueuePeriod(cfg["experiment-config"]["queue-sample-us"] ?
+      cfg["experiment-config"]["queue-sample-us"].as<size_t>() : 1000);
+  const size_t kQueueSamples = cfg["experiment-config"]["queue-max-samples"] ?
+      cfg["experiment-config"]["queue-max-samples"].as<size_t>() : 1 << 20;
+  // Peak RSS, bytes per owner, and malloc calls per image
+  const bool kMemoryStats = cfg["experiment-config"]["memory-stats"] ?
+      cfg["experiment-config"]["memory-stats"].as<bool>() : false;
+  // Unix socket a local scraper can poll for progress while the run goes on
+  const std::string kMetricsSocket = cfg["experiment-config"]["metrics-socket"] ?
+      cfg["experiment-config"]["metrics-socket"].as<std::string>() : "";
+  // Timed runs in this process, after a single load and warmup; runtimes are their mean
+  const size_t kNbTrials = cfg["experiment-config"]["trials"] ?
+      cfg["experiment-config"]["trials"].as<size_t>() : 1;
+  // Page cache state of the inputs before each trial that reads them
+  const CacheMode kCacheMode = ParseCacheMode(cfg["experiment-config"]["cache-mode"] ?
+      cfg["experiment-config"]["cache-mode"].as<std::string>() : "any");
+  if (kCacheMode != CacheMode::Any &&
+      (!kTimeLoad || cfg["experiment-type"].as<std::string>() != "full"))
+    throw std::invalid_argument("Cache modes need a full experiment with time-load on");
+  // Every trial after the first would be served from the rows the first one cached
+  if (kNbTrials > 1 && kResultCfg)
+    throw std::invalid_argument("Trials can't be repeated with the result cache on");
 
+  // Each stage's criterion picks the images that go on to the next stage; stages without one
+  // use the top level criterion
+  const Criterion *default_criterion = ParseCriterion(cfg["criterion"]);
+  std::vector<const Criterion *> criteria;
+  std::vector<ResultCache *> results;
   std::vector<InferenceConfig> configs;
   auto model_cfg = cfg["model-config"];
   std::string cond_str = cfg["experiment-config"]["exp-type"].as<std::string>();
@@ -150,6 +385,13 @@ int main(int argc, char *argv[]) {
       loader = new NaiveDataLoader(kResizeDim, kModelInputDim, kDoResize, cond);
     } else if (loader_type == "opt-jpg") {
       loader = new OptimizedDataLoader(kResizeDim, kModelInputDim, kDoResize, cond);
+    } else if (loader_type == "gray-jpg") {
+      loader = new GrayJPEGDataLoader(kResizeDim, kModelInputDim, kDoResize, cond);
+    } else if (loader_type == "dc-jpg") {
+      const size_t kNbTerms = cfg_single["dct-terms"] ? cfg_single["dct-terms"].as<size_t>() : 1;
+      loader = new DCJPEGDataLoader(kResizeDim, kModelInputDim, kDoResize, cond, kNbTerms);
+    } else if (loader_type == "batch-jpg") {
+      loader = new BatchedJPEGDataLoader(kResizeDim, kModelInputDim, kDoResize, cond);
     } else if (loader_type == "png") {
       loader = new PNGDataLoader(256, kModelInputDim, kDoResize, cond);
     } else if (loader_type == "opt-png") {
@@ -158,6 +400,8 @@ int main(int argc, char *argv[]) {
       throw std::invalid_argument("Wrong loader type");
     }
 
+    criteria.push_back(cfg_single["criterion"] ?
+                       ParseCriterion(cfg_single["criterion"]) : default_criterion);
     configs.push_back(
         InferenceConfig(
             cfg_single["data-path"].as<std::string>(),
@@ -170,89 +414,258 @@ int main(int argc, char *argv[]) {
             loader,
             kDoResize,
             cfg_single["do-int8"].as<bool>()));
+    // The engine exists by now
+    results.push_back(NULL);
+    if (kResultCfg) {
+      const uint64_t kConfigId = GetConfigId(cfg_single, cond_str);
+      const std::string kDiskDir = kResultCfg["disk-dir"] ?
+          kResultCfg["disk-dir"].as<std::string>() : "";
+      results.back() = new ResultCache(
+          configs.back().infer->GetOutputSingle(), kConfigId,
+          kResultCfg["memory-entries"] ? kResultCfg["memory-entries"].as<size_t>() : 1 << 16,
+          kDiskDir.empty() ? "" : kDiskDir + "/" + std::to_string(kConfigId) + ".results",
+          kResultCfg["disk-entries"] ? kResultCfg["disk-entries"].as<size_t>() : 1 << 20);
+    }
   }
 
-  if (cfg["experiment-type"].as<std::string>() != "full") {
+  // Engines are built and warmed up by now
+  StageTimers::Enable(!kTimingPath.empty());
+  if (kMemoryStats)
+    MemoryStats::Enable();
+  if (!kQueuePath.empty())
+    QueueMonitor::Enable(kQueuePeriod, kQueueSamples);
+  if (!kMetricsSocket.empty())
+    LiveMetrics::Enable(kMetricsSocket);
+  if (!kTracePath.empty())
+    Tracer::Enable(kTraceEvents);
+  if (kPerfCounters) {
+    const std::string kError = PerfCounters::Enable();
+    if (!kError.empty())
+      std::cerr << "Hardware counters are off, " << kError << std::endl;
+  }
+
+  // Every model runs over the first model's images, each image decoded once for all of them
+  if (cfg["experiment-type"].as<std::string>() == "fan-out") {
+    std::vector<const DataLoader *> loaders;
+    std::vector<InferenceServer *> infers;
+    for (const auto& config : configs) {
+      if (config.kBatchSize_ != configs[0].kBatchSize_)
+        throw std::invalid_argument("Fan-out models need the same batch size");
+      loaders.push_back(config.loader);
+      infers.push_back(config.infer);
+    }
+    FanOutExperimentServer server(loaders, infers, configs[0].kBatchSize_);
+    auto compressed_images = GetCompressed(
+        GetFileNames(configs[0].kDataPath_), *configs[0].loader, kMult);
+    std::cerr << "Loaded files from disk\n";
+    std::vector<std::vector<float> > outputs;
+    const TrialStats kTrials = RunTrials(kNbTrials, kCacheMode, {}, [&]() {
+      float time;
+      std::tie(time, outputs) = server.TimeNoLoad(compressed_images);
+      return time;
+    });
+    PrintTrials(std::cerr, kTrials);
+    std::cerr << "Runtime: " << kTrials.mean << std::endl;
+    if (kComputeAcc) {
+      const auto kLabels = GetLabels(configs[0].kDataPath_);
+      for (size_t i = 0; i < outputs.size(); i++) {
+        const size_t kOutputSingle = infers[i]->GetOutputSingle();
+        AccuracySink accuracy(kLabels, compressed_images.size(), kOutputSingle);
+        accuracy.Write(0, outputs[i].data(), compressed_images.size(), kOutputSingle);
+        PrintAccuracy(accuracy, "Model " + std::to_string(i) + " ");
+      }
+    }
+    if (kWriteOut) {
+      for (size_t i = 0; i < outputs.size(); i++) {
+        std::ofstream fout("preds_" + std::to_string(i) + ".out", std::ios::out | std::ios::binary);
+        fout.write((char *) outputs[i].data(), outputs[i].size() * sizeof(float));
+        fout.close();
+      }
+    }
+    WriteTimings(kTimingPath, kTracePath, kQueuePath, compressed_images.size() * kNbTrials);
+    return 0;
+  }
+
+  // Images arrive one at a time at a fixed mean rate, and each is timed from its arrival
+  if (cfg["experiment-type"].as<std::string>() == "online") {
+    const YAML::Node kOnlineCfg = cfg["experiment-config"]["online"];
+    if (!kOnlineCfg || !kOnlineCfg["arrival-rate"])
+      throw std::invalid_argument("Online runs need online.arrival-rate");
+    const double kArrivalRate = kOnlineCfg["arrival-rate"].as<double>();
+    auto compressed_images = GetCompressed(
+        GetFileNames(configs[0].kDataPath_), *configs[0].loader, kMult);
+    std::cerr << "Loaded files from disk\n";
+    const size_t kNbRequests = kOnlineCfg["nb-requests"] ?
+        kOnlineCfg["nb-requests"].as<size_t>() : compressed_images.size();
+    const std::chrono::microseconds kMaxBatchDelay(kOnlineCfg["max-batch-delay-us"] ?
+        kOnlineCfg["max-batch-delay-us"].as<size_t>() : 1000);
+    const uint64_t kSeed = kOnlineCfg["seed"] ? kOnlineCfg["seed"].as<uint64_t>() : 0;
+
     ExperimentServer server(*configs[0].loader, configs[0].infer,
                             configs[0].kBatchSize_, kRunInfer);
-    float time = server.TimeInferenceOnly();
-    std::cerr << "Runtime: " << time << std::endl;
+    // Latencies are over the requests of every trial
+    std::vector<float> output;
+    LatencyHistogram queue, total;
+    const TrialStats kTrials = RunTrials(kNbTrials, kCacheMode, {}, [&]() {
+      const ServingStats kStats = server.ServeOnline(
+          compressed_images, kNbRequests, kArrivalRate, kMaxBatchDelay, kSeed, &output);
+      queue.Merge(kStats.queue);
+      total.Merge(kStats.total);
+      return kStats.runtime;
+    });
+    PrintTrials(std::cerr, kTrials);
+    std::cerr << "Runtime: " << kTrials.mean << std::endl;
+    std::cerr << "Offered load: " << kArrivalRate << " im/s, achieved throughput: "
+              << kNbRequests / kTrials.mean << " im/s" << std::endl;
+    PrintLatency(queue, "Queue");
+    PrintLatency(total, "End-to-end");
+    // Request r ran on image r modulo the dataset, as the sinks expect
+    if (kComputeAcc) {
+      const size_t kOutputSingle = configs[0].infer->GetOutputSingle();
+      AccuracySink accuracy(GetLabels(configs[0].kDataPath_), kNbRequests, kOutputSingle);
+      accuracy.Write(0, output.data(), kNbRequests, kOutputSingle);
+      PrintAccuracy(accuracy);
+    }
+    if (kWriteOut) {
+      std::ofstream fout("preds.out", std::ios::out | std::ios::binary);
+      fout.write((char *) output.data(), output.size() * sizeof(float));
+    }
+    WriteTimings(kTimingPath, kTracePath, kQueuePath, kNbRequests * kNbTrials);
     return 0;
   }
 
-  // Set the cascade criterion
-  Criterion *criterion = NULL;
-  auto crit_string = cfg["criterion"]["name"].as<std::string>();
-  if (crit_string == "max") {
-    criterion = new MaxCriterion(cfg["criterion"]["param"].as<float>());
-  } else if (crit_string == "none") {
-  } else {
-    throw std::invalid_argument("Criterion wrong");
+  if (cfg["experiment-type"].as<std::string>() != "full") {
+    ExperimentServer server(*configs[0].loader, configs[0].infer,
+                            configs[0].kBatchSize_, kRunInfer);
+    const TrialStats kTrials = RunTrials(kNbTrials, kCacheMode, {},
+                                         [&]() { return server.TimeInferenceOnly(); });
+    PrintTrials(std::cerr, kTrials);
+    std::cerr << "Runtime: " << kTrials.mean << std::endl;
+    WriteTimings(kTimingPath, kTracePath, kQueuePath, 0);
+    return 0;
   }
 
   // FIXME: cascades are implemented in a really annoying way right now
-  std::vector<float> final_output;
-  std::vector<bool> mask;
-  std::vector<size_t> ind_map;
-  for (size_t i = 0; i < configs.size(); i++) {
-    InferenceConfig *config = &configs[i];
-    const size_t kOutputSingle = config->infer->GetOutputSingle();
-    auto base_paths = GetFileNames(config->kDataPath_);
-    std::vector<std::string> paths(base_paths.size());
-    if (i == 0) {
-      paths = base_paths;
-    } else {
-      auto it = std::copy_if(
-          base_paths.begin(), base_paths.end(), paths.begin(),
-          [&](const std::string& str) -> bool {
-            size_t idx = &str - &base_paths[0];
-            return mask[idx];
-          });
-      paths.resize(std::distance(paths.begin(), it));
-    }
-    std::cerr << "Paths: " << paths.size() << std::endl;
-    ExperimentServer server(*config->loader, config->infer,
-                            config->kBatchSize_, kRunInfer);
-    float time;
-    std::vector<float> output;
-    if (kTimeLoad) {
-      // throw std::runtime_error("Loading not implemented");
-      time = server.TimeEndToEnd(paths);
-      std::cerr << "Runtime: " << time << std::endl;
-    } else {
-      auto compressed_images = GetCompressed(paths, *config->loader, kMult);
-      std::cerr << "Loaded files from disk\n";
-      std::tie(time, output) = server.TimeNoLoad(compressed_images);
-      std::cerr << "Runtime: " << time << std::endl;
-    }
+  const PreFilter *pre_filter = ParsePreFilter(cfg["pre-filter"]);
+  if (pre_filter != NULL && kTimeLoad)
+    throw std::invalid_argument("The pre-filter needs time-load off");
 
-    // Cascades
-    if (i == 0) {
-      assert(output.size() % kOutputSingle == 0);
-      std::copy(output.begin(), output.end(), std::back_inserter(final_output));
-      // FIXME: do softmax anyway?
-      if (criterion == NULL)
-        continue;
-      mask = criterion->filter(output.size() / kOutputSingle, output);
-      ind_map = MaskToIndMap(mask);
-    } else {
-      if (ind_map.size() == 0)
-        continue;
-      assert(output.size() % kOutputSingle == 0);
-      for (size_t i = 0; i < ind_map.size(); i++) {
-        const auto kInStart = output.begin() + i * kOutputSingle;
-        const auto kInEnd = output.begin() + (i + 1) * kOutputSingle;
-        auto kOutStart = final_output.begin() + ind_map[i] * kOutputSingle;
-        std::copy(kInStart, kInEnd, kOutStart);
-      }
-    }
+  // Rows are written to preds.out as stages finish instead of being gathered in memory
+  std::unique_ptr<OutputSink> file_sink;
+  if (kWriteOut && !kTimeLoad) {
+    const OutputFormat kFormat = ParseOutputFormat(cfg["experiment-config"]["output-format"] ?
+        cfg["experiment-config"]["output-format"].as<std::string>() : "fp32");
+    const size_t kTopK = cfg["experiment-config"]["output-top-k"] ?
+        cfg["experiment-config"]["output-top-k"].as<size_t>() : 5;
+    file_sink.reset(new MmapOutputSink(
+        "preds.out", GetFileNames(configs[0].kDataPath_).size() * kMult,
+        configs[0].infer->GetOutputSingle(), kFormat, kTopK));
+  }
+  // Later stages overwrite rows, so the accuracy is the cascade's
+  std::unique_ptr<AccuracySink> accuracy;
+  if (kComputeAcc) {
+    if (kTimeLoad)
+      throw std::invalid_argument("Computing accuracy needs time-load off");
+    const auto kLabels = GetLabels(configs[0].kDataPath_);
+    accuracy.reset(new AccuracySink(kLabels, kLabels.size() * kMult,
+                                    configs[0].infer->GetOutputSingle(), file_sink.get()));
   }
+  OutputSink *sink = accuracy ? accuracy.get() : file_sink.get();
+
+  if (kStreamingCascade) {
+    if (kTimeLoad || !kRunInfer)
+      throw std::invalid_argument("Streaming cascades need time-load off and run-infer on");
+    RunStreamingCascade(configs, criteria, results, kMult, kCacheBytes, pre_filter, kNbTrials,
+                        sink);
+  } else {
+    // Images are indexed as in stage 0, which runs on all of them. ind_map holds the images the
+    // current stage runs on; the others already exited at an earlier stage.
+    std::vector<size_t> ind_map;
+    std::vector<CompressedImage> first_compressed;
+    for (size_t i = 0; i < configs.size(); i++) {
+      InferenceConfig *config = &configs[i];
+      const size_t kOutputSingle = config->infer->GetOutputSingle();
+      auto base_paths = GetFileNames(config->kDataPath_);
+      if (i == 0) {
+        ind_map.resize(base_paths.size() * kMult);
+        std::iota(ind_map.begin(), ind_map.end(), 0);
+      }
+      if (ind_map.empty())
+        break;
+      // Copies past the first kMult - 1 repeat the same files
+      std::vector<std::string> paths(ind_map.size());
+      for (size_t k = 0; k < ind_map.size(); k++)
+        paths[k] = base_paths[ind_map[k] % base_paths.size()];
+      std::cerr << "Paths: " << paths.size() << std::endl;
+      ExperimentServer server(*config->loader, config->infer,
+                              config->kBatchSize_, kRunInfer, i);
+      std::vector<float> output;
+      if (kTimeLoad) {
+        // throw std::runtime_error("Loading not implemented");
+        const auto& kStagePaths = i == 0 ? base_paths : paths;
+        const TrialStats kTrials = RunTrials(kNbTrials, kCacheMode, kStagePaths,
+                                             [&]() { return server.TimeEndToEnd(kStagePaths); });
+        PrintTrials(std::cerr, kTrials);
+        std::cerr << "Runtime: " << kTrials.mean << std::endl;
+      } else {
+        std::vector<CompressedImage> compressed_images;
+        if (i > 0 && config->kDataPath_ == configs[0].kDataPath_) {
+          // Stage 0 already read the selected images
+          for (const size_t kIdx : ind_map)
+            compressed_images.push_back(first_compressed[kIdx]);
+        } else {
+          compressed_images = GetCompressed(i == 0 ? base_paths : paths, *config->loader,
+                                            i == 0 ? kMult : 1);
+          std::cerr << "Loaded files from disk\n";
+        }
+        if (i == 0)
+          first_compressed = compressed_images;
+        // Dropped images keep the default prediction and never reach the models
+        float filter_time = 0;
+        if (i == 0 && pre_filter != NULL) {
+          ind_map = RunPreFilter(*pre_filter, first_compressed, &filter_time);
+          std::cerr << "Pre-filter dropped images: "
+                    << first_compressed.size() - ind_map.size() << std::endl;
+          std::vector<float> default_output(kOutputSingle);
+          pre_filter->FillDefault(default_output.data(), kOutputSingle);
+          for (size_t k = 0; sink && k < first_compressed.size(); k++)
+            sink->WriteRow(k, default_output.data());
+          compressed_images.clear();
+          for (const size_t kIdx : ind_map)
+            compressed_images.push_back(first_compressed[kIdx]);
+        }
+        // Routing uses the last trial's outputs, which are the same as any other's
+        const TrialStats kTrials = RunTrials(kNbTrials, kCacheMode, {}, [&]() {
+          float time;
+          std::tie(time, output) = server.TimeNoLoad(compressed_images, results[i]);
+          return time + filter_time;
+        });
+        PrintTrials(std::cerr, kTrials);
+        std::cerr << "Runtime: " << kTrials.mean << std::endl;
+        PrintResultCache(results[i], i);
+      }
 
-  if (kWriteOut) {
-    std::ofstream fout("preds.out", std::ios::out | std::ios::binary);
-    fout.write((char *) final_output.data(), final_output.size() * sizeof(float));
-    fout.close();
+      // Cascades: nothing to route on without outputs, so later stages see the same images
+      if (output.empty())
+        continue;
+      assert(output.size() == ind_map.size() * kOutputSingle);
+      for (size_t k = 0; sink && k < ind_map.size(); k++)
+        sink->WriteRow(ind_map[k], output.data() + k * kOutputSingle);
+      if (i + 1 == configs.size())
+        break;
+      // FIXME: do softmax anyway?
+      if (criteria[i] == NULL)
+        break;
+      std::vector<size_t> next_ind_map = MaskToIndMap(criteria[i]->filter(ind_map.size(), output));
+      for (size_t& idx : next_ind_map)
+        idx = ind_map[idx];
+      ind_map = std::move(next_ind_map);
+    }
   }
+  if (accuracy)
+    PrintAccuracy(*accuracy);
+  WriteTimings(kTimingPath, kTracePath, kQueuePath,
+               GetFileNames(configs[0].kDataPath_).size() * kMult * kNbTrials);
 
   return 0;
 }
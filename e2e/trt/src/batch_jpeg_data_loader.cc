@@ -0,0 +1,141 @@
+#include <iostream>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "jpeglib.h"
+
+#include "data_loader.h"
+#include "memory_stats.h"
+#include "stage_timer.h"
+
+// Largest 1/N DCT scaling that still covers kResizeDim on the short side
+static unsigned int ScaleDenom(const size_t kShortSide, const size_t kResizeDim) {
+  for (unsigned int denom = 8; denom > 1; denom /= 2) {
+    if ((kShortSide + denom - 1) / denom >= kResizeDim)
+      return denom;
+  }
+  return 1;
+}
+
+// Expects a created decompressor, which is reset (not destroyed) so the next image can reuse it
+cv::Mat BatchedJPEGDataLoader::DecodeWith(
+    struct jpeg_decompress_struct *cinfo, CompressedImage compressed) const {
+  jpeg_mem_src(cinfo, compressed.first, compressed.second);
+  (void) jpeg_read_header(cinfo, TRUE);
+  cinfo->out_color_space = JCS_RGB;
+  // The reduced-size IDCT only computes the output pixels; merged upsampling fuses chroma
+  // upsampling with color conversion
+  cinfo->scale_num = 1;
+  cinfo->scale_denom = ScaleDenom(std::min(cinfo->image_width, cinfo->image_height), kResizeDim_);
+  cinfo->do_fancy_upsampling = FALSE;
+  (void) jpeg_start_decompress(cinfo);
+
+  cv::Mat decoded(cinfo->output_height, cinfo->output_width, CV_8UC3);
+  while (cinfo->output_scanline < cinfo->output_height) {
+    const size_t kNbRows = std::min(
+        (size_t) cinfo->rec_outbuf_height,
+        (size_t) (cinfo->output_height - cinfo->output_scanline));
+    uint8_t *buffer_array[kNbRows];
+    for (size_t i = 0; i < kNbRows; i++)
+      buffer_array[i] = decoded.ptr(cinfo->output_scanline + i);
+    (void) jpeg_read_scanlines(cinfo, buffer_array, kNbRows);
+  }
+  jpeg_abort_decompress(cinfo);
+  return decoded;
+}
+
+cv::Mat BatchedJPEGDataLoader::DecodeImage(CompressedImage compressed) const {
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&cinfo);
+  cv::Mat decoded = DecodeWith(&cinfo, compressed);
+  jpeg_destroy_decompress(&cinfo);
+  return decoded;
+}
+
+// Same crop as OptResizePNGDataLoader: center crop in the decoded image, then one resize
+void BatchedJPEGDataLoader::CropResize(const cv::Mat& kRawImage, cv::Mat *output) const {
+  const size_t short_side = std::min(kRawImage.cols, kRawImage.rows);
+  const size_t crop_size = (size_t) (short_side * kModelInputDim_ / (float) kResizeDim_);
+  const auto new_resol = RatioPreservingResize(crop_size, kRawImage.cols, kRawImage.rows);
+  const size_t x = (size_t) round((kRawImage.cols - new_resol.first) / 2.0);
+  const size_t y = (size_t) round((kRawImage.rows - new_resol.second) / 2.0);
+  cv::Rect crop_region(x, y, crop_size, crop_size);
+  cv::resize(kRawImage(crop_region), *output, cv::Size(kModelInputDim_, kModelInputDim_));
+}
+
+void BatchedJPEGDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *output_buf) const {
+  if (kCondition_ == LoaderCondition::DecodeOnly)
+    return;
+
+  StageTimer timer(TimedStage::Resize);
+  cv::Mat center_cropped;
+  CropResize(kRawImage, &center_cropped);
+  if (kCondition_ == LoaderCondition::DecodeResize)
+    return;
+
+  timer.Next(TimedStage::Normalize);
+  const size_t kChannelSize = kModelInputDim_ * kModelInputDim_;
+  std::vector<uint8_t> scratch(kChannelSize * 3);
+  std::vector<cv::Mat> channels(3);
+  for (size_t i = 0; i < channels.size(); i++)
+    channels[i] = cv::Mat(kModelInputDim_, kModelInputDim_, CV_8UC1, scratch.data() + i * kChannelSize);
+  cv::split(center_cropped, channels);
+
+  for (size_t ch = 0, offset = 0; ch < 3; ch++) {
+    for (size_t j = 0; j < kChannelSize; j++, offset++)
+      output_buf[offset] = scratch[offset] * scale_[ch] + bias_[ch];
+  }
+}
+
+void BatchedJPEGDataLoader::DecodeAndPreprocBatch(
+    const CompressedImage *kCompressed, const size_t kNbImages, float *output_buf) const {
+  DecoderMemoryScope scope;
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&cinfo);
+
+  // Planar uint8 staging for the whole batch, laid out exactly like output_buf
+  const size_t kChannelSize = kModelInputDim_ * kModelInputDim_;
+  const size_t kImSize = 3 * kChannelSize;
+  std::vector<uint8_t> staging(kNbImages * kImSize);
+  cv::Mat center_cropped;
+  std::vector<cv::Mat> channels(3);
+  for (size_t i = 0; i < kNbImages; i++) {
+    StageTimer timer(TimedStage::Decode);
+    cv::Mat decoded = DecodeWith(&cinfo, kCompressed[i]);
+    if (kCondition_ == LoaderCondition::DecodeOnly)
+      continue;
+
+    timer.Next(TimedStage::Resize);
+    CropResize(decoded, &center_cropped);
+    if (kCondition_ == LoaderCondition::DecodeResize)
+      continue;
+
+    timer.Next(TimedStage::Normalize);
+    for (size_t ch = 0; ch < 3; ch++)
+      channels[ch] = cv::Mat(kModelInputDim_, kModelInputDim_, CV_8UC1,
+                             staging.data() + i * kImSize + ch * kChannelSize);
+    cv::split(center_cropped, channels);
+  }
+  jpeg_destroy_decompress(&cinfo);
+
+  if (kCondition_ == LoaderCondition::DecodeOnly || kCondition_ == LoaderCondition::DecodeResize)
+    return;
+
+  // One multiply-add per pixel over contiguous planes, which the compiler vectorizes. Timed once
+  // for the whole batch.
+  StageTimer timer(TimedStage::Normalize);
+  for (size_t plane = 0; plane < 3 * kNbImages; plane++) {
+    const size_t kOffset = plane * kChannelSize;
+    const float kScale = scale_[plane % 3], kBias = bias_[plane % 3];
+    const uint8_t *in = staging.data() + kOffset;
+    float *out = output_buf + kOffset;
+    for (size_t j = 0; j < kChannelSize; j++)
+      out[j] = in[j] * kScale + kBias;
+  }
+}
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+#include "cascade_server.h"
+#include "live_metrics.h"
+#include "memory_stats.h"
+#include "stage_timer.h"
+
+CascadeServer::CascadeServer(const std::vector<CascadeStage>& kStages, ImageCache *cache) :
+    kStages_(kStages),
+    kNbImages_(kStages.at(0).compressed->size()),
+    kOutputSingle_(kStages[0].infer->GetOutputSingle()),
+    cache_(cache), reuse_decode_(kStages.size(), false) {
+  for (const auto& stage : kStages_) {
+    if (stage.compressed->size() != kNbImages_)
+      throw std::invalid_argument("Cascade stages must have the same images");
+    if (stage.infer->GetOutputSingle() != kOutputSingle_)
+      throw std::invalid_argument("Cascade stages must have the same output size");
+    batch_queues_.push_back(
+        std::make_unique<folly::MPMCQueue<Batch> >(omp_get_max_threads() * 3));
+    queue_registrations_.push_back(
+        std::make_unique<QueueRegistration>(QueueKind::Batch, batch_queues_.back().get()));
+    for (size_t i = 0; i < omp_get_max_threads() * 3; i++)
+      batch_queues_.back()->blockingWrite(
+          std::make_unique<BatchBase>(stage.batch_size * stage.loader->GetImSize()));
+  }
+  // Stages that read the same images as stage 0 with a compatible loader
+  for (size_t s = 1; cache_ != NULL && s < kStages_.size(); s++) {
+    reuse_decode_[s] = kStages_[s].compressed == kStages_[0].compressed &&
+        kStages_[s].loader->SharesDecode(*kStages_[0].loader);
+    reuse_decode_[0] = reuse_decode_[0] || reuse_decode_[s];
+  }
+}
+
+// Must hold mutex_. Stages finish in order: a stage is done once the previous one is, its last
+// partial batch has been queued, and all its batches have been scored.
+void CascadeServer::UpdateFinished() {
+  for (size_t s = 0; s < kStages_.size(); s++) {
+    if (finished_[s])
+      continue;
+    const bool kInputDone = s == 0 ? next_image_ >= kNbImages_ : finished_[s - 1];
+    if (!kInputDone)
+      return;
+    if (!pending_[s].empty()) {
+      ready_[s].push_back(std::move(pending_[s]));
+      pending_[s].clear();
+    }
+    if (in_flight_[s] != 0 || !ready_[s].empty())
+      return;
+    finished_[s] = true;
+    cv_.notify_all();
+  }
+}
+
+// Blocks until there is work, or returns NULL once the whole cascade is done
+std::unique_ptr<CascadeServer::Work> CascadeServer::NextWork() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    for (size_t s = kStages_.size() - 1; s > 0; s--) {
+      if (!ready_[s].empty()) {
+        std::unique_ptr<Work> work(new Work{s, std::move(ready_[s].front()), {}});
+        ready_[s].pop_front();
+        in_flight_[s]++;
+        return work;
+      }
+    }
+    if (next_image_ < kNbImages_) {
+      const size_t kEnd = std::min(next_image_ + kStages_[0].batch_size, kNbImages_);
+      std::unique_ptr<Work> work(new Work{0, std::vector<size_t>(kEnd - next_image_), {}});
+      for (size_t i = 0; i < work->indices.size(); i++)
+        work->indices[i] = next_image_ + i;
+      next_image_ = kEnd;
+      in_flight_[0]++;
+      UpdateFinished();
+      return work;
+    }
+    UpdateFinished();
+    if (finished_.back())
+      return NULL;
+    cv_.wait(lock);
+  }
+}
+
+void CascadeServer::DecodeAndPreproc(const size_t kStageIdx, const std::vector<size_t>& kIndices,
+                                     float *output_buf) {
+  const CascadeStage& kStage = kStages_[kStageIdx];
+  const size_t kNbImages = kIndices.size();
+  const size_t kImSize = kStage.loader->GetImSize();
+  if (!reuse_decode_[kStageIdx]) {
+    std::vector<CompressedImage> compressed(kNbImages);
+    for (size_t i = 0; i < kNbImages; i++)
+      compressed[i] = (*kStage.compressed)[kIndices[i]];
+    kStage.loader->DecodeAndPreprocBatch(compressed.data(), kNbImages, output_buf);
+    return;
+  }
+
+  for (size_t i = 0; i < kNbImages; i++) {
+    const size_t kIndex = kIndices[i];
+    cv::Mat decoded;
+    if (kStageIdx == 0 || !cache_->Get(kIndex, &decoded)) {
+      StageTimer timer(TimedStage::Decode);
+      decoded = kStage.loader->DecodeImage((*kStage.compressed)[kIndex]);
+    }
+    kStage.loader->PreprocessImage(decoded, output_buf + i * kImSize);
+    if (kStageIdx == 0)
+      cache_->Put(kIndex, decoded);
+  }
+}
+
+void CascadeServer::RunWork(std::unique_ptr<Work> work) {
+  TraceSpan span("stage-batch", work->stage);
+  const CascadeStage& kStage = kStages_[work->stage];
+  const size_t kNbImages = work->indices.size();
+  work->output.resize(kNbImages * kOutputSingle_);
+  float *output_buf = work->output.data();
+
+  // Cached rows skip decode and inference, the others run as a smaller batch
+  std::vector<size_t> miss_indices;
+  if (kStage.results != NULL) {
+    work->keys.resize(kNbImages);
+    for (size_t i = 0; i < kNbImages; i++) {
+      work->keys[i] = kStage.results->Key((*kStage.compressed)[work->indices[i]]);
+      if (!kStage.results->Get(work->keys[i], output_buf + i * kOutputSingle_)) {
+        work->misses.push_back(i);
+        miss_indices.push_back(work->indices[i]);
+      }
+    }
+    if (work->misses.empty()) {
+      FinishWork(work.release());
+      return;
+    }
+    work->run_output.resize(work->misses.size() * kOutputSingle_);
+    output_buf = work->run_output.data();
+  }
+  const std::vector<size_t>& kRunIndices = kStage.results == NULL ? work->indices : miss_indices;
+  const size_t kNbRun = kRunIndices.size();
+
+  Batch batch;
+  folly::MPMCQueue<Batch> *batch_queue = batch_queues_[work->stage].get();
+  StageTimer wait_timer(TimedStage::BatchWait);
+  MonitoredRead(batch_queue, batch, QueueKind::Batch);
+  wait_timer.Stop();
+  DecodeAndPreproc(work->stage, kRunIndices, batch.get()->data());
+
+  Work *kWork = work.release();
+  kStage.infer->RunInference(
+      std::make_tuple(std::move(batch), kStage.batch_size,
+                      output_buf, kNbRun * kOutputSingle_, batch_queue),
+      [this, kWork]() { FinishWork(kWork); });
+}
+
+// Runs on an inference thread, or on the decode thread when every row was cached
+void CascadeServer::FinishWork(Work *kWork) {
+  std::unique_ptr<Work> work(kWork);
+  const CascadeStage& kStage = kStages_[work->stage];
+  const size_t kNbImages = work->indices.size();
+  for (size_t k = 0; kStage.results != NULL && k < work->misses.size(); k++) {
+    const float *kRow = work->run_output.data() + k * kOutputSingle_;
+    std::copy(kRow, kRow + kOutputSingle_, work->output.begin() + work->misses[k] * kOutputSingle_);
+    kStage.results->Put(work->keys[work->misses[k]], kRow);
+  }
+  // Stages write in order, so later stages overwrite the outputs of earlier ones
+  for (size_t i = 0; output_ != NULL && i < kNbImages; i++)
+    std::copy(work->output.begin() + i * kOutputSingle_,
+              work->output.begin() + (i + 1) * kOutputSingle_,
+              output_->begin() + work->indices[i] * kOutputSingle_);
+  for (size_t i = 0; sink_ != NULL && i < kNbImages; i++)
+    sink_->WriteRow(work->indices[i], work->output.data() + i * kOutputSingle_);
+
+  const size_t kNext = work->stage + 1;
+  std::unique_ptr<bool[]> selected(new bool[kNbImages]());
+  const Criterion *kCriterion = kStage.criterion;
+  if (kNext < kStages_.size() && kCriterion != NULL)
+    kCriterion->FilterBatch(work->output.data(), kNbImages, kOutputSingle_, selected.get());
+
+  if (cache_ != NULL) {
+    for (size_t i = 0; i < kNbImages; i++) {
+      if (!selected[i])
+        cache_->Erase(work->indices[i]);
+    }
+  }
+
+  LiveMetrics::AddImages(work->stage, kNbImages);
+  std::lock_guard<std::mutex> lock(mutex_);
+  nb_processed_[work->stage] += kNbImages;
+  for (size_t i = 0; i < kNbImages; i++) {
+    if (!selected[i])
+      continue;
+    pending_[kNext].push_back(work->indices[i]);
+    if (pending_[kNext].size() == kStages_[kNext].batch_size) {
+      ready_[kNext].push_back(std::move(pending_[kNext]));
+      pending_[kNext].clear();
+    }
+  }
+  in_flight_[work->stage]--;
+  UpdateFinished();
+  cv_.notify_all();
+}
+
+void CascadeServer::RunInferenceOnCompressed(std::vector<float> *output, OutputSink *sink) {
+  const size_t kNbStages = kStages_.size();
+  output_ = output;
+  sink_ = sink;
+  next_image_ = 0;
+  pending_.assign(kNbStages, std::vector<size_t>());
+  ready_.assign(kNbStages, std::deque<std::vector<size_t> >());
+  in_flight_.assign(kNbStages, 0);
+  finished_.assign(kNbStages, false);
+  nb_processed_.assign(kNbStages, 0);
+
+  #pragma omp parallel
+  {
+    std::unique_ptr<Work> work;
+    while ((work = NextWork()) != NULL)
+      RunWork(std::move(work));
+  }
+}
+
+std::pair<float, std::vector<float> > CascadeServer::TimeNoLoad() {
+  std::vector<float> output(kNbImages_ * kOutputSingle_);
+  MemoryCharge output_charge(MemoryOwner::Output, output.size() * sizeof(float));
+
+  auto start = std::chrono::high_resolution_clock::now();
+  RunInferenceOnCompressed(&output);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::milli> diff = end - start;
+  float time = diff.count() / 1000.0;
+  return std::make_pair(time, output);
+}
+
+float CascadeServer::TimeNoLoad(OutputSink *sink) {
+  auto start = std::chrono::high_resolution_clock::now();
+  RunInferenceOnCompressed(NULL, sink);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::milli> diff = end - start;
+  return diff.count() / 1000.0;
+}
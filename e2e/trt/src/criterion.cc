@@ -1,30 +1,186 @@
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
 
 #include "criterion.h"
 
-std::vector<bool> MaxCriterion::filter(const size_t kNbEl, std::vector<float> data) const {
+// exp for x <= 0, to about 2e-7 relative error. Written so that loops over it vectorize: split
+// x / ln(2) into n + f with f in [-0.5, 0.5], evaluate 2^f with a polynomial and add n to the
+// exponent bits.
+static inline float FastExp(float x) {
+  x = x < -87.f ? -87.f : x;
+  const float kT = x * 1.44269504f;
+  const float kN = __builtin_floorf(kT + 0.5f);
+  const float kF = (kT - kN) * 0.69314718f;
+  float p = 1.f / 720;
+  p = p * kF + 1.f / 120;
+  p = p * kF + 1.f / 24;
+  p = p * kF + 1.f / 6;
+  p = p * kF + 0.5f;
+  p = p * kF + 1.f;
+  p = p * kF + 1.f;
+  const int32_t kBits = ((int32_t) kN + 127) << 23;
+  float scale;
+  memcpy(&scale, &kBits, sizeof(scale));
+  return p * scale;
+}
+
+LogitStats ComputeLogitStats(const float *kLogits, const size_t kNbClasses,
+                             const float kInvTemp) {
+  float max_el = kLogits[0];
+  #pragma omp simd reduction(max:max_el)
+  for (size_t i = 0; i < kNbClasses; i++)
+    max_el = kLogits[i] > max_el ? kLogits[i] : max_el;
+
+  // Ties with the max count once, so a second max equal to the max means a real tie
+  float second = -__builtin_inff();
+  size_t nb_max = 0;
+  #pragma omp simd reduction(max:second) reduction(+:nb_max)
+  for (size_t i = 0; i < kNbClasses; i++) {
+    const bool kIsMax = kLogits[i] == max_el;
+    nb_max += kIsMax;
+    second = !kIsMax && kLogits[i] > second ? kLogits[i] : second;
+  }
+  if (nb_max > 1)
+    second = max_el;
+
+  float sum_exp = 0, sum_xexp = 0;
+  #pragma omp simd reduction(+:sum_exp, sum_xexp)
+  for (size_t i = 0; i < kNbClasses; i++) {
+    const float kZ = (kLogits[i] - max_el) * kInvTemp;
+    const float kExp = FastExp(kZ);
+    sum_exp += kExp;
+    sum_xexp += kZ * kExp;
+  }
+  return LogitStats{max_el, second, kInvTemp, sum_exp, sum_xexp};
+}
+
+float LogitStats::Margin() const {
+  return (1 - std::exp((second - max) * inv_temp)) / sum_exp;
+}
+
+// -sum(p log p) with p = exp(z) / sum_exp
+float LogitStats::Entropy() const {
+  return std::log(sum_exp) - sum_xexp / sum_exp;
+}
+
+void softmax(const float *kIn, const size_t kNbClasses, float *out) {
+  float max_el = kIn[0];
+  #pragma omp simd reduction(max:max_el)
+  for (size_t i = 0; i < kNbClasses; i++)
+    max_el = kIn[i] > max_el ? kIn[i] : max_el;
+
+  float exptot = 0;
+  #pragma omp simd reduction(+:exptot)
+  for (size_t i = 0; i < kNbClasses; i++) {
+    out[i] = FastExp(kIn[i] - max_el);
+    exptot += out[i];
+  }
+
+  const float kInvTot = 1 / exptot;
+  #pragma omp simd
+  for (size_t i = 0; i < kNbClasses; i++)
+    out[i] *= kInvTot;
+}
+
+
+std::vector<bool> Criterion::filter(const size_t kNbEl, const std::vector<float>& data) const {
   assert(data.size() % kNbEl == 0);
   const size_t kSingleSize = data.size() / kNbEl;
-  std::vector<bool> ret(kNbEl);
+  const size_t kChunk = 256;
+  std::unique_ptr<bool[]> selected(new bool[kNbEl]);
 
   #pragma omp parallel for
+  for (size_t i = 0; i < kNbEl; i += kChunk) {
+    FilterBatch(data.data() + i * kSingleSize, std::min(kChunk, kNbEl - i), kSingleSize,
+                selected.get() + i);
+  }
+  return std::vector<bool>(selected.get(), selected.get() + kNbEl);
+}
+
+
+void ThresholdCriterion::Scores(
+    const float *kLogits, const size_t kNbEl, const size_t kNbClasses, float *scores) const {
+  const float kInvTemp = GetInvTemp();
+  for (size_t i = 0; i < kNbEl; i++)
+    scores[i] = Score(ComputeLogitStats(kLogits + i * kNbClasses, kNbClasses, kInvTemp));
+}
+
+void ThresholdCriterion::FilterBatch(
+    const float *kLogits, const size_t kNbEl, const size_t kNbClasses, bool *selected) const {
+  const float kInvTemp = GetInvTemp();
   for (size_t i = 0; i < kNbEl; i++) {
-    auto beg = data.begin() + i * kSingleSize;
-    auto end = data.begin() + (i + 1) * kSingleSize;
-    softmax(beg, end, beg);
-
-    // Softmax modifies the iterators
-    beg = data.begin() + i * kSingleSize;
-    end = data.begin() + (i + 1) * kSingleSize;
-
-    const float kMaxEl { *std::max_element(beg, end) };
-    if (kMaxEl < kCutoff_) {
-      ret[i] = false;
-    } else {
-      ret[i] = true;
-    }
+    const float kScore =
+        Score(ComputeLogitStats(kLogits + i * kNbClasses, kNbClasses, kInvTemp));
+    selected[i] = kForwardAbove_ ? kScore >= kCutoff_ : kScore < kCutoff_;
+  }
+}
+
+TemperatureCriterion::TemperatureCriterion(const float kCutoff, const float kTemperature) :
+    ThresholdCriterion(kCutoff, false), kInvTemp_(1 / kTemperature) {
+  if (!(kTemperature > 0))
+    throw std::invalid_argument("Temperature must be positive");
+}
+
+
+static std::vector<bool> Top1Correct(const std::vector<float>& kLogits,
+                                     const std::vector<size_t>& kLabels) {
+  const size_t kNbClasses = kLogits.size() / kLabels.size();
+  std::vector<bool> correct(kLabels.size());
+  for (size_t i = 0; i < kLabels.size(); i++) {
+    const auto kRow = kLogits.begin() + i * kNbClasses;
+    correct[i] = std::max_element(kRow, kRow + kNbClasses) - kRow == kLabels[i];
   }
+  return correct;
+}
 
-  return ret;
+Calibration CalibrateCutoff(const ThresholdCriterion& kCriterion,
+                            const std::vector<float>& kSmall, const std::vector<float>& kBig,
+                            const std::vector<size_t>& kLabels, const float kTargetAcc) {
+  const size_t kNbEl = kLabels.size();
+  if (kNbEl == 0 || kSmall.size() != kBig.size() || kSmall.size() % kNbEl != 0)
+    throw std::invalid_argument("Calibration needs the logits of both stages on every image");
+  const size_t kNbClasses = kSmall.size() / kNbEl;
+
+  std::vector<float> scores(kNbEl);
+  #pragma omp parallel for
+  for (size_t i = 0; i < kNbEl; i++)
+    kCriterion.Scores(kSmall.data() + i * kNbClasses, 1, kNbClasses, &scores[i]);
+  const std::vector<bool> kSmallCorrect = Top1Correct(kSmall, kLabels);
+  const std::vector<bool> kBigCorrect = Top1Correct(kBig, kLabels);
+
+  // Images in the order the criterion forwards them as the cutoff moves
+  std::vector<size_t> order(kNbEl);
+  std::iota(order.begin(), order.end(), 0);
+  const bool kAbove = kCriterion.ForwardsAbove();
+  std::sort(order.begin(), order.end(), [&](const size_t a, const size_t b) {
+    return kAbove ? scores[a] > scores[b] : scores[a] < scores[b];
+  });
+
+  // Forwarding the first k images; only cutoffs between distinct scores are reachable
+  size_t nb_correct = std::count(kSmallCorrect.begin(), kSmallCorrect.end(), true);
+  for (size_t k = 0; k <= kNbEl; k++) {
+    if (k > 0)
+      nb_correct += (int) kBigCorrect[order[k - 1]] - (int) kSmallCorrect[order[k - 1]];
+    if (k > 0 && k < kNbEl && scores[order[k - 1]] == scores[order[k]])
+      continue;
+    const float kAcc = (float) nb_correct / kNbEl;
+    if (kAcc < kTargetAcc)
+      continue;
+
+    // The last forwarded score for >=, the first kept one for <
+    float cutoff;
+    if (kAbove)
+      cutoff = k == 0 ? std::nextafter(scores[order[0]], INFINITY) : scores[order[k - 1]];
+    else
+      cutoff = k == kNbEl ? std::nextafter(scores[order[k - 1]], INFINITY) : scores[order[k]];
+    return Calibration{cutoff, k, kAcc};
+  }
+  throw std::invalid_argument("Target accuracy is unreachable with these stages");
 }
@@ -1,3 +1,5 @@
+#include <cstring>
+#include <future>
 #include <iostream>
 #include <iterator>
 #include <fstream>
@@ -10,8 +12,11 @@
 #include "jpeglib.h"
 
 #include "data_loader.h"
+#include "memory_stats.h"
+#include "stage_timer.h"
 
 CompressedImage DataLoader::LoadCompressedImageFromFile(const std::string& kFileName) const {
+  StageTimer timer(TimedStage::Read);
   std::ifstream file(kFileName, std::ios::binary | std::ios::in);
   file.unsetf(std::ios::skipws);
 
@@ -27,13 +32,201 @@ CompressedImage DataLoader::LoadCompressedImageFromFile(const std::string& kFile
 }
 
 
+// Very large baseline JPEGs with restart markers are split into row bands decoded in parallel
+static const size_t kParallelDecodeMinPixels = 20 * 1000 * 1000;
+static const size_t kMaxRestartBands = 8;
+
+// A standalone JPEG stream covering rows [top, top + height) of the original image, of which
+// rows [core_top, core_bottom) belong to this band
+struct RestartBand {
+  std::vector<uint8_t> stream;
+  size_t top, height;
+  size_t core_top, core_bottom;
+};
+
+// Returns the offset of the SOF height field, or 0 if there is none before the scan
+static size_t FindSOFHeight(const uint8_t *data, const size_t kScanStart) {
+  size_t pos = 2;
+  while (pos + 7 <= kScanStart) {
+    if (data[pos] != 0xFF)
+      return 0;
+    const uint8_t kMarker = data[pos + 1];
+    if (kMarker == 0xFF) {
+      pos++;
+      continue;
+    }
+    if (kMarker >= 0xC0 && kMarker <= 0xC1)
+      return pos + 5;
+    pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+  }
+  return 0;
+}
+
+// Restart segments only reset the DC predictors, so any segment that starts an MCU row can start
+// a band. Each band gets a copy of the headers with its own height, the segments' entropy-coded
+// data with the RSTn markers renumbered from 0, and an EOI.
+// Returns no bands if the image has no usable restart markers.
+static std::vector<RestartBand> SplitRestartBands(
+    CompressedImage compressed, const struct jpeg_decompress_struct& kInfo, const size_t kScanStart) {
+  std::vector<RestartBand> bands;
+  if (kInfo.restart_interval == 0 || kInfo.progressive_mode ||
+      kInfo.comps_in_scan != kInfo.num_components)
+    return bands;
+  const size_t kSOFHeight = FindSOFHeight(compressed.first, kScanStart);
+  if (kSOFHeight == 0)
+    return bands;
+
+  const bool kInterleaved = kInfo.comps_in_scan > 1;
+  const size_t kMCUWidth = DCTSIZE * (kInterleaved ? kInfo.max_h_samp_factor : 1);
+  const size_t kMCUHeight = DCTSIZE * (kInterleaved ? kInfo.max_v_samp_factor : 1);
+  const size_t kMCUsPerRow = (kInfo.image_width + kMCUWidth - 1) / kMCUWidth;
+  const size_t kMCURows = (kInfo.image_height + kMCUHeight - 1) / kMCUHeight;
+  const size_t kRI = kInfo.restart_interval;
+  const size_t kNbSegments = (kMCUsPerRow * kMCURows + kRI - 1) / kRI;
+
+  // Offsets of the RSTn markers and of the marker that ends the scan
+  const uint8_t *data = compressed.first;
+  std::vector<size_t> markers;
+  size_t scan_end = compressed.second;
+  for (size_t pos = kScanStart; pos + 1 < compressed.second; pos++) {
+    const void *next = memchr(data + pos, 0xFF, compressed.second - pos - 1);
+    if (next == NULL)
+      break;
+    pos = (const uint8_t *) next - data;
+    const uint8_t kNext = data[pos + 1];
+    if (kNext >= 0xD0 && kNext <= 0xD7) {
+      markers.push_back(pos);
+      pos++;
+    } else if (kNext != 0x00 && kNext != 0xFF) {
+      scan_end = pos;
+      break;
+    }
+  }
+  if (markers.size() + 1 != kNbSegments)
+    return bands;
+
+  // Segments that start an MCU row, plus kNbSegments as the end of the image
+  std::vector<size_t> aligned;
+  for (size_t seg = 0; seg < kNbSegments; seg++) {
+    if ((seg * kRI) % kMCUsPerRow == 0)
+      aligned.push_back(seg);
+  }
+  aligned.push_back(kNbSegments);
+  auto segment_row = [&](const size_t kSegment) {
+    return kSegment == kNbSegments ? kInfo.image_height : kSegment * kRI / kMCUsPerRow * kMCUHeight;
+  };
+
+  // Indices into aligned where each band starts
+  const size_t kTargetRows = (kMCURows + kMaxRestartBands - 1) / kMaxRestartBands * kMCUHeight;
+  std::vector<size_t> starts = {0};
+  for (size_t a = 1; a + 1 < aligned.size(); a++) {
+    if (segment_row(aligned[a]) - segment_row(aligned[starts.back()]) >= kTargetRows)
+      starts.push_back(a);
+  }
+  starts.push_back(aligned.size() - 1);
+  if (starts.size() < 3)
+    return bands;
+
+  bands.resize(starts.size() - 1);
+  for (size_t b = 0; b < bands.size(); b++) {
+    // Decode one more aligned segment on each side so chroma upsampling at the core's edges sees
+    // the same neighbouring rows as a serial decode
+    const size_t kFirst = aligned[starts[b] == 0 ? 0 : starts[b] - 1];
+    const size_t kLast = aligned[std::min(starts[b + 1] + 1, aligned.size() - 1)];
+    const size_t kBegin = kFirst == 0 ? kScanStart : markers[kFirst - 1] + 2;
+    const size_t kEnd = kLast == kNbSegments ? scan_end : markers[kLast - 1];
+    RestartBand& band = bands[b];
+    band.top = segment_row(kFirst);
+    band.height = segment_row(kLast) - band.top;
+    band.core_top = segment_row(aligned[starts[b]]);
+    band.core_bottom = segment_row(aligned[starts[b + 1]]);
+
+    band.stream.reserve(kScanStart + (kEnd - kBegin) + 2);
+    band.stream.insert(band.stream.end(), data, data + kScanStart);
+    band.stream.insert(band.stream.end(), data + kBegin, data + kEnd);
+    band.stream.push_back(0xFF);
+    band.stream.push_back(JPEG_EOI);
+    band.stream[kSOFHeight] = band.height >> 8;
+    band.stream[kSOFHeight + 1] = band.height & 0xFF;
+    for (size_t m = kFirst; m + 1 < kLast; m++)
+      band.stream[markers[m] - kBegin + kScanStart + 1] = JPEG_RST0 + (m - kFirst) % 8;
+  }
+  return bands;
+}
+
+// Decodes rows [kTop, kBottom) of the band, cropped to [kCropLeft, kCropLeft + kCropWidth), into
+// the rows of output that start at kOutTop
+static void DecodeRestartBand(
+    const RestartBand& kBand, const J_COLOR_SPACE kOutSpace,
+    unsigned int crop_left, unsigned int crop_width,
+    const size_t kTop, const size_t kBottom, const size_t kOutTop, cv::Mat *output) {
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (uint8_t *) kBand.stream.data(), kBand.stream.size());
+  (void) jpeg_read_header(&cinfo, TRUE);
+  cinfo.out_color_space = kOutSpace;
+  (void) jpeg_start_decompress(&cinfo);
+
+  jpeg_crop_scanline(&cinfo, &crop_left, &crop_width);
+  jpeg_skip_scanlines(&cinfo, kTop - kBand.top);
+  while (cinfo.output_scanline < kBottom - kBand.top) {
+    uint8_t *row = output->ptr(kBand.top + cinfo.output_scanline - kOutTop);
+    (void) jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_abort_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+}
+
+// The calling thread decodes the first band, the others get their own threads since the
+// loaders already run inside an OpenMP worker
+static void DecodeRestartBands(
+    const std::vector<RestartBand>& kBands, const J_COLOR_SPACE kOutSpace,
+    const unsigned int kCropLeft, const unsigned int kCropWidth,
+    const size_t kTop, const size_t kBottom, cv::Mat *output) {
+  std::vector<std::future<void> > async_results;
+  const RestartBand *first = NULL;
+  for (const auto& band : kBands) {
+    const size_t kBandTop = std::max(kTop, band.core_top);
+    const size_t kBandBottom = std::min(kBottom, band.core_bottom);
+    if (kBandTop >= kBandBottom)
+      continue;
+    if (first == NULL) {
+      first = &band;
+      continue;
+    }
+    async_results.push_back(std::async(
+        std::launch::async, DecodeRestartBand,
+        std::cref(band), kOutSpace, kCropLeft, kCropWidth, kBandTop, kBandBottom, kTop, output));
+  }
+  if (first != NULL) {
+    DecodeRestartBand(*first, kOutSpace, kCropLeft, kCropWidth,
+                      std::max(kTop, first->core_top), std::min(kBottom, first->core_bottom),
+                      kTop, output);
+  }
+  for (size_t i = 0; i < async_results.size(); i++)
+    async_results[i].get();
+}
+
+
 cv::Mat OptimizedDataLoader::DecodeImage(CompressedImage compressed) const {
+  return DecodeCenterCrop(compressed, false);
+}
+
+// With kGray, libjpeg only dequantizes and IDCTs the Y component and skips upsampling and color
+// conversion. Chroma still has to be entropy decoded in interleaved scans.
+cv::Mat OptimizedDataLoader::DecodeCenterCrop(CompressedImage compressed, const bool kGray) const {
   struct jpeg_decompress_struct cinfo;
   struct jpeg_error_mgr jerr;
   cinfo.err = jpeg_std_error(&jerr);
   jpeg_create_decompress(&cinfo);
   jpeg_mem_src(&cinfo, compressed.first, compressed.second);
   (void) jpeg_read_header(&cinfo, TRUE);
+  // The memory source stops right after the SOS header
+  const size_t kScanStart = cinfo.src->next_input_byte - compressed.first;
+  const J_COLOR_SPACE kOutSpace = kGray ? JCS_GRAYSCALE : JCS_RGB;
+  cinfo.out_color_space = kOutSpace;
   (void) jpeg_start_decompress(&cinfo);
 
   const size_t kOrigWidth = cinfo.output_width;
@@ -76,18 +269,27 @@ cv::Mat OptimizedDataLoader::DecodeImage(CompressedImage compressed) const {
   unsigned int crop_y_offset = adjusted_bottom - adjusted_top;
   unsigned int row_stride = crop_x_offset * cinfo.output_components;
 
-  cv::Mat decoded_img(crop_y_offset, crop_x_offset, CV_8UC3);
+  cv::Mat decoded_img(crop_y_offset, crop_x_offset, kGray ? CV_8UC1 : CV_8UC3);
   uint8_t *img_buf = decoded_img.ptr();
-  jpeg_skip_scanlines(&cinfo, adjusted_top);
 
-  size_t newRowIdx = 0;
-  while (cinfo.output_scanline < adjusted_bottom) {
-    size_t nSimultaneousRows = cinfo.rec_outbuf_height;
-    uint8_t *buffer_array[nSimultaneousRows];
-    for (size_t i = 0; i < nSimultaneousRows; i++)
-      buffer_array[i] = img_buf + (newRowIdx * row_stride);
-    (void) jpeg_read_scanlines(&cinfo, buffer_array, nSimultaneousRows);
-    newRowIdx += nSimultaneousRows;
+  std::vector<RestartBand> bands;
+  if (kOrigWidth * kOrigHeight >= kParallelDecodeMinPixels)
+    bands = SplitRestartBands(compressed, cinfo, kScanStart);
+  if (bands.size() > 1) {
+    DecodeRestartBands(bands, kOutSpace, new_adj_left, crop_x_offset, adjusted_top, adjusted_bottom,
+                       &decoded_img);
+  } else {
+    jpeg_skip_scanlines(&cinfo, adjusted_top);
+
+    size_t newRowIdx = 0;
+    while (cinfo.output_scanline < adjusted_bottom) {
+      size_t nSimultaneousRows = cinfo.rec_outbuf_height;
+      uint8_t *buffer_array[nSimultaneousRows];
+      for (size_t i = 0; i < nSimultaneousRows; i++)
+        buffer_array[i] = img_buf + (newRowIdx * row_stride);
+      (void) jpeg_read_scanlines(&cinfo, buffer_array, nSimultaneousRows);
+      newRowIdx += nSimultaneousRows;
+    }
   }
   jpeg_abort_decompress(&cinfo);
   jpeg_destroy_decompress(&cinfo);
@@ -103,6 +305,7 @@ void OptimizedDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *outpu
   if (kCondition_ == LoaderCondition::DecodeOnly)
     return;
 
+  StageTimer timer(TimedStage::Resize);
   cv::Mat resized;
   if (kDoResize_) {
     resized.create(kModelInputDim_, kModelInputDim_, CV_8UC3);
@@ -113,6 +316,7 @@ void OptimizedDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *outpu
   if (kCondition_ == LoaderCondition::DecodeResize)
     return;
 
+  timer.Next(TimedStage::Normalize);
   std::vector<uint8_t> scratch(kModelInputDim_ * kModelInputDim_ * 3);
   std::vector<cv::Mat> channels(3);
   for (size_t i = 0, offset = 0; i < channels.size(); i++) {
@@ -151,17 +355,93 @@ void OptimizedDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *outpu
 }
 
 
+cv::Mat GrayJPEGDataLoader::DecodeImage(CompressedImage compressed) const {
+  return DecodeCenterCrop(compressed, true);
+}
+
+void GrayJPEGDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *output_buf) const {
+  if (kCondition_ == LoaderCondition::DecodeOnly)
+    return;
+
+  StageTimer timer(TimedStage::Resize);
+  cv::Mat resized;
+  if (kDoResize_) {
+    resized.create(kModelInputDim_, kModelInputDim_, CV_8UC1);
+    cv::resize(kRawImage, resized, cv::Size(kModelInputDim_, kModelInputDim_));
+  } else {
+    resized = kRawImage;
+  }
+  if (kCondition_ == LoaderCondition::DecodeResize)
+    return;
+
+  timer.Next(TimedStage::Normalize);
+  // The crop is a ROI of the decoded image, so rows are not contiguous
+  for (size_t row = 0, offset = 0; row < kModelInputDim_; row++) {
+    const uint8_t *in = resized.ptr(row);
+    for (size_t col = 0; col < kModelInputDim_; col++)
+      output_buf[offset++] = gray_map_[in[col]];
+  }
+}
+
+
 void DataLoader::DecodeAndPreproc(CompressedImage kCompressedBuf, float *output_buf) const {
+  DecoderMemoryScope scope;
+  StageTimer timer(TimedStage::Decode);
   cv::Mat decoded = DecodeImage(kCompressedBuf);
+  timer.Stop();
   PreprocessImage(decoded, output_buf);
 }
 
 void DataLoader::LoadAndPreproc(const std::string& kFileName, float *output_buf) const {
   auto compressed = LoadCompressedImageFromFile(kFileName);
+  DecoderMemoryScope scope;
+  StageTimer timer(TimedStage::Decode);
   cv::Mat decoded = DecodeImage(compressed);
+  timer.Stop();
   PreprocessImage(decoded, output_buf);
 }
 
+void DataLoader::DecodeAndPreprocBatch(
+    const CompressedImage *kCompressed, const size_t kNbImages, float *output_buf) const {
+  const size_t kImSize = GetImSize();
+  for (size_t i = 0; i < kNbImages; i++)
+    DecodeAndPreproc(kCompressed[i], output_buf + i * kImSize);
+}
+
+const DataLoader *FanOutLoader::PickDecoder(const std::vector<const DataLoader *>& kTargets) {
+  if (kTargets.empty())
+    throw std::invalid_argument("Fan-out needs at least one loader");
+  const DataLoader *decoder = kTargets[0];
+  for (const DataLoader *target : kTargets) {
+    if (target->GetResizeDim() > decoder->GetResizeDim())
+      decoder = target;
+  }
+  for (const DataLoader *target : kTargets) {
+    if (target != decoder && !target->SharesDecode(*decoder))
+      throw std::invalid_argument("Fan-out loaders can't share a decode");
+  }
+  return decoder;
+}
+
+void FanOutLoader::DecodeAndPreproc(CompressedImage kCompressed, float *const *output_bufs) const {
+  DecoderMemoryScope scope;
+  StageTimer timer(TimedStage::Decode);
+  cv::Mat decoded = kDecoder_->DecodeImage(kCompressed);
+  timer.Stop();
+  for (size_t i = 0; i < kTargets_.size(); i++)
+    kTargets_[i]->PreprocessImage(decoded, output_bufs[i]);
+}
+
+void FanOutLoader::DecodeAndPreprocBatch(
+    const CompressedImage *kCompressed, const size_t kNbImages, float *const *output_bufs) const {
+  std::vector<float *> bufs(output_bufs, output_bufs + kTargets_.size());
+  for (size_t i = 0; i < kNbImages; i++) {
+    DecodeAndPreproc(kCompressed[i], bufs.data());
+    for (size_t j = 0; j < bufs.size(); j++)
+      bufs[j] += kTargets_[j]->GetImSize();
+  }
+}
+
 /*std::vector<float> OptimizedDataLoader::LoadAndPreproc(const std::string& kFileName) const {
   std::vector<float> output;
   output.reserve(kModelInputDim_ * kModelInputDim_ * 3);
@@ -0,0 +1,104 @@
+#include <iostream>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "jpeglib.h"
+
+#include "data_loader.h"
+
+// Mean of the first AC basis function over half a block: (cos(pi/16) + ... + cos(7pi/16)) / 4
+static const float kHalfBlockAC = 0.6407288619f;
+static const float kInvSqrt2 = 0.7071067812f;
+
+static inline uint8_t Clamp(const float kVal) {
+  return kVal < 0 ? 0 : (kVal > 255 ? 255 : (uint8_t) (kVal + 0.5f));
+}
+
+// Mean of quadrant (kSubY, kSubX) of the block, from the 2x2 lowest frequencies, or the mean of
+// the whole block if kNbTerms == 1
+static inline float BlockSample(
+    const JCOEF *kBlock, const UINT16 *kQuant, const size_t kNbTerms,
+    const size_t kSubY, const size_t kSubX) {
+  const float kDC = kBlock[0] * kQuant[0];
+  if (kNbTerms == 1)
+    return kDC / 8 + 128;
+  const float kX = kSubX == 0 ? kHalfBlockAC : -kHalfBlockAC;
+  const float kY = kSubY == 0 ? kHalfBlockAC : -kHalfBlockAC;
+  return (kDC / 2 +
+          kInvSqrt2 * kX * kBlock[1] * kQuant[1] +
+          kInvSqrt2 * kY * kBlock[DCTSIZE] * kQuant[DCTSIZE] +
+          kX * kY * kBlock[DCTSIZE + 1] * kQuant[DCTSIZE + 1]) / 4 + 128;
+}
+
+cv::Mat DCJPEGDataLoader::DecodeImage(CompressedImage compressed) const {
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, compressed.first, compressed.second);
+  (void) jpeg_read_header(&cinfo, TRUE);
+  const J_COLOR_SPACE kColorSpace = cinfo.jpeg_color_space;
+  if (kColorSpace != JCS_YCbCr && kColorSpace != JCS_RGB && kColorSpace != JCS_GRAYSCALE) {
+    jpeg_destroy_decompress(&cinfo);
+    throw std::invalid_argument("Unsupported JPEG color space");
+  }
+  jvirt_barray_ptr *coefs = jpeg_read_coefficients(&cinfo);
+
+  // kNbTerms_ output pixels per block in each direction
+  const size_t kOutWidth = (cinfo.image_width * kNbTerms_ + DCTSIZE - 1) / DCTSIZE;
+  const size_t kOutHeight = (cinfo.image_height * kNbTerms_ + DCTSIZE - 1) / DCTSIZE;
+  const size_t kShortSide = std::min(kOutWidth, kOutHeight);
+  const size_t kCropSize = std::max((size_t) 1, (size_t) (kShortSide * kModelInputDim_ / (float) kResizeDim_));
+  const size_t kLeft = (size_t) round((kOutWidth - kCropSize) / 2.0);
+  const size_t kTop = (size_t) round((kOutHeight - kCropSize) / 2.0);
+
+  // Samples for the crop, one plane per component. Subsampled components are replicated.
+  const size_t kNbComps = cinfo.num_components == 1 ? 1 : 3;
+  std::vector<uint8_t> planes(kNbComps * kCropSize * kCropSize);
+  for (size_t c = 0; c < kNbComps; c++) {
+    const jpeg_component_info *comp = &cinfo.comp_info[c];
+    const UINT16 *kQuant = comp->quant_table->quantval;
+    const size_t kH = comp->h_samp_factor, kV = comp->v_samp_factor;
+    const size_t kMaxH = cinfo.max_h_samp_factor, kMaxV = cinfo.max_v_samp_factor;
+    uint8_t *plane = planes.data() + c * kCropSize * kCropSize;
+    for (size_t y = 0; y < kCropSize; y++) {
+      const size_t kCompY = (kTop + y) * kV / kMaxV;
+      const size_t kBlockRow = std::min(kCompY / kNbTerms_, (size_t) comp->height_in_blocks - 1);
+      // The coefficient arrays only allow v_samp_factor rows per access, so fetch one at a time
+      JBLOCKARRAY rows = (*cinfo.mem->access_virt_barray)(
+          (j_common_ptr) &cinfo, coefs[c], kBlockRow, 1, FALSE);
+      for (size_t x = 0; x < kCropSize; x++) {
+        const size_t kCompX = (kLeft + x) * kH / kMaxH;
+        const size_t kBlockCol = std::min(kCompX / kNbTerms_, (size_t) comp->width_in_blocks - 1);
+        plane[y * kCropSize + x] = Clamp(BlockSample(
+            rows[0][kBlockCol], kQuant, kNbTerms_, kCompY % kNbTerms_, kCompX % kNbTerms_));
+      }
+    }
+  }
+  jpeg_abort_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+
+  cv::Mat decoded(kCropSize, kCropSize, CV_8UC3);
+  const size_t kPlaneSize = kCropSize * kCropSize;
+  for (size_t i = 0; i < kPlaneSize; i++) {
+    uint8_t *pixel = decoded.data + 3 * i;
+    if (kNbComps == 1) {
+      pixel[0] = pixel[1] = pixel[2] = planes[i];
+    } else if (kColorSpace == JCS_RGB) {
+      pixel[0] = planes[i];
+      pixel[1] = planes[kPlaneSize + i];
+      pixel[2] = planes[2 * kPlaneSize + i];
+    } else {
+      // JFIF YCbCr -> RGB
+      const float kY = planes[i];
+      const float kCb = planes[kPlaneSize + i] - 128.f;
+      const float kCr = planes[2 * kPlaneSize + i] - 128.f;
+      pixel[0] = Clamp(kY + 1.402f * kCr);
+      pixel[1] = Clamp(kY - 0.344136f * kCb - 0.714136f * kCr);
+      pixel[2] = Clamp(kY + 1.772f * kCb);
+    }
+  }
+  return decoded;
+}
@@ -1,16 +1,28 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <fstream>
 #include <future>
 #include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "experiment_server.h"
+#include "live_metrics.h"
+#include "memory_stats.h"
+#include "queue_monitor.h"
+#include "stage_timer.h"
 
 std::vector<float> ExperimentServer::RunInferenceOnFiles(const std::vector<std::string>& kFileNames) {
   std::vector<float> output, batch;
   output.reserve(kFileNames.size() * kOutputSingle_);
   batch.reserve(kBatchSize_ * kImSize_);
+  MemoryCharge output_charge(MemoryOwner::Output, output.capacity() * sizeof(float));
 
   /*#pragma omp parallel for
   for (size_t i = 0; i < kFileNames.size(); i++) {
@@ -40,8 +52,11 @@ std::vector<float> ExperimentServer::RunInferenceOnFiles(const std::vector<std::
 
   #pragma omp parallel for
   for (size_t i = 0; i < kFileNames.size(); i += kBatchSize_) {
+    TraceSpan span("batch", i);
     Batch batch;
-    batch_queue_.blockingRead(batch);
+    StageTimer wait_timer(TimedStage::BatchWait);
+    MonitoredRead(&batch_queue_, batch, QueueKind::Batch);
+    wait_timer.Stop();
     for (size_t j = 0; j < kBatchSize_; j++) {
       if (i + j < kFileNames.size()) {
         kLoader_.LoadAndPreproc(
@@ -51,6 +66,7 @@ std::vector<float> ExperimentServer::RunInferenceOnFiles(const std::vector<std::
     }
     const size_t kOutputSize =
         std::min(kFileNames.size() - i, kBatchSize_) * kOutputSingle_;
+    LiveMetrics::AddImages(kStage_, std::min(kFileNames.size() - i, kBatchSize_));
     kInfer_->RunInference(
         std::make_tuple(std::move(batch), kBatchSize_,
                         output.data() + i * kOutputSingle_, kOutputSize,
@@ -74,15 +90,16 @@ void ExperimentServer::RunInferenceOnCompressed(
     std::vector<float> *output) {
   #pragma omp parallel for
   for (size_t i = 0; i < kCompressedImages.size(); i += kBatchSize_) {
+    TraceSpan span("batch", i);
     Batch batch;
-    batch_queue_.blockingRead(batch);
-    for (size_t j = 0; j < kBatchSize_; j++) {
-      if (i + j < kCompressedImages.size()) {
-        kLoader_.DecodeAndPreproc(
-            kCompressedImages[i + j],
-            batch.get()->data() + j * kImSize_);
-      }
-    }
+    StageTimer wait_timer(TimedStage::BatchWait);
+    MonitoredRead(&batch_queue_, batch, QueueKind::Batch);
+    wait_timer.Stop();
+    kLoader_.DecodeAndPreprocBatch(
+        kCompressedImages.data() + i,
+        std::min(kCompressedImages.size() - i, kBatchSize_),
+        batch.get()->data());
+    LiveMetrics::AddImages(kStage_, std::min(kCompressedImages.size() - i, kBatchSize_));
     if (kRunInfer_) {
       const size_t kOutputSize =
           std::min(kCompressedImages.size() - i, kBatchSize_) * kOutputSingle_;
@@ -92,7 +109,8 @@ void ExperimentServer::RunInferenceOnCompressed(
                           kOutputSize,
                           &batch_queue_));
     } else {
-      batch_queue_.blockingWrite(std::move(batch));
+      TraceSpan span("batch-queue-write");
+      MonitoredWrite(&batch_queue_, std::move(batch), QueueKind::Batch);
     }
   }
   /*std::vector<std::future<void> > async_results;
@@ -138,11 +156,59 @@ void ExperimentServer::RunInferenceOnCompressed(
 
 
 
-std::pair<float, std::vector<float> > ExperimentServer::TimeNoLoad(const std::vector<CompressedImage>& kCompressedImages) {
+void ExperimentServer::RunInferenceCached(
+    const std::vector<CompressedImage>& kCompressedImages,
+    ResultCache *results, std::vector<float> *output) {
+  const size_t kNbImages = kCompressedImages.size();
+  std::vector<uint64_t> keys(kNbImages);
+  #pragma omp parallel for
+  for (size_t i = 0; i < kNbImages; i++)
+    keys[i] = results->Key(kCompressedImages[i]);
+
+  // Repeats copy the row of the first image with their content
+  std::unordered_map<uint64_t, size_t> firsts;
+  std::vector<size_t> misses;
+  for (size_t i = 0; i < kNbImages; i++) {
+    if (!firsts.emplace(keys[i], i).second)
+      continue;
+    if (!results->Get(keys[i], output->data() + i * kOutputSingle_))
+      misses.push_back(i);
+  }
+  // The rest count once they are run
+  LiveMetrics::AddImages(kStage_, kNbImages - misses.size());
+
+  std::vector<CompressedImage> to_run(misses.size());
+  for (size_t k = 0; k < misses.size(); k++)
+    to_run[k] = kCompressedImages[misses[k]];
+  std::vector<float> run_output(misses.size() * kOutputSingle_);
+  RunInferenceOnCompressed(to_run, &run_output);
+  for (size_t k = 0; k < misses.size(); k++) {
+    const float *kRow = run_output.data() + k * kOutputSingle_;
+    std::copy(kRow, kRow + kOutputSingle_, output->begin() + misses[k] * kOutputSingle_);
+    results->Put(keys[misses[k]], kRow);
+  }
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < kNbImages; i++) {
+    const size_t kFirst = firsts.find(keys[i])->second;
+    if (kFirst != i)
+      std::copy(output->begin() + kFirst * kOutputSingle_,
+                output->begin() + (kFirst + 1) * kOutputSingle_,
+                output->begin() + i * kOutputSingle_);
+  }
+}
+
+std::pair<float, std::vector<float> > ExperimentServer::TimeNoLoad(
+    const std::vector<CompressedImage>& kCompressedImages, ResultCache *results) {
   std::vector<float> output(kCompressedImages.size() * kOutputSingle_);
+  MemoryCharge output_charge(MemoryOwner::Output, output.size() * sizeof(float));
 
   auto start = std::chrono::high_resolution_clock::now();
-  RunInferenceOnCompressed(kCompressedImages, &output);
+  // Without inference there are no rows to cache
+  if (results != NULL && kRunInfer_)
+    RunInferenceCached(kCompressedImages, results, &output);
+  else
+    RunInferenceOnCompressed(kCompressedImages, &output);
   auto end = std::chrono::high_resolution_clock::now();
   std::chrono::duration<double, std::milli> diff = end - start;
   float time = diff.count() / 1000.0;
@@ -153,13 +219,17 @@ float ExperimentServer::TimeInferenceOnly() {
   const size_t kNbBatches = 1000;
   // BatchBase output(kNbBatches * kBatchSize_ * kOutputSingle_);
   std::vector<float> output(kNbBatches * kBatchSize_ * kOutputSingle_);
+  MemoryCharge output_charge(MemoryOwner::Output, output.size() * sizeof(float));
 
   auto start = std::chrono::high_resolution_clock::now();
 
   #pragma omp parallel for
   for (size_t i = 0; i < kNbBatches; i++) {
+    TraceSpan span("batch", i);
     Batch batch;
-    batch_queue_.blockingRead(batch);
+    StageTimer wait_timer(TimedStage::BatchWait);
+    MonitoredRead(&batch_queue_, batch, QueueKind::Batch);
+    wait_timer.Stop();
     kInfer_->RunInference(
         std::make_tuple(
             std::move(batch), kBatchSize_,
@@ -189,13 +259,11 @@ float ExperimentServer::TimeDecodePreprocOnly(const std::vector<CompressedImage>
   }*/
   #pragma omp parallel for
   for (size_t i = 0; i < kCompressedImages.size(); i += kBatchSize_) {
-    for (size_t j = 0; j < kBatchSize_; j++) {
-      if (i + j < kCompressedImages.size()) {
-        kLoader_.DecodeAndPreproc(
-            kCompressedImages[i + j],
-            batch.data() + j * kImSize_);
-      }
-    }
+    TraceSpan span("batch", i);
+    kLoader_.DecodeAndPreprocBatch(
+        kCompressedImages.data() + i,
+        std::min(kCompressedImages.size() - i, kBatchSize_),
+        batch.data());
   }
 
 
@@ -203,3 +271,114 @@ float ExperimentServer::TimeDecodePreprocOnly(const std::vector<CompressedImage>
   std::chrono::duration<double, std::milli> diff = end - start;
   return diff.count() / 1000.0;
 }
+
+ServingStats ExperimentServer::ServeOnline(
+    const std::vector<CompressedImage>& kCompressedImages, const size_t kNbRequests,
+    const double kArrivalRate, const std::chrono::microseconds kMaxBatchDelay,
+    const uint64_t kSeed, std::vector<float> *output) {
+  if (kArrivalRate <= 0)
+    throw std::invalid_argument("The arrival rate must be positive");
+  const size_t kNbWorkers = omp_get_max_threads();
+  output->resize(kNbRequests * kOutputSingle_);
+  MemoryCharge output_charge(MemoryOwner::Output, output->size() * sizeof(float));
+  std::vector<Clock::time_point> arrivals(kNbRequests), decode_starts(kNbRequests),
+      dones(kNbRequests);
+  // Holds every request, so the generator never waits on the workers
+  folly::MPMCQueue<OnlineRequest> requests(kNbRequests + kNbWorkers);
+  // Sync doesn't wait for the callbacks, which time the outputs
+  std::atomic<size_t> nb_pending(0);
+
+  // Open loop: arrivals are stamped with their scheduled time, so a late generator can't hide
+  // queueing behind it
+  const Clock::time_point kStart = Clock::now();
+  std::thread generator([&]() {
+    std::mt19937_64 gen(kSeed);
+    std::exponential_distribution<double> gap(kArrivalRate);
+    Clock::time_point next = kStart;
+    for (size_t r = 0; r < kNbRequests; r++) {
+      next += std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(gap(gen)));
+      std::this_thread::sleep_until(next);
+      arrivals[r] = next;
+      requests.blockingWrite(OnlineRequest{r, next});
+    }
+    for (size_t w = 0; w < kNbWorkers; w++)
+      requests.blockingWrite(OnlineRequest{kNoRequest_, Clock::now()});
+  });
+
+  #pragma omp parallel num_threads(kNbWorkers)
+  {
+    bool finished = false;
+    while (!finished) {
+      OnlineRequest request;
+      requests.blockingRead(request);
+      if (request.idx == kNoRequest_)
+        break;
+      std::vector<size_t> indices{request.idx};
+      const Clock::time_point kDeadline = request.arrival + kMaxBatchDelay;
+      while (indices.size() < kBatchSize_ && requests.tryReadUntil(kDeadline, request)) {
+        if (request.idx == kNoRequest_) {
+          finished = true;
+          break;
+        }
+        indices.push_back(request.idx);
+      }
+      const size_t kNbImages = indices.size();
+      TraceSpan span("online-batch", kNbImages);
+
+      Batch batch;
+      StageTimer wait_timer(TimedStage::BatchWait);
+      MonitoredRead(&batch_queue_, batch, QueueKind::Batch);
+      wait_timer.Stop();
+      std::vector<CompressedImage> images(kNbImages);
+      const Clock::time_point kDecodeStart = Clock::now();
+      for (size_t k = 0; k < kNbImages; k++) {
+        images[k] = kCompressedImages[indices[k] % kCompressedImages.size()];
+        decode_starts[indices[k]] = kDecodeStart;
+      }
+      kLoader_.DecodeAndPreprocBatch(images.data(), kNbImages, batch.get()->data());
+
+      // Requests aren't contiguous, so rows land in a buffer per batch first
+      auto batch_output = std::make_shared<std::vector<float> >(kNbImages * kOutputSingle_);
+      nb_pending++;
+      auto on_done = [this, batch_output, indices, output, &dones, &nb_pending]() {
+        const Clock::time_point kNow = Clock::now();
+        for (size_t k = 0; k < indices.size(); k++) {
+          std::copy(batch_output->begin() + k * kOutputSingle_,
+                    batch_output->begin() + (k + 1) * kOutputSingle_,
+                    output->begin() + indices[k] * kOutputSingle_);
+          dones[indices[k]] = kNow;
+        }
+        LiveMetrics::AddImages(kStage_, indices.size());
+        nb_pending--;
+      };
+      if (kRunInfer_) {
+        kInfer_->RunInference(
+            std::make_tuple(std::move(batch), kBatchSize_,
+                            batch_output->data(), kNbImages * kOutputSingle_,
+                            &batch_queue_),
+            on_done);
+      } else {
+        MonitoredWrite(&batch_queue_, std::move(batch), QueueKind::Batch);
+        on_done();
+      }
+    }
+  }
+  generator.join();
+  kInfer_->Sync();
+  while (nb_pending.load() > 0)
+    std::this_thread::yield();
+
+  ServingStats stats;
+  stats.nb_requests = kNbRequests;
+  Clock::time_point last = kStart;
+  for (size_t r = 0; r < kNbRequests; r++) {
+    stats.queue.Record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(decode_starts[r] - arrivals[r]).count());
+    stats.total.Record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(dones[r] - arrivals[r]).count());
+    last = std::max(last, dones[r]);
+  }
+  stats.runtime = std::chrono::duration<float>(last - kStart).count();
+  return stats;
+}
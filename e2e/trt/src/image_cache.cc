@@ -0,0 +1,33 @@
+#include "image_cache.h"
+
+void ImageCache::Put(const size_t kIndex, const cv::Mat& kImage) {
+  const size_t kBytes = Footprint(kImage);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (bytes_ + kBytes > kBudgetBytes_ || images_.count(kIndex) != 0) {
+    nb_dropped_++;
+    return;
+  }
+  images_.emplace(kIndex, kImage);
+  bytes_ += kBytes;
+}
+
+bool ImageCache::Get(const size_t kIndex, cv::Mat *image) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = images_.find(kIndex);
+  if (it == images_.end()) {
+    nb_misses_++;
+    return false;
+  }
+  nb_hits_++;
+  *image = it->second;
+  return true;
+}
+
+void ImageCache::Erase(const size_t kIndex) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = images_.find(kIndex);
+  if (it == images_.end())
+    return;
+  bytes_ -= Footprint(it->second);
+  images_.erase(it);
+}
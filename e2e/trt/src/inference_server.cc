@@ -8,6 +8,7 @@
 
 #include "calibrator.h"
 #include "inference_server.h"
+#include "stage_timer.h"
 
 
 static void add_resize(nvinfer1::INetworkDefinition *network, const int32_t kBatchSize) {
@@ -89,7 +90,8 @@ nvinfer1::ICudaEngine* OnnxInferenceServer::GetCudaEngine(const std::string& kEn
 OnnxInferenceServer::OnnxInferenceServer(
     const std::string& kEnginePath, const size_t kBatchSize, const bool kDoMemcpy) :
     kBatchSize_(kBatchSize),
-    queue_(omp_get_max_threads() * 3), contexts(kNbStreams_),
+    queue_(omp_get_max_threads() * 3), kQueueRegistration_(QueueKind::Infer, &queue_),
+    contexts(kNbStreams_),
     kDoMemcpy_(kDoMemcpy) {
   // TensorRT engine stuff
   this->engine.reset(GetCudaEngine(kEnginePath));
@@ -107,7 +109,8 @@ OnnxInferenceServer::OnnxInferenceServer(
     const bool kAddResize
 ) :
     kBatchSize_(kBatchSize),
-    queue_(omp_get_max_threads() * 3), contexts(kNbStreams_),
+    queue_(omp_get_max_threads() * 3), kQueueRegistration_(QueueKind::Infer, &queue_),
+    contexts(kNbStreams_),
     kDoMemcpy_(kDoMemcpy) {
   BaseCalibrator *calibrator = NULL;
   if (kDoINT8) {
@@ -136,7 +139,8 @@ OnnxInferenceServer::OnnxInferenceServer(
     const bool kAddResize
 ) :
     kBatchSize_(kBatchSize),
-    queue_(omp_get_max_threads() * 3), contexts(kNbStreams_),
+    queue_(omp_get_max_threads() * 3), kQueueRegistration_(QueueKind::Infer, &queue_),
+    contexts(kNbStreams_),
     kDoMemcpy_(kDoMemcpy) {
   BaseCalibrator *calibrator = NULL;
   if (kDoINT8) {
@@ -179,18 +183,24 @@ void OnnxInferenceServer::LoadAndLaunch() {
 
 
 void OnnxInferenceServer::_RunInferenceThread(const size_t idx) {
+  Tracer::SetThreadName("infer-stream-" + std::to_string(idx));
   const int input_id = !contexts[idx]->getEngine().bindingIsInput(0);
-  QueueData input_data;
+  InferWork work;
   folly::MPMCQueue<Batch> *batch_queue;
   size_t output_size, batch_size;
   float *output_buf;
   while (true) {
-    queue_.blockingRead(input_data);
+    MonitoredRead(&queue_, work, QueueKind::Infer);
+    QueueData& input_data = work.data;
     std::tie(std::ignore, batch_size, output_buf, output_size, batch_queue) = input_data;
     if (batch_size == 0) {
       cudaStreamSynchronize(streams[idx]);
       break;
     }
+    const bool kTimed = StageTimers::IsEnabled() || Tracer::IsEnabled();
+    if (kTimed || LiveMetrics::IsEnabled())
+      StageTimers::RecordSpan(TimedStage::InferQueueWait, work.queued, Tracer::Clock::now());
+    StageTimer timer(TimedStage::Infer);
     Batch kData = std::move(std::get<0>(input_data));
     if (kDoMemcpy_) {
       cudaMemcpyAsync(bindings[idx][input_id],
@@ -205,13 +215,32 @@ void OnnxInferenceServer::_RunInferenceThread(const size_t idx) {
                       output_size * sizeof(float),
                       cudaMemcpyDeviceToHost, streams[idx]);
     }
-    if (batch_queue != nullptr)
-      batch_queue->blockingWrite(std::move(kData));
+    // Timing waits for the stream, which otherwise only happens for callbacks
+    if (work.on_done || kTimed)
+      cudaStreamSynchronize(streams[idx]);
+    timer.Stop();
+    // Callbacks may let the queue's owner finish and free it, so the batch goes back first
+    if (batch_queue != nullptr) {
+      TraceSpan span("batch-queue-write");
+      MonitoredWrite(batch_queue, std::move(kData), QueueKind::Batch);
+    }
+    if (work.on_done)
+      work.on_done();
   }
 }
 
 void OnnxInferenceServer::RunInference(QueueData data) {
-  queue_.blockingWrite(std::move(data));
+  TraceSpan span("infer-queue-write");
+  MonitoredWrite(&queue_, InferWork{
+      std::move(data), std::function<void()>(), std::chrono::steady_clock::now()},
+      QueueKind::Infer);
+}
+
+void OnnxInferenceServer::RunInference(QueueData data, std::function<void()> kOnDone) {
+  TraceSpan span("infer-queue-write");
+  MonitoredWrite(&queue_, InferWork{
+      std::move(data), std::move(kOnDone), std::chrono::steady_clock::now()},
+      QueueKind::Infer);
 }
 
 void OnnxInferenceServer::Sync() {
@@ -0,0 +1,259 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "live_metrics.h"
+#include "per_thread.h"
+#include "queue_monitor.h"
+#include "stage_timer.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static const size_t kNbStages = (size_t) TimedStage::NbStages;
+static const size_t kMaxStages = LiveMetrics::kMaxStages;
+
+std::atomic<bool> LiveMetrics::enabled_(false);
+
+// Written only by their thread, with plain loads and stores
+struct ThreadLiveCounters {
+  std::atomic<uint64_t> images[kMaxStages];
+  std::atomic<uint64_t> busy_ns[kNbStages];
+
+  ThreadLiveCounters() {
+    for (auto& count : images)
+      count.store(0, std::memory_order_relaxed);
+    for (auto& nanos : busy_ns)
+      nanos.store(0, std::memory_order_relaxed);
+  }
+};
+
+typedef PerThreadRegistry<ThreadLiveCounters> CountersRegistry;
+
+static ThreadLiveCounters *GetThreadLiveCounters() { return CountersRegistry::Get(); }
+
+void LiveMetrics::RecordImages(const size_t kStage, const uint64_t kNbImages) {
+  Bump(&GetThreadLiveCounters()->images[std::min(kStage, kMaxStages - 1)], kNbImages);
+}
+
+void LiveMetrics::AddBusy(const TimedStage kStage, const uint64_t kNanos) {
+  Bump(&GetThreadLiveCounters()->busy_ns[(size_t) kStage], kNanos);
+}
+
+struct Totals {
+  Clock::time_point time;
+  uint64_t images[kMaxStages] = {};
+  uint64_t busy_ns[kNbStages] = {};
+};
+
+static Totals GetTotals() {
+  Totals totals;
+  totals.time = Clock::now();
+  auto lock = CountersRegistry::Lock();
+  for (const auto& counters : CountersRegistry::GetAll()) {
+    for (size_t s = 0; s < kMaxStages; s++)
+      totals.images[s] += counters->images[s].load(std::memory_order_relaxed);
+    for (size_t s = 0; s < kNbStages; s++)
+      totals.busy_ns[s] += counters->busy_ns[s].load(std::memory_order_relaxed);
+  }
+  return totals;
+}
+
+// Totals at Enable and then every second, enough to cover the longest window
+static const std::chrono::seconds kSnapshotPeriod(1);
+static const size_t kMaxSnapshots = 62;
+static const int kWindows[] = {1, 10, 60};
+static const int kBusyWindow = 10;
+
+static std::mutex snapshots_mutex;
+static std::deque<Totals> snapshots;
+
+static std::string socket_path;
+static int listen_fd = -1;
+static std::atomic<bool> stop_server(false);
+static std::thread server;
+
+// The latest snapshot at least kSeconds old, or the first one early on
+static Totals GetSnapshotBefore(const Clock::time_point kNow, const int kSeconds) {
+  std::lock_guard<std::mutex> lock(snapshots_mutex);
+  for (auto it = snapshots.rbegin(); it != snapshots.rend(); ++it) {
+    if (kNow - it->time >= std::chrono::seconds(kSeconds))
+      return *it;
+  }
+  return snapshots.front();
+}
+
+static double Seconds(const Clock::duration kDuration) {
+  return std::chrono::duration<double>(kDuration).count();
+}
+
+std::string LiveMetrics::GetJson() {
+  const Totals kNow = GetTotals();
+  Clock::time_point start;
+  {
+    std::lock_guard<std::mutex> lock(snapshots_mutex);
+    if (snapshots.empty())
+      return "{}\n";
+    start = snapshots.front().time;
+  }
+  // Stages past the last one reached are left out
+  size_t nb_stages = 1;
+  for (size_t s = 0; s < kMaxStages; s++) {
+    if (kNow.images[s] > 0)
+      nb_stages = s + 1;
+  }
+
+  std::ostringstream json;
+  json << "{\"uptime-s\": " << Seconds(kNow.time - start)
+       << ", \"images\": " << kNow.images[0] << ", \"stage-images\": [";
+  for (size_t s = 0; s < nb_stages; s++)
+    json << (s == 0 ? "" : ", ") << kNow.images[s];
+  json << "], \"pass-through\": [";
+  for (size_t s = 1; s < nb_stages; s++) {
+    json << (s == 1 ? "" : ", ")
+         << (kNow.images[s - 1] == 0 ? 0 : kNow.images[s] / (double) kNow.images[s - 1]);
+  }
+  json << "], \"images-per-s\": {";
+  for (size_t w = 0; w < sizeof(kWindows) / sizeof(kWindows[0]); w++) {
+    const Totals kThen = GetSnapshotBefore(kNow.time, kWindows[w]);
+    const double kElapsed = Seconds(kNow.time - kThen.time);
+    json << (w == 0 ? "" : ", ") << "\"" << kWindows[w] << "s\": "
+         << (kElapsed <= 0 ? 0 : (kNow.images[0] - kThen.images[0]) / kElapsed);
+  }
+  // Time spent in a stage over wall time is the mean number of threads in it
+  json << "}, \"busy-threads\": {";
+  const Totals kThen = GetSnapshotBefore(kNow.time, kBusyWindow);
+  const double kElapsedNanos = Seconds(kNow.time - kThen.time) * 1e9;
+  for (size_t s = 0; s < kNbStages; s++) {
+    json << (s == 0 ? "" : ", ") << "\"" << GetStageName((TimedStage) s) << "\": "
+         << (kElapsedNanos <= 0 ? 0 : (kNow.busy_ns[s] - kThen.busy_ns[s]) / kElapsedNanos);
+  }
+  json << "}, \"queues\": [";
+  const std::vector<QueueDepth> kDepths = QueueMonitor::GetDepths();
+  for (size_t i = 0; i < kDepths.size(); i++) {
+    json << (i == 0 ? "" : ", ") << "{\"id\": " << kDepths[i].id
+         << ", \"kind\": \"" << GetQueueName(kDepths[i].kind) << "\""
+         << ", \"depth\": " << kDepths[i].depth
+         << ", \"capacity\": " << kDepths[i].capacity << "}";
+  }
+  json << "]}\n";
+  return json.str();
+}
+
+static void SendAll(const int kFd, const std::string& kData) {
+  size_t sent = 0;
+  while (sent < kData.size()) {
+    const ssize_t kNbSent = send(kFd, kData.data() + sent, kData.size() - sent, MSG_NOSIGNAL);
+    if (kNbSent < 0 && errno == EINTR)
+      continue;
+    if (kNbSent <= 0)
+      return;
+    sent += kNbSent;
+  }
+}
+
+// Clients that send nothing get the JSON right away; scrapers don't have to speak HTTP
+static void HandleClient(const int kFd) {
+  const int kRequestTimeoutMs = 10;
+  char request[1024];
+  ssize_t nb_read = 0;
+  struct pollfd pfd = {kFd, POLLIN, 0};
+  if (poll(&pfd, 1, kRequestTimeoutMs) > 0)
+    nb_read = recv(kFd, request, sizeof(request), 0);
+  const std::string kBody = LiveMetrics::GetJson();
+  if (nb_read >= 4 && strncmp(request, "GET ", 4) == 0) {
+    SendAll(kFd, "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\nContent-Length: " +
+                 std::to_string(kBody.size()) + "\r\nConnection: close\r\n\r\n");
+  }
+  SendAll(kFd, kBody);
+  close(kFd);
+}
+
+static void Serve() {
+  // Short enough for Disable not to wait long
+  const int kPollTimeoutMs = 100;
+  Clock::time_point last_snapshot = Clock::now();
+  while (!stop_server.load(std::memory_order_relaxed)) {
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    const int kNbReady = poll(&pfd, 1, kPollTimeoutMs);
+    if (Clock::now() - last_snapshot >= kSnapshotPeriod) {
+      const Totals kTotals = GetTotals();
+      last_snapshot = kTotals.time;
+      std::lock_guard<std::mutex> lock(snapshots_mutex);
+      snapshots.push_back(kTotals);
+      if (snapshots.size() > kMaxSnapshots)
+        snapshots.pop_front();
+    }
+    if (kNbReady <= 0)
+      continue;
+    const int kFd = accept(listen_fd, NULL, NULL);
+    if (kFd >= 0)
+      HandleClient(kFd);
+  }
+}
+
+void LiveMetrics::Enable(const std::string& kPath) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (kPath.empty() || kPath.size() >= sizeof(addr.sun_path))
+    throw std::invalid_argument("Metrics socket path must be 1 to " +
+                                std::to_string(sizeof(addr.sun_path) - 1) + " characters");
+  Disable();
+  strncpy(addr.sun_path, kPath.c_str(), sizeof(addr.sun_path) - 1);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0)
+    throw std::runtime_error("Couldn't create metrics socket: " + std::string(strerror(errno)));
+  // A previous run may have left its socket behind; anything else at the path is a mistake
+  struct stat st;
+  if (lstat(kPath.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      close(listen_fd);
+      listen_fd = -1;
+      throw std::invalid_argument("Metrics socket path " + kPath + " exists and isn't a socket");
+    }
+    unlink(kPath.c_str());
+  }
+  if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+      listen(listen_fd, 16) != 0) {
+    const std::string kError = strerror(errno);
+    close(listen_fd);
+    listen_fd = -1;
+    throw std::runtime_error("Couldn't listen on metrics socket " + kPath + ": " + kError);
+  }
+  socket_path = kPath;
+
+  {
+    std::lock_guard<std::mutex> lock(snapshots_mutex);
+    snapshots.clear();
+    snapshots.push_back(GetTotals());
+  }
+  stop_server.store(false, std::memory_order_relaxed);
+  server = std::thread(Serve);
+  enabled_.store(true, std::memory_order_relaxed);
+}
+
+void LiveMetrics::Disable() {
+  enabled_.store(false, std::memory_order_relaxed);
+  if (!server.joinable())
+    return;
+  stop_server.store(true, std::memory_order_relaxed);
+  server.join();
+  close(listen_fd);
+  listen_fd = -1;
+  unlink(socket_path.c_str());
+}
@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <cstdio>
+#include <errno.h>
+
+#include <malloc.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "memory_stats.h"
+#include "per_thread.h"
+
+static const size_t kNbOwners = (size_t) MemoryOwner::NbOwners;
+
+const char *GetOwnerName(const MemoryOwner kOwner) {
+  static const char *kNames[kNbOwners] = {"compressed", "batch-pool", "output", "decoder"};
+  return kNames[(size_t) kOwner];
+}
+
+std::atomic<bool> MemoryStats::enabled_(false);
+
+static std::atomic<int64_t> owner_bytes[kNbOwners];
+static std::atomic<int64_t> owner_peaks[kNbOwners];
+
+// Written only by their thread, with plain loads and stores, so counting costs no locked
+// instructions. Must not allocate: it runs inside malloc.
+struct ThreadAllocs {
+  std::atomic<uint64_t> nb_allocs;
+  std::atomic<uint64_t> bytes;
+  // Usable bytes allocated minus freed by this thread, which goes negative when it frees what
+  // others allocated
+  std::atomic<int64_t> live;
+  std::atomic<int64_t> decoder_peak;
+  int64_t decoder_base;
+  size_t decoder_depth;
+};
+
+// Zero before any constructor runs, since malloc may be called first. Threads past the last
+// slot aren't counted.
+static const size_t kMaxThreads = 4096;
+static ThreadAllocs thread_allocs[kMaxThreads];
+static std::atomic<size_t> nb_threads(0);
+
+static ThreadAllocs *GetThreadAllocs() {
+  static thread_local ThreadAllocs *allocs __attribute__((tls_model("initial-exec"))) = NULL;
+  static thread_local bool registered __attribute__((tls_model("initial-exec"))) = false;
+  if (!registered) {
+    const size_t kSlot = nb_threads.fetch_add(1, std::memory_order_relaxed);
+    allocs = kSlot < kMaxThreads ? &thread_allocs[kSlot] : NULL;
+    registered = true;
+  }
+  return allocs;
+}
+
+static void CountAlloc(void *ptr) {
+  if (ptr == NULL || !MemoryStats::IsEnabled())
+    return;
+  ThreadAllocs *allocs = GetThreadAllocs();
+  if (allocs == NULL)
+    return;
+  const int64_t kSize = malloc_usable_size(ptr);
+  Bump<uint64_t>(&allocs->nb_allocs, 1);
+  Bump<uint64_t>(&allocs->bytes, kSize);
+  Bump<int64_t>(&allocs->live, kSize);
+  if (allocs->decoder_depth > 0) {
+    const int64_t kUsed = allocs->live.load(std::memory_order_relaxed) - allocs->decoder_base;
+    if (kUsed > allocs->decoder_peak.load(std::memory_order_relaxed))
+      allocs->decoder_peak.store(kUsed, std::memory_order_relaxed);
+  }
+}
+
+static void CountFree(void *ptr) {
+  if (ptr == NULL || !MemoryStats::IsEnabled())
+    return;
+  ThreadAllocs *allocs = GetThreadAllocs();
+  if (allocs != NULL)
+    Bump<int64_t>(&allocs->live, -(int64_t) malloc_usable_size(ptr));
+}
+
+// Replacing malloc costs every allocation in the process a call and a branch, enabled or not, so
+// only builds with MALLOC_HOOKS on do it
+#if defined(__GLIBC__) && defined(MALLOC_HOOKS)
+// Everything else in the process, operator new included, reaches these through the PLT
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+  void *ptr = __libc_malloc(size);
+  CountAlloc(ptr);
+  return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  void *ptr = __libc_calloc(nmemb, size);
+  CountAlloc(ptr);
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+  CountFree(ptr);
+  void *ret = __libc_realloc(ptr, size);
+  // A failed realloc keeps the old block
+  CountAlloc(ret == NULL && size > 0 ? ptr : ret);
+  return ret;
+}
+
+void *memalign(size_t alignment, size_t size) {
+  void *ptr = __libc_memalign(alignment, size);
+  CountAlloc(ptr);
+  return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+  void *ptr = memalign(alignment, size);
+  if (ptr == NULL && size > 0)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+void free(void *ptr) {
+  CountFree(ptr);
+  __libc_free(ptr);
+}
+}
+
+bool MemoryStats::CountsAllocs() { return true; }
+#else
+bool MemoryStats::CountsAllocs() { return false; }
+#endif
+
+void MemoryStats::Charge(const MemoryOwner kOwner, const int64_t kBytes) {
+  const size_t kIdx = (size_t) kOwner;
+  const int64_t kNow = owner_bytes[kIdx].fetch_add(kBytes, std::memory_order_relaxed) + kBytes;
+  int64_t peak = owner_peaks[kIdx].load(std::memory_order_relaxed);
+  while (kNow > peak &&
+         !owner_peaks[kIdx].compare_exchange_weak(peak, kNow, std::memory_order_relaxed)) ;
+}
+
+uint64_t MemoryStats::GetBytes(const MemoryOwner kOwner) {
+  return std::max((int64_t) 0, owner_bytes[(size_t) kOwner].load(std::memory_order_relaxed));
+}
+
+uint64_t MemoryStats::GetPeakBytes(const MemoryOwner kOwner) {
+  if (kOwner != MemoryOwner::Decoder)
+    return owner_peaks[(size_t) kOwner].load(std::memory_order_relaxed);
+  // Every thread may reach its peak at once
+  const size_t kNbThreads = std::min(nb_threads.load(std::memory_order_relaxed), kMaxThreads);
+  uint64_t total = 0;
+  for (size_t i = 0; i < kNbThreads; i++)
+    total += thread_allocs[i].decoder_peak.load(std::memory_order_relaxed);
+  return total;
+}
+
+AllocCounts MemoryStats::GetAllocs() {
+  const size_t kNbThreads = std::min(nb_threads.load(std::memory_order_relaxed), kMaxThreads);
+  AllocCounts counts;
+  for (size_t i = 0; i < kNbThreads; i++) {
+    counts.nb_allocs += thread_allocs[i].nb_allocs.load(std::memory_order_relaxed);
+    counts.bytes += thread_allocs[i].bytes.load(std::memory_order_relaxed);
+  }
+  return counts;
+}
+
+uint64_t MemoryStats::GetRSS() {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL)
+    return 0;
+  unsigned long nb_pages = 0, nb_resident = 0;
+  const int kNbRead = fscanf(statm, "%lu %lu", &nb_pages, &nb_resident);
+  fclose(statm);
+  return kNbRead == 2 ? (uint64_t) nb_resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+uint64_t MemoryStats::GetPeakRSS() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  // In kilobytes on Linux
+  return (uint64_t) usage.ru_maxrss << 10;
+}
+
+void MemoryStats::Print(std::ostream& os, const size_t kNbImages) {
+  const double kMB = 1 << 20;
+  os << "Memory RSS: " << GetRSS() / kMB << " MB, peak RSS: " << GetPeakRSS() / kMB << " MB"
+     << std::endl;
+  for (size_t o = 0; o < kNbOwners; o++) {
+    const MemoryOwner kOwner = (MemoryOwner) o;
+    if (kOwner == MemoryOwner::Decoder && !CountsAllocs())
+      continue;
+    os << "Memory " << GetOwnerName(kOwner);
+    if (kOwner != MemoryOwner::Decoder)
+      os << ": " << GetBytes(kOwner) / kMB << " MB, peak";
+    os << ": " << GetPeakBytes(kOwner) / kMB << " MB" << std::endl;
+  }
+  if (!IsEnabled() || kNbImages == 0)
+    return;
+  if (!CountsAllocs()) {
+    os << "Allocations aren't counted, build with -D MALLOC_HOOKS=ON" << std::endl;
+    return;
+  }
+  const AllocCounts kAllocs = GetAllocs();
+  os << "Allocations/image: " << kAllocs.nb_allocs / (double) kNbImages
+     << ", allocated bytes/image: " << kAllocs.bytes / (double) kNbImages << std::endl;
+}
+
+DecoderMemoryScope::DecoderMemoryScope() : kActive_(MemoryStats::IsEnabled()) {
+  if (!kActive_)
+    return;
+  ThreadAllocs *allocs = GetThreadAllocs();
+  if (allocs != NULL && allocs->decoder_depth++ == 0)
+    allocs->decoder_base = allocs->live.load(std::memory_order_relaxed);
+}
+
+DecoderMemoryScope::~DecoderMemoryScope() {
+  ThreadAllocs *allocs = GetThreadAllocs();
+  if (kActive_ && allocs != NULL)
+    allocs->decoder_depth--;
+}
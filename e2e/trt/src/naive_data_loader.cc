@@ -8,6 +8,7 @@
 #include "jpeglib.h"
 
 #include "data_loader.h"
+#include "stage_timer.h"
 
 cv::Mat NaiveDataLoader::DecodeImage(CompressedImage compressed) const {
   cv::Mat raw_data(1, compressed.second, CV_8UC1, (void*) compressed.first);
@@ -24,6 +25,7 @@ void NaiveDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *output_bu
   cv::Mat resized, normalized;
 
   // Resize
+  StageTimer timer(TimedStage::Resize);
   auto new_resol = RatioPreservingResize(kResizeDim_, kRawImage.cols, kRawImage.rows);
   cv::resize(kRawImage, resized, cv::Size(new_resol.first, new_resol.second));
   if (kCondition_ == LoaderCondition::DecodeResize)
@@ -36,6 +38,7 @@ void NaiveDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *output_bu
   cv::Mat center_cropped = resized(crop_region);
 
   // Normalization
+  timer.Next(TimedStage::Normalize);
   center_cropped.convertTo(normalized, CV_32FC3, 1/255.0);
   normalized -= cv::Scalar(0.485, 0.456, 0.406);
   cv::divide(normalized, cv::Scalar(0.229, 0.224, 0.225), normalized);
@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iterator>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "criterion.h"
+#include "output_sink.h"
+
+// Round to nearest even, overflowing to infinity
+static uint16_t FloatToHalf(const float kVal) {
+  uint32_t x;
+  memcpy(&x, &kVal, sizeof(x));
+  const uint16_t kSign = (x >> 16) & 0x8000;
+  x &= 0x7fffffff;
+  if (x >= 0x7f800000)
+    return kSign | (x > 0x7f800000 ? 0x7e00 : 0x7c00);
+  if (x >= 0x477ff000)
+    return kSign | 0x7c00;
+  if (x < 0x38800000) {
+    // Subnormal halfs count in units of 2^-24
+    if (x < 0x33000000)
+      return kSign;
+    const uint32_t kShift = 126 - (x >> 23);
+    const uint32_t kMant = (x & 0x7fffff) | 0x800000;
+    uint32_t half = kMant >> kShift;
+    const uint32_t kRem = kMant & ((1u << kShift) - 1), kHalfway = 1u << (kShift - 1);
+    if (kRem > kHalfway || (kRem == kHalfway && (half & 1)))
+      half++;
+    return kSign | half;
+  }
+  // Rebias the exponent from 127 to 15
+  uint32_t half = (x - 0x38000000) >> 13;
+  const uint32_t kRem = x & 0x1fff;
+  if (kRem > 0x1000 || (kRem == 0x1000 && (half & 1)))
+    half++;
+  return kSign | half;
+}
+
+static float HalfToFloat(const uint16_t kHalf) {
+  const uint32_t kSign = (uint32_t) (kHalf & 0x8000) << 16;
+  const uint32_t kExp = (kHalf >> 10) & 0x1f, kMant = kHalf & 0x3ff;
+  uint32_t x;
+  if (kExp == 0x1f) {
+    x = kSign | 0x7f800000 | (kMant << 13);
+  } else if (kExp != 0) {
+    x = kSign | ((kExp + 112) << 23) | (kMant << 13);
+  } else {
+    // Subnormal halfs are exact floats
+    const float kVal = kMant / 16777216.f;
+    return kSign ? -kVal : kVal;
+  }
+  float val;
+  memcpy(&val, &x, sizeof(val));
+  return val;
+}
+
+OutputFormat ParseOutputFormat(const std::string& kName) {
+  if (kName == "fp32")
+    return OutputFormat::FP32;
+  else if (kName == "fp16")
+    return OutputFormat::FP16;
+  else if (kName == "top-k")
+    return OutputFormat::TopK;
+  throw std::invalid_argument("Output format wrong");
+}
+
+static size_t RecordSize(const OutputFormat kFormat, const size_t kOutputSingle,
+                         const size_t kTopK) {
+  switch (kFormat) {
+    case OutputFormat::FP32:
+      return kOutputSingle * sizeof(float);
+    case OutputFormat::FP16:
+      return kOutputSingle * sizeof(uint16_t);
+    case OutputFormat::TopK:
+      return kTopK * (sizeof(uint32_t) + sizeof(float));
+    default:
+      throw std::invalid_argument("Unknown output format");
+  }
+}
+
+MmapOutputSink::MmapOutputSink(
+    const std::string& kPath, const size_t kNbImages, const size_t kOutputSingle,
+    const OutputFormat kFormat, const size_t kTopK) :
+    kOutputSingle_(kOutputSingle), kFormat_(kFormat), kTopK_(kTopK),
+    kRecordSize_(RecordSize(kFormat, kOutputSingle, kTopK)),
+    kFileSize_(kNbImages * kRecordSize_), kCharge_(MemoryOwner::Output, kFileSize_),
+    data_(NULL) {
+  if (kFormat_ == OutputFormat::TopK && (kTopK_ == 0 || kTopK_ > kOutputSingle_))
+    throw std::invalid_argument("Top-k must be between 1 and the number of classes");
+  fd_ = open(kPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0)
+    throw std::runtime_error("Couldn't open output file " + kPath);
+  if (ftruncate(fd_, kFileSize_) != 0)
+    throw std::runtime_error("Couldn't size output file " + kPath);
+  if (kFileSize_ == 0)
+    return;
+  void *addr = mmap(NULL, kFileSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (addr == MAP_FAILED)
+    throw std::runtime_error("Couldn't map output file " + kPath);
+  data_ = (uint8_t *) addr;
+}
+
+MmapOutputSink::~MmapOutputSink() {
+  if (data_ != NULL)
+    munmap(data_, kFileSize_);
+  close(fd_);
+}
+
+void MmapOutputSink::WriteRow(const size_t kIndex, const float *kLogits) {
+  if ((kIndex + 1) * kRecordSize_ > kFileSize_)
+    throw std::out_of_range("Output row past the end of the file");
+  uint8_t *record = data_ + kIndex * kRecordSize_;
+  switch (kFormat_) {
+    case OutputFormat::FP32:
+      memcpy(record, kLogits, kRecordSize_);
+      break;
+    case OutputFormat::FP16: {
+      uint16_t *out = (uint16_t *) record;
+      for (size_t i = 0; i < kOutputSingle_; i++)
+        out[i] = FloatToHalf(kLogits[i]);
+      break;
+    }
+    case OutputFormat::TopK: {
+      // Called per row from many threads
+      thread_local std::vector<float> probs;
+      thread_local std::vector<uint32_t> classes;
+      probs.resize(kOutputSingle_);
+      classes.resize(kOutputSingle_);
+      softmax(kLogits, kOutputSingle_, probs.data());
+      std::iota(classes.begin(), classes.end(), 0);
+      std::partial_sort(classes.begin(), classes.begin() + kTopK_, classes.end(),
+                        [&](const uint32_t a, const uint32_t b) {
+                          return probs[a] > probs[b] || (probs[a] == probs[b] && a < b);
+                        });
+      for (size_t i = 0; i < kTopK_; i++) {
+        memcpy(record, &classes[i], sizeof(uint32_t));
+        memcpy(record + sizeof(uint32_t), &probs[classes[i]], sizeof(float));
+        record += sizeof(uint32_t) + sizeof(float);
+      }
+      break;
+    }
+  }
+}
+
+std::vector<float> ReadOutputs(const std::string& kPath, const size_t kNbImages,
+                               const size_t kOutputSingle, const OutputFormat kFormat) {
+  if (kFormat == OutputFormat::TopK)
+    throw std::invalid_argument("Top-k predictions don't have whole rows: " + kPath);
+  std::ifstream fin(kPath, std::ios::in | std::ios::binary);
+  std::vector<float> outputs(kNbImages * kOutputSingle);
+  if (kFormat == OutputFormat::FP32) {
+    fin.read((char *) outputs.data(), outputs.size() * sizeof(float));
+  } else {
+    std::vector<uint16_t> halfs(outputs.size());
+    fin.read((char *) halfs.data(), halfs.size() * sizeof(uint16_t));
+    std::transform(halfs.begin(), halfs.end(), outputs.begin(), HalfToFloat);
+  }
+  if (!fin)
+    throw std::invalid_argument("Predictions are missing or too short: " + kPath);
+  return outputs;
+}
+
+std::vector<size_t> GetLabels(const std::string& val_dir) {
+  namespace fs = std::experimental::filesystem;
+
+  std::vector<fs::path> dirs;
+  std::copy(fs::directory_iterator(val_dir), fs::directory_iterator(), std::back_inserter(dirs));
+  std::sort(dirs.begin(), dirs.end());
+
+  std::vector<size_t> labels;
+  size_t label = 0;
+  for (const auto& dir : dirs) {
+    if (fs::is_directory(dir)) {
+      const size_t kNbFiles = std::distance(fs::directory_iterator(dir), fs::directory_iterator());
+      labels.insert(labels.end(), kNbFiles, label);
+      label++;
+    }
+  }
+  return labels;
+}
+
+AccuracySink::AccuracySink(const std::vector<size_t>& kLabels, const size_t kNbImages,
+                           const size_t kOutputSingle, OutputSink *kBase) :
+    kLabels_(kLabels), kOutputSingle_(kOutputSingle), kBase_(kBase),
+    ranks_(kNbImages, kMaxRank_) {
+  if (kLabels_.empty())
+    throw std::invalid_argument("No labels to score against");
+  if (*std::max_element(kLabels_.begin(), kLabels_.end()) >= kOutputSingle_)
+    throw std::invalid_argument("More classes than model outputs");
+}
+
+void AccuracySink::WriteRow(const size_t kIndex, const float *kLogits) {
+  if (kBase_ != NULL)
+    kBase_->WriteRow(kIndex, kLogits);
+  const size_t kLabel = kLabels_[kIndex % kLabels_.size()];
+  const float kTarget = kLogits[kLabel];
+  // Classes that an argmax would pick over the label
+  size_t rank = 0;
+  #pragma omp simd reduction(+:rank)
+  for (size_t i = 0; i < kOutputSingle_; i++)
+    rank += (kLogits[i] > kTarget) | ((kLogits[i] == kTarget) & (i < kLabel));
+  ranks_.at(kIndex) = std::min(rank, (size_t) kMaxRank_);
+}
+
+float AccuracySink::GetTopK(const size_t kK) const {
+  if (ranks_.empty())
+    return 0;
+  const size_t kNbCorrect = std::count_if(ranks_.begin(), ranks_.end(),
+                                          [kK](const uint8_t kRank) { return kRank < kK; });
+  return 100.f * kNbCorrect / ranks_.size();
+}
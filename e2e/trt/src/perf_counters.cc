@@ -0,0 +1,85 @@
+#include <cerrno>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perf_counters.h"
+
+static const size_t kNbCounters = (size_t) PerfCounter::NbCounters;
+
+const char *GetCounterName(const PerfCounter kCounter) {
+  static const char *kNames[kNbCounters] = {
+    "cycles", "instructions", "llc-misses", "branch-misses"
+  };
+  return kNames[(size_t) kCounter];
+}
+
+std::atomic<bool> PerfCounters::enabled_(false);
+
+// One group per thread, led by the cycles counter, so every read is a consistent snapshot
+struct ThreadCounters {
+  int fds[kNbCounters];
+  int error = 0;
+
+  ThreadCounters() {
+    const uint64_t kConfigs[kNbCounters] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+      PERF_COUNT_HW_BRANCH_MISSES
+    };
+    for (size_t i = 0; i < kNbCounters; i++) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = kConfigs[i];
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+          PERF_FORMAT_TOTAL_TIME_RUNNING;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0);
+      if (fds[i] < 0) {
+        error = errno;
+        Close(i);
+        return;
+      }
+    }
+  }
+  ~ThreadCounters() { Close(error == 0 ? kNbCounters : 0); }
+
+  void Close(const size_t kNbOpen) {
+    for (size_t i = 0; i < kNbOpen; i++)
+      close(fds[i]);
+    fds[0] = -1;
+  }
+};
+
+static ThreadCounters& GetThreadCounters() {
+  thread_local ThreadCounters counters;
+  return counters;
+}
+
+std::string PerfCounters::Enable() {
+  const ThreadCounters& kCounters = GetThreadCounters();
+  if (kCounters.error != 0)
+    return std::string("perf_event_open failed: ") + strerror(kCounters.error);
+  enabled_.store(true, std::memory_order_relaxed);
+  return "";
+}
+
+PerfCounts PerfCounters::Read() {
+  PerfCounts counts;
+  const ThreadCounters& kCounters = GetThreadCounters();
+  if (kCounters.fds[0] < 0)
+    return counts;
+  // nr, time enabled, time running, then the values in group order
+  uint64_t buf[3 + kNbCounters];
+  if (read(kCounters.fds[0], buf, sizeof(buf)) != sizeof(buf))
+    return counts;
+  counts.time_enabled = buf[1];
+  counts.time_running = buf[2];
+  for (size_t i = 0; i < kNbCounters; i++)
+    counts.values[i] = buf[3 + i];
+  return counts;
+}
@@ -7,6 +7,7 @@
 #include "spng.h"
 
 #include "data_loader.h"
+#include "stage_timer.h"
 
 cv::Mat PNGDataLoader::DecodeImage(CompressedImage compressed) const {
   spng_ctx *ctx;
@@ -38,6 +39,7 @@ void PNGDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *output_buf)
   cv::Mat resized, normalized;
 
   // Resize
+  StageTimer timer(TimedStage::Resize);
   auto new_resol = RatioPreservingResize(kResizeDim_, kRawImage.cols, kRawImage.rows);
   cv::resize(kRawImage, resized, cv::Size(new_resol.first, new_resol.second));
   if (kCondition_ == LoaderCondition::DecodeResize)
@@ -50,6 +52,7 @@ void PNGDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *output_buf)
   cv::Mat center_cropped = resized(crop_region);
 
   // Normalization
+  timer.Next(TimedStage::Normalize);
   center_cropped.convertTo(normalized, CV_32FC3, 1/255.0);
   normalized -= cv::Scalar(0.485, 0.456, 0.406);
   cv::divide(normalized, cv::Scalar(0.229, 0.224, 0.225), normalized);
@@ -69,23 +72,43 @@ void PNGDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *output_buf)
 
 
 
+// Adam7 pass 6 - 2s completes a 1/2^s scale image. Pick the coarsest one whose short side still
+// covers the resize target so the later passes are never inflated or defiltered.
+static int Adam7LastPass(const struct spng_ihdr& kIhdr, const size_t kMinShortSide) {
+  if (kIhdr.interlace_method == 0)
+    return 6;
+  const size_t kShortSide = std::min(kIhdr.width, kIhdr.height);
+  for (int shift = 3; shift > 0; shift--) {
+    if (((kShortSide + (1 << shift) - 1) >> shift) >= kMinShortSide)
+      return 6 - 2 * shift;
+  }
+  return 6;
+}
+
 cv::Mat OptPNGDataLoader::DecodeImage(CompressedImage compressed) const {
   struct spng_ihdr ihdr;
   size_t size;
+  uint32_t width, height;
 
   spng_ctx *ctx = spng_ctx_new(0);
   if (ctx == NULL
       || spng_set_png_buffer(ctx, compressed.first, compressed.second)
-      || spng_get_ihdr(ctx, &ihdr)
-      || spng_decoded_image_size(ctx, SPNG_FMT_RGBA8, &size)) {
+      || spng_get_ihdr(ctx, &ihdr)) {
+    spng_ctx_free(ctx);
+    throw std::invalid_argument("Could not decode PNG");
+  }
+  // Both preprocessing paths only need kResizeDim_ pixels on the short side
+  const int kLastPass = Adam7LastPass(ihdr, kResizeDim_);
+  if (spng_decoded_reduced_size(ctx, SPNG_FMT_RGBA8, kLastPass, &size, &width, &height)) {
     spng_ctx_free(ctx);
     throw std::invalid_argument("Could not decode PNG");
   }
 
-  //              rows         cols
-  cv::Mat decoded(ihdr.height, ihdr.width, CV_8UC4), output;
+  //              rows    cols
+  cv::Mat decoded(height, width, CV_8UC4), output;
 
-  spng_decode_image(ctx, decoded.data, size, SPNG_FMT_RGBA8, SPNG_DECODE_USE_TRNS);
+  spng_decode_image_reduced(ctx, decoded.data, size, SPNG_FMT_RGBA8, SPNG_DECODE_USE_TRNS, kLastPass);
+  spng_ctx_free(ctx);
   cv::cvtColor(decoded, output, cv::COLOR_BGRA2BGR);
   return output;
 }
@@ -93,6 +116,7 @@ cv::Mat OptPNGDataLoader::DecodeImage(CompressedImage compressed) const {
 void OptPNGDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *output_buf) const {
   if (kCondition_ == LoaderCondition::DecodeOnly)
     return;
+  StageTimer timer(TimedStage::Resize);
   cv::Mat resized;
 
   auto new_resol = RatioPreservingResize(kResizeDim_, kRawImage.cols, kRawImage.rows);
@@ -105,6 +129,7 @@ void OptPNGDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *output_b
   cv::Rect crop_region(x, y, kModelInputDim_, kModelInputDim_);
   cv::Mat center_cropped = resized(crop_region);
 
+  timer.Next(TimedStage::Normalize);
   std::vector<uint8_t> scratch(kModelInputDim_ * kModelInputDim_ * 3);
   std::vector<cv::Mat> channels(3);
   for (size_t i = 0, offset = 0; i < channels.size(); i++) {
@@ -126,6 +151,7 @@ void OptResizePNGDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *ou
   if (kCondition_ == LoaderCondition::DecodeOnly)
     return;
 
+  StageTimer timer(TimedStage::Resize);
   cv::Mat resized, center_cropped;
   const size_t short_side = std::min(kRawImage.cols, kRawImage.rows);
   const size_t crop_size = (size_t) (short_side * kModelInputDim_ / (float) kResizeDim_);
@@ -137,6 +163,7 @@ void OptResizePNGDataLoader::PreprocessImage(const cv::Mat& kRawImage, float *ou
   if (kCondition_ == LoaderCondition::DecodeResize)
     return;
 
+  timer.Next(TimedStage::Normalize);
   std::vector<uint8_t> scratch(kModelInputDim_ * kModelInputDim_ * 3);
   std::vector<cv::Mat> channels(3);
   for (size_t i = 0, offset = 0; i < channels.size(); i++) {
@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+
+#include "opencv2/highgui/highgui.hpp"
+#include "yaml-cpp/yaml.h"
+
+#include "pre_filter.h"
+
+PreFilter::PreFilter(const PreFilterRules& kRules, const std::string& kReferencePath,
+                     const size_t kThumbnailScale) :
+    kRules_(kRules), kThumbnailScale_(kThumbnailScale) {
+  if (kThumbnailScale != 1 && kThumbnailScale != 2 && kThumbnailScale != 4 && kThumbnailScale != 8)
+    throw std::invalid_argument("Thumbnail scale must be 1, 2, 4 or 8");
+  if (kReferencePath.empty()) {
+    if (kRules_.min_hist_distance > 0)
+      throw std::invalid_argument("Histogram rule needs a reference image");
+    return;
+  }
+  cv::Mat reference = cv::imread(kReferencePath, cv::IMREAD_COLOR);
+  if (reference.empty())
+    throw std::invalid_argument("Couldn't read reference image");
+  if (!reference.isContinuous())
+    reference = reference.clone();
+  const uint8_t *kRGB[3] = {reference.data + 2, reference.data + 1, reference.data};
+  ref_hist_ = ColorHistogram(kRGB, 3, 3, reference.total());
+}
+
+std::vector<float> PreFilter::ColorHistogram(
+    const uint8_t *const *kRGB, const size_t kNbChannels, const size_t kStep,
+    const size_t kNbPixels) const {
+  std::vector<float> hist(3 * kHistBins_, 0);
+  for (size_t ch = 0; ch < kNbChannels; ch++) {
+    size_t counts[kHistBins_] = {0};
+    const uint8_t *in = kRGB[ch];
+    for (size_t i = 0; i < kNbPixels; i++)
+      counts[in[i * kStep] >> 5]++;
+    for (size_t bin = 0; bin < kHistBins_; bin++)
+      hist[ch * kHistBins_ + bin] = (float) counts[bin] / kNbPixels;
+  }
+  for (size_t ch = kNbChannels; ch < 3; ch++)
+    std::copy(hist.begin(), hist.begin() + kHistBins_, hist.begin() + ch * kHistBins_);
+  return hist;
+}
+
+ImageStats PreFilter::ComputeStats(
+    const uint8_t *const *kRGB, const size_t kNbChannels, const size_t kStep,
+    const size_t kWidth, const size_t kHeight) const {
+  const size_t kNbPixels = kWidth * kHeight;
+  ImageStats stats{0, 0, 0, 0};
+  if (kNbPixels == 0)
+    return stats;
+
+  // BT.601 luma in 8.8 fixed point
+  std::vector<uint8_t> luma_buf;
+  const uint8_t *luma = kRGB[0];
+  if (kNbChannels == 3) {
+    luma_buf.resize(kNbPixels);
+    const uint8_t *kR = kRGB[0], *kG = kRGB[1], *kB = kRGB[2];
+    uint8_t *out = luma_buf.data();
+    #pragma omp simd
+    for (size_t i = 0; i < kNbPixels; i++)
+      out[i] = (77 * kR[i * kStep] + 150 * kG[i * kStep] + 29 * kB[i * kStep] + 128) >> 8;
+    luma = out;
+  } else if (kStep != 1) {
+    luma_buf.resize(kNbPixels);
+    for (size_t i = 0; i < kNbPixels; i++)
+      luma_buf[i] = luma[i * kStep];
+    luma = luma_buf.data();
+  }
+
+  uint64_t sum = 0, sum_sq = 0;
+  #pragma omp simd reduction(+:sum, sum_sq)
+  for (size_t i = 0; i < kNbPixels; i++) {
+    const uint32_t kY = luma[i];
+    sum += kY;
+    sum_sq += kY * kY;
+  }
+  stats.mean = (double) sum / kNbPixels;
+  const double kVar = (double) sum_sq / kNbPixels - (double) stats.mean * stats.mean;
+  stats.stddev = std::sqrt(std::max(0., kVar));
+
+  // 4-neighbour Laplacian over the interior
+  if (kWidth >= 3 && kHeight >= 3) {
+    int64_t lap_sum = 0, lap_sum_sq = 0;
+    for (size_t row = 1; row + 1 < kHeight; row++) {
+      const uint8_t *kUp = luma + (row - 1) * kWidth;
+      const uint8_t *kMid = luma + row * kWidth;
+      const uint8_t *kDown = luma + (row + 1) * kWidth;
+      #pragma omp simd reduction(+:lap_sum, lap_sum_sq)
+      for (size_t col = 1; col < kWidth - 1; col++) {
+        const int32_t kLap = 4 * kMid[col] - kMid[col - 1] - kMid[col + 1] - kUp[col] - kDown[col];
+        lap_sum += kLap;
+        lap_sum_sq += kLap * kLap;
+      }
+    }
+    const double kNbInterior = (double) (kWidth - 2) * (kHeight - 2);
+    const double kLapMean = lap_sum / kNbInterior;
+    stats.sharpness = lap_sum_sq / kNbInterior - kLapMean * kLapMean;
+  }
+
+  // Half the L1 distance, averaged over channels
+  if (!ref_hist_.empty()) {
+    const std::vector<float> kHist = ColorHistogram(kRGB, kNbChannels, kStep, kNbPixels);
+    float dist = 0;
+    for (size_t i = 0; i < kHist.size(); i++)
+      dist += std::fabs(kHist[i] - ref_hist_[i]);
+    stats.hist_distance = dist / 6;
+  }
+  return stats;
+}
+
+bool PreFilter::Accept(const ImageStats& kStats) const {
+  return kStats.mean >= kRules_.min_mean && kStats.mean <= kRules_.max_mean &&
+      kStats.stddev >= kRules_.min_stddev &&
+      kStats.sharpness >= kRules_.min_sharpness &&
+      (ref_hist_.empty() || kStats.hist_distance >= kRules_.min_hist_distance);
+}
+
+bool PreFilter::AcceptImage(const cv::Mat& kImage) const {
+  // Corrupt images are dropped too
+  if (kImage.empty())
+    return false;
+  const cv::Mat kCont = kImage.isContinuous() ? kImage : kImage.clone();
+  if (kCont.channels() == 1) {
+    const uint8_t *kGray[1] = {kCont.data};
+    return Accept(ComputeStats(kGray, 1, 1, kCont.cols, kCont.rows));
+  }
+  const uint8_t *kRGB[3] = {kCont.data + 2, kCont.data + 1, kCont.data};
+  return Accept(ComputeStats(kRGB, 3, kCont.channels(), kCont.cols, kCont.rows));
+}
+
+std::vector<bool> PreFilter::FilterCompressed(const std::vector<CompressedImage>& kImages) const {
+  int flags;
+  switch (kThumbnailScale_) {
+    case 1: flags = cv::IMREAD_COLOR; break;
+    case 2: flags = cv::IMREAD_REDUCED_COLOR_2; break;
+    case 4: flags = cv::IMREAD_REDUCED_COLOR_4; break;
+    default: flags = cv::IMREAD_REDUCED_COLOR_8; break;
+  }
+  std::unique_ptr<bool[]> accepted(new bool[kImages.size()]);
+  #pragma omp parallel for
+  for (size_t i = 0; i < kImages.size(); i++) {
+    cv::Mat raw_data(1, kImages[i].second, CV_8UC1, (void *) kImages[i].first);
+    accepted[i] = AcceptImage(cv::imdecode(raw_data, flags));
+  }
+  return std::vector<bool>(accepted.get(), accepted.get() + kImages.size());
+}
+
+void PreFilter::FillDefault(float *output, const size_t kOutputSingle) const {
+  std::fill(output, output + kOutputSingle, 0.f);
+  if (kRules_.default_class < kOutputSingle)
+    output[kRules_.default_class] = 1;
+}
+
+const PreFilter *ParsePreFilter(const YAML::Node& kCfg) {
+  if (!kCfg)
+    return NULL;
+  PreFilterRules rules;
+  if (kCfg["min-mean"]) rules.min_mean = kCfg["min-mean"].as<float>();
+  if (kCfg["max-mean"]) rules.max_mean = kCfg["max-mean"].as<float>();
+  if (kCfg["min-stddev"]) rules.min_stddev = kCfg["min-stddev"].as<float>();
+  if (kCfg["min-sharpness"]) rules.min_sharpness = kCfg["min-sharpness"].as<float>();
+  if (kCfg["min-hist-distance"]) rules.min_hist_distance = kCfg["min-hist-distance"].as<float>();
+  if (kCfg["default-class"]) rules.default_class = kCfg["default-class"].as<size_t>();
+  return new PreFilter(
+      rules,
+      kCfg["reference-image"] ? kCfg["reference-image"].as<std::string>() : "",
+      kCfg["thumbnail-scale"] ? kCfg["thumbnail-scale"].as<size_t>() : 4);
+}
@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "per_thread.h"
+#include "queue_monitor.h"
+
+static const size_t kNbKinds = (size_t) QueueKind::NbKinds;
+
+const char *GetQueueName(const QueueKind kKind) {
+  static const char *kNames[kNbKinds] = {"batch-queue", "infer-queue"};
+  return kNames[(size_t) kKind];
+}
+
+std::atomic<bool> QueueMonitor::enabled_(false);
+
+struct ThreadQueueStats {
+  QueueStats kinds[kNbKinds];
+};
+
+typedef PerThreadRegistry<ThreadQueueStats> StatsRegistry;
+
+static ThreadQueueStats *GetThreadQueueStats() { return StatsRegistry::Get(); }
+
+// Queues stay listed after they are unregistered, for the report
+struct QueueInfo {
+  QueueKind kind;
+  size_t capacity;
+  std::function<ssize_t()> depth;
+  bool active;
+  uint64_t nb_samples, depth_sum, nb_empty, nb_full;
+  ssize_t max_depth;
+};
+
+struct Sample {
+  int64_t time_ns;
+  size_t id;
+  ssize_t depth;
+};
+
+static std::mutex queue_mutex;
+static std::vector<QueueInfo> queues;
+static std::vector<Sample> samples;
+static size_t max_samples = 0;
+static std::chrono::microseconds period(0);
+static QueueMonitor::Clock::time_point epoch;
+
+static std::mutex sampler_mutex;
+static std::condition_variable sampler_cv;
+static bool stop_sampler = false;
+static std::thread sampler;
+
+static void SampleQueues() {
+  std::lock_guard<std::mutex> lock(queue_mutex);
+  const int64_t kNow = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      QueueMonitor::Clock::now() - epoch).count();
+  for (size_t i = 0; i < queues.size(); i++) {
+    QueueInfo& info = queues[i];
+    if (!info.active)
+      continue;
+    // sizeGuess goes negative while readers wait on an empty queue
+    const ssize_t kDepth = std::max((ssize_t) 0, info.depth());
+    info.nb_samples++;
+    info.depth_sum += kDepth;
+    info.nb_empty += kDepth == 0;
+    info.nb_full += (size_t) kDepth >= info.capacity;
+    info.max_depth = std::max(info.max_depth, kDepth);
+    if (samples.size() < max_samples)
+      samples.push_back(Sample{kNow, i, kDepth});
+  }
+}
+
+static void RunSampler() {
+  std::unique_lock<std::mutex> lock(sampler_mutex);
+  while (!sampler_cv.wait_for(lock, period, [] { return stop_sampler; }))
+    SampleQueues();
+}
+
+void QueueMonitor::Enable(const std::chrono::microseconds kPeriod, const size_t kMaxSamples) {
+  if (kPeriod.count() <= 0)
+    throw std::invalid_argument("The queue sampling period must be positive");
+  Disable();
+  {
+    auto lock = StatsRegistry::Lock();
+    for (auto& stats : StatsRegistry::GetAll())
+      *stats = ThreadQueueStats();
+  }
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    for (QueueInfo& info : queues) {
+      info.nb_samples = info.depth_sum = info.nb_empty = info.nb_full = 0;
+      info.max_depth = 0;
+    }
+    samples.clear();
+    max_samples = kMaxSamples;
+    period = kPeriod;
+    epoch = Clock::now();
+  }
+  stop_sampler = false;
+  sampler = std::thread(RunSampler);
+  enabled_.store(true, std::memory_order_relaxed);
+}
+
+void QueueMonitor::Disable() {
+  enabled_.store(false, std::memory_order_relaxed);
+  if (!sampler.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(sampler_mutex);
+    stop_sampler = true;
+  }
+  sampler_cv.notify_all();
+  sampler.join();
+}
+
+size_t QueueMonitor::Register(const QueueKind kKind, std::function<ssize_t()> depth,
+                              const size_t kCapacity) {
+  std::lock_guard<std::mutex> lock(queue_mutex);
+  queues.push_back(QueueInfo{kKind, kCapacity, std::move(depth), true, 0, 0, 0, 0, 0});
+  return queues.size() - 1;
+}
+
+void QueueMonitor::Unregister(const size_t kId) {
+  std::lock_guard<std::mutex> lock(queue_mutex);
+  queues[kId].active = false;
+  queues[kId].depth = std::function<ssize_t()>();
+}
+
+void QueueMonitor::RecordRead(const QueueKind kKind, const bool kStarved,
+                              const uint64_t kWaitNanos) {
+  QueueStats& stats = GetThreadQueueStats()->kinds[(size_t) kKind];
+  stats.nb_reads++;
+  stats.nb_starved_reads += kStarved;
+  stats.read_wait_ns += kWaitNanos;
+}
+
+void QueueMonitor::RecordWrite(const QueueKind kKind, const bool kBlocked,
+                               const uint64_t kWaitNanos) {
+  QueueStats& stats = GetThreadQueueStats()->kinds[(size_t) kKind];
+  stats.nb_writes++;
+  stats.nb_blocked_writes += kBlocked;
+  stats.write_wait_ns += kWaitNanos;
+}
+
+QueueStats QueueMonitor::GetMerged(const QueueKind kKind) {
+  auto lock = StatsRegistry::Lock();
+  QueueStats merged;
+  for (const auto& stats : StatsRegistry::GetAll())
+    merged += stats->kinds[(size_t) kKind];
+  return merged;
+}
+
+std::vector<QueueDepth> QueueMonitor::GetDepths() {
+  std::lock_guard<std::mutex> lock(queue_mutex);
+  std::vector<QueueDepth> depths;
+  for (size_t i = 0; i < queues.size(); i++) {
+    const QueueInfo& kInfo = queues[i];
+    if (kInfo.active)
+      depths.push_back(QueueDepth{i, kInfo.kind, kInfo.capacity,
+                                  std::max((ssize_t) 0, kInfo.depth())});
+  }
+  return depths;
+}
+
+static double Percent(const uint64_t kPart, const uint64_t kTotal) {
+  return kTotal == 0 ? 0 : 100.0 * kPart / kTotal;
+}
+
+// The depth samples of every queue of kKind, as one queue
+static QueueInfo MergeDepths(const QueueKind kKind) {
+  std::lock_guard<std::mutex> lock(queue_mutex);
+  QueueInfo merged{kKind, 0, std::function<ssize_t()>(), false, 0, 0, 0, 0, 0};
+  for (const QueueInfo& kInfo : queues) {
+    if (kInfo.kind != kKind)
+      continue;
+    merged.capacity = std::max(merged.capacity, kInfo.capacity);
+    merged.nb_samples += kInfo.nb_samples;
+    merged.depth_sum += kInfo.depth_sum;
+    merged.nb_empty += kInfo.nb_empty;
+    merged.nb_full += kInfo.nb_full;
+    merged.max_depth = std::max(merged.max_depth, kInfo.max_depth);
+  }
+  return merged;
+}
+
+void QueueMonitor::PrintSummary(std::ostream& os) {
+  for (size_t k = 0; k < kNbKinds; k++) {
+    const QueueStats kStats = GetMerged((QueueKind) k);
+    const QueueInfo kDepths = MergeDepths((QueueKind) k);
+    if (kStats.nb_reads + kStats.nb_writes + kDepths.nb_samples == 0)
+      continue;
+    os << "Queue " << GetQueueName((QueueKind) k) << " reads: " << kStats.nb_reads
+       << ", starved: " << Percent(kStats.nb_starved_reads, kStats.nb_reads) << "%"
+       << ", read wait ms: " << kStats.read_wait_ns / 1e6
+       << ", writes: " << kStats.nb_writes
+       << ", blocked: " << Percent(kStats.nb_blocked_writes, kStats.nb_writes) << "%"
+       << ", write wait ms: " << kStats.write_wait_ns / 1e6 << std::endl;
+    if (kDepths.nb_samples == 0)
+      continue;
+    os << "Queue " << GetQueueName((QueueKind) k) << " mean depth: "
+       << kDepths.depth_sum / (double) kDepths.nb_samples << " of " << kDepths.capacity
+       << ", max: " << kDepths.max_depth
+       << ", empty: " << Percent(kDepths.nb_empty, kDepths.nb_samples) << "%"
+       << ", full: " << Percent(kDepths.nb_full, kDepths.nb_samples) << "%" << std::endl;
+  }
+}
+
+void QueueMonitor::WriteJson(const std::string& kPath) {
+  std::ofstream fout(kPath);
+  if (!fout)
+    throw std::runtime_error("Couldn't open queue file " + kPath);
+  fout << "{\"period-us\": " << period.count() << ", \"kinds\": {";
+  for (size_t k = 0; k < kNbKinds; k++) {
+    const QueueStats kStats = GetMerged((QueueKind) k);
+    fout << (k == 0 ? "" : ",") << "\n  \"" << GetQueueName((QueueKind) k) << "\": {"
+         << "\"reads\": " << kStats.nb_reads
+         << ", \"starved-reads\": " << kStats.nb_starved_reads
+         << ", \"read-wait-ms\": " << kStats.read_wait_ns / 1e6
+         << ", \"writes\": " << kStats.nb_writes
+         << ", \"blocked-writes\": " << kStats.nb_blocked_writes
+         << ", \"write-wait-ms\": " << kStats.write_wait_ns / 1e6 << "}";
+  }
+  fout << "},\n\"queues\": [";
+
+  std::lock_guard<std::mutex> lock(queue_mutex);
+  for (size_t i = 0; i < queues.size(); i++) {
+    const QueueInfo& kInfo = queues[i];
+    fout << (i == 0 ? "" : ",") << "\n  {\"id\": " << i
+         << ", \"kind\": \"" << GetQueueName(kInfo.kind) << "\""
+         << ", \"capacity\": " << kInfo.capacity
+         << ", \"samples\": " << kInfo.nb_samples
+         << ", \"mean-depth\": "
+         << (kInfo.nb_samples == 0 ? 0 : kInfo.depth_sum / (double) kInfo.nb_samples)
+         << ", \"max-depth\": " << kInfo.max_depth
+         << ", \"empty-samples\": " << kInfo.nb_empty
+         << ", \"full-samples\": " << kInfo.nb_full << "}";
+  }
+  fout << "],\n\"samples\": [";
+  for (size_t i = 0; i < samples.size(); i++) {
+    fout << (i == 0 ? "" : ",") << (i % 8 == 0 ? "\n  " : " ")
+         << "[" << samples[i].time_ns / 1e6 << ", " << samples[i].id << ", "
+         << samples[i].depth << "]";
+  }
+  fout << "]}\n";
+}
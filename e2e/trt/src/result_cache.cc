@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "result_cache.h"
+
+static const uint64_t kDiskMagic = 0x31534c5365727473ULL;
+
+// Slots aren't 8 byte aligned, so the key goes byte by byte. The stores are volatile so that none
+// is dropped, and the fence keeps the slot's earlier stores ahead of them.
+static void StoreKey(uint8_t *slot, const uint64_t kKey) {
+  std::atomic_signal_fence(std::memory_order_release);
+  uint8_t bytes[sizeof(kKey)];
+  memcpy(bytes, &kKey, sizeof(kKey));
+  volatile uint8_t *dst = slot;
+  for (size_t i = 0; i < sizeof(kKey); i++)
+    dst[i] = bytes[i];
+  std::atomic_signal_fence(std::memory_order_release);
+}
+
+ResultCache::ResultCache(const size_t kOutputSingle, const uint64_t kConfigId,
+                         const size_t kMemEntries, const std::string& kDiskPath,
+                         const size_t kDiskEntries) :
+    kOutputSingle_(kOutputSingle), kConfigId_(kConfigId), kMemEntries_(kMemEntries) {
+  if (kDiskPath.empty() || kDiskEntries == 0)
+    return;
+
+  nb_disk_slots_ = kDiskEntries;
+  disk_size_ = sizeof(DiskHeader) + kDiskEntries * (sizeof(uint64_t) + kOutputSingle * sizeof(float));
+  fd_ = open(kDiskPath.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd_ < 0)
+    throw std::runtime_error("Couldn't open result cache " + kDiskPath);
+  const DiskHeader kHeader{kDiskMagic, kConfigId, kOutputSingle, kDiskEntries};
+  DiskHeader old_header{0, 0, 0, 0};
+  struct stat st;
+  if (fstat(fd_, &st) != 0)
+    throw std::runtime_error("Couldn't stat result cache " + kDiskPath);
+  const bool kReuse = (size_t) st.st_size == disk_size_ &&
+      pread(fd_, &old_header, sizeof(old_header), 0) == sizeof(old_header) &&
+      memcmp(&old_header, &kHeader, sizeof(kHeader)) == 0;
+  // Anything written for another model or layout is dropped
+  if (!kReuse && (ftruncate(fd_, 0) != 0 || ftruncate(fd_, disk_size_) != 0))
+    throw std::runtime_error("Couldn't size result cache " + kDiskPath);
+  void *addr = mmap(NULL, disk_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (addr == MAP_FAILED)
+    throw std::runtime_error("Couldn't map result cache " + kDiskPath);
+  disk_ = (uint8_t *) addr;
+  if (!kReuse)
+    memcpy(disk_, &kHeader, sizeof(kHeader));
+}
+
+ResultCache::~ResultCache() {
+  if (disk_ != NULL)
+    munmap(disk_, disk_size_);
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+uint64_t ResultCache::Hash(const void *kData, const size_t kLen, const uint64_t kSeed) {
+  const uint64_t kMul = 0xc6a4a7935bd1e995ULL;
+  const int kShift = 47;
+  const uint8_t *kBytes = (const uint8_t *) kData;
+  uint64_t h = kSeed ^ (kLen * kMul);
+
+  const size_t kNbWords = kLen / 8;
+  for (size_t i = 0; i < kNbWords; i++) {
+    uint64_t k;
+    memcpy(&k, kBytes + i * 8, sizeof(k));
+    k *= kMul;
+    k ^= k >> kShift;
+    k *= kMul;
+    h ^= k;
+    h *= kMul;
+  }
+
+  const uint8_t *kTail = kBytes + kNbWords * 8;
+  switch (kLen & 7) {
+    case 7: h ^= (uint64_t) kTail[6] << 48;
+    case 6: h ^= (uint64_t) kTail[5] << 40;
+    case 5: h ^= (uint64_t) kTail[4] << 32;
+    case 4: h ^= (uint64_t) kTail[3] << 24;
+    case 3: h ^= (uint64_t) kTail[2] << 16;
+    case 2: h ^= (uint64_t) kTail[1] << 8;
+    case 1: h ^= (uint64_t) kTail[0];
+            h *= kMul;
+  }
+
+  h ^= h >> kShift;
+  h *= kMul;
+  h ^= h >> kShift;
+  return h;
+}
+
+uint64_t ResultCache::Key(const CompressedImage& kImage) const {
+  const uint64_t kKey = Hash(kImage.first, kImage.second, kConfigId_);
+  return kKey == 0 ? 1 : kKey;
+}
+
+uint8_t *ResultCache::DiskSlot(const uint64_t kKey) const {
+  const size_t kSlotSize = sizeof(uint64_t) + kOutputSingle_ * sizeof(float);
+  return disk_ + sizeof(DiskHeader) + (kKey % nb_disk_slots_) * kSlotSize;
+}
+
+void ResultCache::PutMem(const uint64_t kKey, const float *kOutput) {
+  if (kMemEntries_ == 0)
+    return;
+  size_t slot;
+  auto it = mem_index_.find(kKey);
+  if (it != mem_index_.end()) {
+    slot = it->second->second;
+    lru_.erase(it->second);
+  } else if (lru_.size() < kMemEntries_) {
+    slot = lru_.size();
+    mem_rows_.resize((slot + 1) * kOutputSingle_);
+  } else {
+    slot = lru_.back().second;
+    mem_index_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+  std::copy(kOutput, kOutput + kOutputSingle_, mem_rows_.begin() + slot * kOutputSingle_);
+  lru_.emplace_front(kKey, slot);
+  mem_index_[kKey] = lru_.begin();
+}
+
+bool ResultCache::Get(const uint64_t kKey, float *output) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = mem_index_.find(kKey);
+  if (it != mem_index_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    const float *kRow = mem_rows_.data() + it->second->second * kOutputSingle_;
+    std::copy(kRow, kRow + kOutputSingle_, output);
+    nb_mem_hits_++;
+    return true;
+  }
+
+  if (disk_ != NULL) {
+    const uint8_t *kSlot = DiskSlot(kKey);
+    uint64_t slot_key;
+    memcpy(&slot_key, kSlot, sizeof(slot_key));
+    if (slot_key == kKey) {
+      memcpy(output, kSlot + sizeof(uint64_t), kOutputSingle_ * sizeof(float));
+      PutMem(kKey, output);
+      nb_disk_hits_++;
+      return true;
+    }
+  }
+  nb_misses_++;
+  return false;
+}
+
+void ResultCache::Put(const uint64_t kKey, const float *kOutput) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  PutMem(kKey, kOutput);
+  // Write through, replacing whatever shared the slot. The key goes last so a run killed midway
+  // leaves an empty slot rather than a wrong row.
+  if (disk_ != NULL) {
+    uint8_t *slot = DiskSlot(kKey);
+    StoreKey(slot, 0);
+    memcpy(slot + sizeof(uint64_t), kOutput, kOutputSingle_ * sizeof(float));
+    StoreKey(slot, kKey);
+  }
+}
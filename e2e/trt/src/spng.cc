@@ -1747,19 +1747,29 @@ static int get_ancillary2(spng_ctx *ctx)
     return get_ancillary(ctx);
 }
 
+/* Log2 of the pixel spacing of the grid completed after each Adam7 pass */
+static const uint8_t adam7_x_shift[7] = { 3, 2, 2, 1, 1, 0, 0 };
+static const uint8_t adam7_y_shift[7] = { 3, 3, 2, 2, 1, 1, 0 };
+
 int spng_decode_image(spng_ctx *ctx, unsigned char *out, size_t out_size, int fmt, int flags)
+{
+    return spng_decode_image_reduced(ctx, out, out_size, fmt, flags, 6);
+}
+
+int spng_decode_image_reduced(spng_ctx *ctx, unsigned char *out, size_t out_size, int fmt, int flags, int last_pass)
 {
     if(ctx == NULL) return 1;
     if(out == NULL) return 1;
 
     int ret;
     size_t out_size_required, out_width;
+    uint32_t out_w, out_h;
 
-    ret = spng_decoded_image_size(ctx, fmt, &out_size_required);
+    ret = spng_decoded_reduced_size(ctx, fmt, last_pass, &out_size_required, &out_w, &out_h);
     if(ret) return ret;
     if(out_size < out_size_required) return SPNG_EBUFSIZ;
 
-    out_width = out_size_required / ctx->ihdr.height;
+    out_width = out_size_required / out_h;
 
     uint8_t channels = 1; /* grayscale or indexed_color */
 
@@ -1798,6 +1808,12 @@ int spng_decode_image(spng_ctx *ctx, unsigned char *out, size_t out_size, int fm
     int interlaced = 0;
     if(ctx->ihdr.interlace_method) interlaced = 1;
 
+    /* Non-interlaced images always decode in full */
+    int partial = 0;
+    if(interlaced && last_pass < 6) partial = 1;
+    const uint8_t x_shift = interlaced ? adam7_x_shift[last_pass] : 0;
+    const uint8_t y_shift = interlaced ? adam7_y_shift[last_pass] : 0;
+
     int same_layout = 0;
 
     int pass;
@@ -1841,7 +1857,7 @@ int spng_decode_image(spng_ctx *ctx, unsigned char *out, size_t out_size, int fm
 
     uint16_t *gamma_lut = NULL;
 
-    if(interlaced) row = (unsigned char *) spng__malloc(ctx, out_width);
+    if(interlaced) row = (unsigned char *) spng__malloc(ctx, ctx->ihdr.width * pixel_size);
     else row = out;
 
     if(scanline == NULL || prev_scanline == NULL || row == NULL)
@@ -2014,7 +2030,7 @@ int spng_decode_image(spng_ctx *ctx, unsigned char *out, size_t out_size, int fm
     stream.avail_in = 0;
     stream.next_in = (Bytef *) ctx->data;
 
-    for(pass=0; pass < 7; pass++)
+    for(pass=0; pass <= last_pass; pass++)
     {
         /* Skip empty passes */
         if(sub[pass].width == 0 || sub[pass].height == 0) continue;
@@ -2253,10 +2269,13 @@ int spng_decode_image(spng_ctx *ctx, unsigned char *out, size_t out_size, int fm
                 const unsigned int adam7_x_delta[7] = { 8, 8, 4, 4, 2, 2, 1 };
                 const unsigned int adam7_y_delta[7] = { 8, 8, 8, 4, 4, 2, 2 };
 
+                /* Every pixel of the passes up to last_pass lies on the reduced grid */
+                const size_t out_row = (adam7_y_start[pass] + scanline_idx * adam7_y_delta[pass]) >> y_shift;
+
                 for(k=0; k < width; k++)
                 {
-                    size_t ioffset = ((adam7_y_start[pass] + scanline_idx * adam7_y_delta[pass]) *
-                                      ctx->ihdr.width + adam7_x_start[pass] + k * adam7_x_delta[pass]) * pixel_size;
+                    size_t ioffset = (out_row * out_w +
+                                      ((adam7_x_start[pass] + k * adam7_x_delta[pass]) >> x_shift)) * pixel_size;
 
                     memcpy((unsigned char*)out + ioffset, row + k * pixel_size, pixel_size);
                 }
@@ -2267,7 +2286,10 @@ int spng_decode_image(spng_ctx *ctx, unsigned char *out, size_t out_size, int fm
             }
 
         }/* for(scanline_idx=0; scanline_idx < sub[pass].height; scanline_idx++) */
-    }/* for(pass=0; pass < 7; pass++) */
+    }/* for(pass=0; pass <= last_pass; pass++) */
+
+    /* The remaining passes and chunks after IDAT are left unread */
+    if(partial) goto decode_err;
 
     if(ctx->cur_chunk_bytes_left) /* zlib stream ended before an IDAT chunk boundary */
     {/* discard the rest of the chunk */
@@ -2287,6 +2309,8 @@ decode_err:
         return ret;
     }
 
+    if(partial) return 0;
+
     memcpy(&ctx->last_idat, &ctx->current_chunk, sizeof(struct spng_chunk));
 
     ret = read_chunks_after_idat(ctx);
@@ -2487,32 +2511,49 @@ int spng_set_crc_action(spng_ctx *ctx, int critical, int ancillary)
 }
 
 int spng_decoded_image_size(spng_ctx *ctx, int fmt, size_t *out)
+{
+    return spng_decoded_reduced_size(ctx, fmt, 6, out, NULL, NULL);
+}
+
+int spng_decoded_reduced_size(spng_ctx *ctx, int fmt, int last_pass, size_t *out, uint32_t *width, uint32_t *height)
 {
     if(ctx == NULL || out == NULL) return 1;
+    if(last_pass < 0 || last_pass > 6) return 1;
 
     int ret = get_ancillary(ctx);
     if(ret) return ret;
 
+    uint32_t w = ctx->ihdr.width;
+    uint32_t h = ctx->ihdr.height;
+
+    if(ctx->ihdr.interlace_method == 1)
+    {/* Round up, the grid always includes the first row and column */
+        w = (w + (1u << adam7_x_shift[last_pass]) - 1) >> adam7_x_shift[last_pass];
+        h = (h + (1u << adam7_y_shift[last_pass]) - 1) >> adam7_y_shift[last_pass];
+    }
+
     size_t res;
     if(fmt == SPNG_FMT_RGBA8)
     {
-        if(4 > SIZE_MAX / ctx->ihdr.width) return SPNG_EOVERFLOW;
-        res = 4 * ctx->ihdr.width;
+        if(4 > SIZE_MAX / w) return SPNG_EOVERFLOW;
+        res = 4 * w;
 
-        if(res > SIZE_MAX / ctx->ihdr.height) return SPNG_EOVERFLOW;
-        res = res * ctx->ihdr.height;
+        if(res > SIZE_MAX / h) return SPNG_EOVERFLOW;
+        res = res * h;
     }
     else if(fmt == SPNG_FMT_RGBA16)
     {
-        if(8 > SIZE_MAX / ctx->ihdr.width) return SPNG_EOVERFLOW;
-        res = 8 * ctx->ihdr.width;
+        if(8 > SIZE_MAX / w) return SPNG_EOVERFLOW;
+        res = 8 * w;
 
-        if(res > SIZE_MAX / ctx->ihdr.height) return SPNG_EOVERFLOW;
-        res = res * ctx->ihdr.height;
+        if(res > SIZE_MAX / h) return SPNG_EOVERFLOW;
+        res = res * h;
     }
     else return SPNG_EFMT;
 
     *out = res;
+    if(width != NULL) *width = w;
+    if(height != NULL) *height = h;
 
     return 0;
 }
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "per_thread.h"
+#include "stage_timer.h"
+
+static const size_t kNbStages = (size_t) TimedStage::NbStages;
+
+const char *GetStageName(const TimedStage kStage) {
+  static const char *kNames[kNbStages] = {
+    "read", "decode", "resize", "normalize", "batch-queue-wait", "infer-queue-wait", "infer"
+  };
+  return kNames[(size_t) kStage];
+}
+
+size_t LatencyHistogram::GetBucket(const uint64_t kValue) {
+  if (kValue < kSubBuckets_)
+    return kValue;
+  const size_t kExp = 63 - __builtin_clzll(kValue);
+  const size_t kSub = (kValue >> (kExp - kSubBits_)) & (kSubBuckets_ - 1);
+  return (kExp - kSubBits_ + 1) * kSubBuckets_ + kSub;
+}
+
+uint64_t LatencyHistogram::GetLowerBound(const size_t kBucket) {
+  if (kBucket < kSubBuckets_)
+    return kBucket;
+  const size_t kExp = kBucket / kSubBuckets_ + kSubBits_ - 1;
+  const uint64_t kSub = kBucket % kSubBuckets_;
+  return (kSubBuckets_ + kSub) << (kExp - kSubBits_);
+}
+
+void LatencyHistogram::Record(const uint64_t kValue) {
+  counts_[GetBucket(kValue)]++;
+  count_++;
+  sum_ += kValue;
+  min_ = std::min(min_, kValue);
+  max_ = std::max(max_, kValue);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& kOther) {
+  for (size_t i = 0; i < kNbBuckets_; i++)
+    counts_[i] += kOther.counts_[i];
+  count_ += kOther.count_;
+  sum_ += kOther.sum_;
+  min_ = std::min(min_, kOther.min_);
+  max_ = std::max(max_, kOther.max_);
+}
+
+uint64_t LatencyHistogram::GetPercentile(const double kPercentile) const {
+  if (count_ == 0)
+    return 0;
+  const uint64_t kRank = std::max((uint64_t) 1, (uint64_t) (kPercentile / 100 * count_ + 0.5));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kNbBuckets_; i++) {
+    seen += counts_[i];
+    if (seen >= kRank) {
+      const uint64_t kLow = GetLowerBound(i);
+      const uint64_t kMid = i + 1 < kNbBuckets_ ? kLow + (GetLowerBound(i + 1) - kLow) / 2 : kLow;
+      return std::min(std::max(kMid, GetMin()), max_);
+    }
+  }
+  return max_;
+}
+
+
+std::atomic<bool> StageTimers::enabled_(false);
+
+struct ThreadHistograms {
+  LatencyHistogram stages[kNbStages];
+  PerfCounts counts[kNbStages];
+};
+
+typedef PerThreadRegistry<ThreadHistograms> Registry;
+
+static ThreadHistograms *GetThreadHistograms() { return Registry::Get(); }
+
+void StageTimers::Record(const TimedStage kStage, const uint64_t kNanos) {
+  GetThreadHistograms()->stages[(size_t) kStage].Record(kNanos);
+}
+
+void StageTimers::RecordSpan(const TimedStage kStage, const Tracer::Clock::time_point kStart,
+                             const Tracer::Clock::time_point kEnd) {
+  const uint64_t kNanos =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(kEnd - kStart).count();
+  if (IsEnabled())
+    Record(kStage, kNanos);
+  if (LiveMetrics::IsEnabled())
+    LiveMetrics::AddBusy(kStage, kNanos);
+  if (Tracer::IsEnabled())
+    Tracer::Record(GetStageName(kStage), kStart, kEnd);
+}
+
+void StageTimers::RecordCounts(const TimedStage kStage, const PerfCounts& kCounts) {
+  GetThreadHistograms()->counts[(size_t) kStage] += kCounts;
+}
+
+void StageTimers::Reset() {
+  auto lock = Registry::Lock();
+  for (auto& histograms : Registry::GetAll()) {
+    for (size_t s = 0; s < kNbStages; s++) {
+      histograms->stages[s] = LatencyHistogram();
+      histograms->counts[s] = PerfCounts();
+    }
+  }
+}
+
+LatencyHistogram StageTimers::GetMerged(const TimedStage kStage) {
+  auto lock = Registry::Lock();
+  LatencyHistogram merged;
+  for (const auto& histograms : Registry::GetAll())
+    merged.Merge(histograms->stages[(size_t) kStage]);
+  return merged;
+}
+
+PerfCounts StageTimers::GetMergedCounts(const TimedStage kStage) {
+  auto lock = Registry::Lock();
+  PerfCounts merged;
+  for (const auto& histograms : Registry::GetAll())
+    merged += histograms->counts[(size_t) kStage];
+  return merged;
+}
+
+void StageTimers::WriteJson(std::ostream& os) {
+  const double kPercentiles[] = {50, 90, 99, 99.9};
+  const char *kPercentileNames[] = {"p50-us", "p90-us", "p99-us", "p99.9-us"};
+  os << "{";
+  for (size_t s = 0; s < kNbStages; s++) {
+    const LatencyHistogram kHist = GetMerged((TimedStage) s);
+    os << (s == 0 ? "" : ",") << "\n  \"" << GetStageName((TimedStage) s) << "\": {"
+       << "\"count\": " << kHist.GetCount()
+       << ", \"total-ms\": " << kHist.GetSum() / 1e6
+       << ", \"mean-us\": " << (kHist.GetCount() == 0 ? 0 : kHist.GetSum() / 1e3 / kHist.GetCount())
+       << ", \"min-us\": " << kHist.GetMin() / 1e3;
+    for (size_t p = 0; p < 4; p++)
+      os << ", \"" << kPercentileNames[p] << "\": " << kHist.GetPercentile(kPercentiles[p]) / 1e3;
+    os << ", \"max-us\": " << kHist.GetMax() / 1e3;
+    if (PerfCounters::IsEnabled()) {
+      const PerfCounts kCounts = GetMergedCounts((TimedStage) s);
+      for (size_t c = 0; c < (size_t) PerfCounter::NbCounters; c++)
+        os << ", \"" << GetCounterName((PerfCounter) c) << "\": " << kCounts.values[c];
+    }
+    os << "}";
+  }
+  os << "\n}\n";
+}
+
+void StageTimers::PrintCounters(std::ostream& os, const size_t kNbImages) {
+  for (size_t s = 0; s < kNbStages; s++) {
+    const PerfCounts kCounts = GetMergedCounts((TimedStage) s);
+    if (kCounts[PerfCounter::Cycles] == 0)
+      continue;
+    os << "Counters " << GetStageName((TimedStage) s) << " IPC: "
+       << kCounts[PerfCounter::Instructions] / (double) kCounts[PerfCounter::Cycles];
+    // Runs without images, e.g. inference only, just get the IPC
+    if (kNbImages > 0) {
+      os << ", cycles/image: " << kCounts[PerfCounter::Cycles] / (double) kNbImages
+         << ", LLC misses/image: " << kCounts[PerfCounter::LLCMisses] / (double) kNbImages
+         << ", branch misses/image: " << kCounts[PerfCounter::BranchMisses] / (double) kNbImages;
+    }
+    os << std::endl;
+  }
+}
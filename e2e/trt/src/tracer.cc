@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "omp.h"
+
+#include "per_thread.h"
+#include "tracer.h"
+
+struct TraceEvent {
+  const char *name;
+  int64_t start_ns, dur_ns;
+  int64_t arg;
+};
+
+struct ThreadRing {
+  std::vector<TraceEvent> events;
+  // Events ever recorded; the latest events.size() of them are kept
+  uint64_t nb_recorded = 0;
+  size_t tid;
+  std::string name;
+};
+
+std::atomic<bool> Tracer::enabled_(false);
+
+typedef PerThreadRegistry<ThreadRing> Registry;
+
+// Both guarded by the registry's lock
+static size_t events_per_thread = 0;
+static Tracer::Clock::time_point epoch;
+
+static ThreadRing *GetThreadRing() {
+  return Registry::Get([](ThreadRing *ring, const size_t kIndex) {
+    ring->events.resize(events_per_thread);
+    ring->tid = kIndex + 1;
+    ring->name = omp_in_parallel() ? "omp-worker-" + std::to_string(omp_get_thread_num()) :
+        "thread-" + std::to_string(ring->tid);
+  });
+}
+
+void Tracer::Enable(const size_t kEventsPerThread) {
+  if (kEventsPerThread == 0)
+    throw std::invalid_argument("Trace rings need at least one event");
+  auto lock = Registry::Lock();
+  events_per_thread = kEventsPerThread;
+  for (auto& ring : Registry::GetAll()) {
+    ring->events.assign(kEventsPerThread, TraceEvent());
+    ring->nb_recorded = 0;
+  }
+  epoch = Clock::now();
+  enabled_.store(true, std::memory_order_relaxed);
+}
+
+void Tracer::Record(const char *kName, const Clock::time_point kStart,
+                    const Clock::time_point kEnd, const int64_t kArg) {
+  ThreadRing *ring = GetThreadRing();
+  if (ring->events.empty())
+    return;
+  TraceEvent& event = ring->events[ring->nb_recorded % ring->events.size()];
+  event.name = kName;
+  event.start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(kStart - epoch).count();
+  event.dur_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(kEnd - kStart).count();
+  event.arg = kArg;
+  ring->nb_recorded++;
+}
+
+void Tracer::SetThreadName(const std::string& kName) {
+  ThreadRing *ring = GetThreadRing();
+  auto lock = Registry::Lock();
+  ring->name = kName;
+}
+
+void Tracer::WriteJson(const std::string& kPath) {
+  std::ofstream fout(kPath);
+  if (!fout)
+    throw std::runtime_error("Couldn't open trace file " + kPath);
+  fout << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+
+  auto lock = Registry::Lock();
+  bool first = true;
+  for (const auto& ring : Registry::GetAll()) {
+    fout << (first ? "" : ",") << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+         << "\"tid\": " << ring->tid << ", \"args\": {\"name\": \"" << ring->name << "\"}}";
+    first = false;
+    const size_t kSize = ring->events.size();
+    const uint64_t kNbKept = std::min(ring->nb_recorded, (uint64_t) kSize);
+    for (uint64_t i = ring->nb_recorded - kNbKept; i < ring->nb_recorded; i++) {
+      const TraceEvent& kEvent = ring->events[i % kSize];
+      fout << ",\n{\"name\": \"" << kEvent.name << "\", \"ph\": \"X\", \"pid\": 1, "
+           << "\"tid\": " << ring->tid << ", \"ts\": " << kEvent.start_ns / 1e3
+           << ", \"dur\": " << kEvent.dur_ns / 1e3;
+      if (kEvent.arg != kNoArg)
+        fout << ", \"args\": {\"n\": " << kEvent.arg << "}";
+      fout << "}";
+    }
+  }
+  fout << "\n]}\n";
+}
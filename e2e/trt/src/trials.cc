@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "trials.h"
+
+CacheMode ParseCacheMode(const std::string& kName) {
+  if (kName == "any")
+    return CacheMode::Any;
+  else if (kName == "warm")
+    return CacheMode::Warm;
+  else if (kName == "cold")
+    return CacheMode::Cold;
+  throw std::invalid_argument("Wrong cache mode: " + kName);
+}
+
+// -1 after keeping the first failure in error, since exceptions can't leave the parallel loops
+static int OpenForCache(const std::string& kPath, std::string *error) {
+  const int kFd = open(kPath.c_str(), O_RDONLY);
+  if (kFd < 0) {
+    #pragma omp critical
+    if (error->empty())
+      *error = "Couldn't open " + kPath + ": " + strerror(errno);
+  }
+  return kFd;
+}
+
+void DropFromPageCache(const std::vector<std::string>& kPaths) {
+  std::string error;
+  #pragma omp parallel for
+  for (size_t i = 0; i < kPaths.size(); i++) {
+    const int kFd = OpenForCache(kPaths[i], &error);
+    if (kFd < 0)
+      continue;
+    posix_fadvise(kFd, 0, 0, POSIX_FADV_DONTNEED);
+    close(kFd);
+  }
+  if (!error.empty())
+    throw std::runtime_error(error);
+}
+
+void LoadIntoPageCache(const std::vector<std::string>& kPaths) {
+  std::string error;
+  #pragma omp parallel
+  {
+    std::vector<char> buf(1 << 20);
+    #pragma omp for
+    for (size_t i = 0; i < kPaths.size(); i++) {
+      const int kFd = OpenForCache(kPaths[i], &error);
+      if (kFd < 0)
+        continue;
+      posix_fadvise(kFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      while (read(kFd, buf.data(), buf.size()) > 0) ;
+      close(kFd);
+    }
+  }
+  if (!error.empty())
+    throw std::runtime_error(error);
+}
+
+static void PrepareTrial(const CacheMode kMode, const std::vector<std::string>& kPaths) {
+  if (kMode == CacheMode::Cold)
+    DropFromPageCache(kPaths);
+  else if (kMode == CacheMode::Warm)
+    LoadIntoPageCache(kPaths);
+}
+
+TrialStats RunTrials(const size_t kNbTrials, const CacheMode kMode,
+                     const std::vector<std::string>& kPaths, const std::function<float()>& kTrial) {
+  if (kNbTrials == 0)
+    throw std::invalid_argument("Need at least one trial");
+  TrialStats stats;
+  for (size_t i = 0; i < kNbTrials; i++) {
+    PrepareTrial(kMode, kPaths);
+    stats.runtimes.push_back(kTrial());
+  }
+
+  double sum = 0, sq_sum = 0;
+  for (const float kTime : stats.runtimes)
+    sum += kTime;
+  stats.mean = sum / kNbTrials;
+  for (const float kTime : stats.runtimes)
+    sq_sum += (kTime - stats.mean) * (kTime - stats.mean);
+  // Sample standard deviation, 0 for a single trial
+  stats.stddev = kNbTrials > 1 ? std::sqrt(sq_sum / (kNbTrials - 1)) : 0;
+  stats.min = *std::min_element(stats.runtimes.begin(), stats.runtimes.end());
+  return stats;
+}
+
+void PrintTrials(std::ostream& os, const TrialStats& kStats) {
+  if (kStats.runtimes.size() < 2)
+    return;
+  os << "Trial runtimes:";
+  for (const float kTime : kStats.runtimes)
+    os << " " << kTime;
+  os << std::endl;
+  os << "Trials: " << kStats.runtimes.size() << ", mean: " << kStats.mean
+     << ", stddev: " << kStats.stddev << ", min: " << kStats.min << std::endl;
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <iterator>
 #include <fstream>
@@ -13,9 +14,12 @@ extern "C" {
 
 #include "video_data_loader.h"
 #include "video_decoder.h"
+#include "memory_stats.h"
+#include "stage_timer.h"
 
 // Is there a way to not copy this? doesn't matter that much
 CompressedImage VideoDataLoader::LoadCompressedImageFromFile(const std::string& kFileName) const {
+  StageTimer timer(TimedStage::Read);
   std::ifstream file(kFileName, std::ios::binary | std::ios::in);
   file.unsetf(std::ios::skipws);
 
@@ -34,7 +38,7 @@ CompressedImage VideoDataLoader::LoadCompressedImageFromFile(const std::string&
 
 // FIXME: pixel format, resol, nbframes
 std::vector<cv::Mat> NaiveVidDataLoader::DecodeGOP(const std::string& kFileName) const {
-  const size_t kNbFrames = 150;
+  const size_t kNbFrames = kFramesPerGOP;
   const size_t kFrameSize = 3 * kModelInputDim_ * kModelInputDim_;
   // FIXME: make this dumber
   uint8_t *output_buf = (uint8_t *) malloc(kFrameSize * kNbFrames);
@@ -79,7 +83,10 @@ void NaiveVidDataLoader::PreprocessGOP(const std::vector<cv::Mat>& kRawGOP, floa
 }
 
 void NaiveVidDataLoader::DecodeAndPreprocessGOP(const std::string& kFileName, float *output_buf) const {
+  DecoderMemoryScope scope;
+  StageTimer timer(TimedStage::Decode);
   std::vector<cv::Mat> mats = DecodeGOP(kFileName);
+  timer.Next(TimedStage::Normalize);
   PreprocessGOP(mats, output_buf);
 
   /*const size_t kFrameSize = 3 * kModelInputDim_ * kModelInputDim_;
@@ -100,31 +107,130 @@ void OptimizedVidDataLoader::PreprocessGOP(const std::vector<cv::Mat>& kRawGOP,
 
 // TODO: non-optimized loader w/o planar?
 void OptimizedVidDataLoader::DecodeAndPreprocessGOP(const std::string& kFileName, float *output_buf) const {
-  // FIXME: pixel format, resol, nbframes
-  const size_t kNbFrames = 150;
+  DecodeAndPreprocessGOPs({this}, kFileName, &output_buf);
+}
+
+void OptimizedVidDataLoader::NormalizeGOP(
+    const uint8_t *kDecoded, const size_t kNbFrames, float *output_buf) const {
   const size_t kChannelSize = kModelInputDim_ * kModelInputDim_;
   const size_t kFrameSize = 3 * kChannelSize;
-  // FIXME: alias into output_buf?
-  std::vector<uint8_t> tmp_buf(kNbFrames * kFrameSize);
-  VideoDecoder decoder(
-      kFileName,
-      PixelFormat::PLANAR_RGB, kModelInputDim_,
-      kNbFrames,
-      kRegion_,
-      kCondition_);
-  decoder.DecodeAll(tmp_buf.data());
-
-  if (kCondition_ == LoaderCondition::DecodeResize)
-    return;
-
   for (size_t i = 0; i < kNbFrames; i++) {
     size_t out_offset = i * kFrameSize;
     for (size_t ch = 0; ch < 3; ch++) {
       const size_t in_chan = (ch + 2) % 3;
       size_t in_offset = i * kFrameSize + kChannelSize * in_chan;
       for (size_t j = 0; j < kChannelSize; j++) {
-        output_buf[out_offset++] = map_[ch][tmp_buf[in_offset++]];
+        output_buf[out_offset++] = map_[ch][kDecoded[in_offset++]];
       }
     }
   }
 }
+
+
+void VideoDataLoader::CheckSharedDecode(const std::vector<const VideoDataLoader *>& kLoaders) {
+  const VideoDataLoader *kFirst = kLoaders.at(0);
+  for (const VideoDataLoader *loader : kLoaders) {
+    if (!loader->CanShareDecode() ||
+        loader->GetDecodeFormat() != kFirst->GetDecodeFormat() ||
+        loader->kCondition_ != kFirst->kCondition_ ||
+        loader->kRegion_.left != kFirst->kRegion_.left || loader->kRegion_.top != kFirst->kRegion_.top ||
+        loader->kRegion_.right != kFirst->kRegion_.right || loader->kRegion_.bottom != kFirst->kRegion_.bottom)
+      throw std::invalid_argument("Video loaders can't share a decode");
+  }
+}
+
+void VideoDataLoader::DecodeAndPreprocessGOPs(
+    const std::vector<const VideoDataLoader *>& kLoaders, const std::string& kFileName,
+    float *const *output_bufs, const PreFilter *kFilter, std::vector<bool> *accepted) {
+  DecoderMemoryScope scope;
+  // FIXME: pixel format, nbframes
+  const size_t kNbFrames = kFramesPerGOP;
+  const VideoDataLoader *kFirst = kLoaders.at(0);
+  std::vector<size_t> resols;
+  std::vector<std::vector<uint8_t> > tmp_bufs;
+  std::vector<uint8_t *> tmp_ptrs;
+  tmp_bufs.reserve(kLoaders.size());
+  for (const VideoDataLoader *loader : kLoaders) {
+    resols.push_back(loader->kModelInputDim_);
+    tmp_bufs.emplace_back(kNbFrames * loader->GetImSize());
+    tmp_ptrs.push_back(tmp_bufs.back().data());
+  }
+
+  // Timed per GOP; the decoder also scales the frames
+  StageTimer timer(TimedStage::Decode);
+  // FIXME: alias into output_buf?
+  VideoDecoder decoder(
+      kFileName,
+      kFirst->GetDecodeFormat(), resols,
+      kNbFrames,
+      kFirst->kRegion_,
+      kFirst->kCondition_);
+  decoder.DecodeAll(tmp_ptrs);
+  timer.Stop();
+
+  if (kFilter != NULL) {
+    const size_t kResol = kFirst->kModelInputDim_;
+    const size_t kPlaneSize = kResol * kResol;
+    const bool kGray = kFirst->GetDecodeFormat() == PixelFormat::GRAY;
+    accepted->assign(kNbFrames, false);
+    for (size_t i = 0; i < kNbFrames; i++) {
+      const uint8_t *kFrame = tmp_bufs[0].data() + i * kFirst->GetImSize();
+      // Planar RGB is decoded as GBR planes
+      const uint8_t *kRGB[3] = {kFrame + 2 * kPlaneSize, kFrame, kFrame + kPlaneSize};
+      (*accepted)[i] = kFilter->Accept(kFilter->ComputeStats(
+          kGray ? &kFrame : kRGB, kGray ? 1 : 3, 1, kResol, kResol));
+    }
+    if (std::find(accepted->begin(), accepted->end(), true) == accepted->end())
+      return;
+  }
+
+  if (kFirst->kCondition_ == LoaderCondition::DecodeResize)
+    return;
+
+  timer.Next(TimedStage::Normalize);
+  for (size_t i = 0; i < kLoaders.size(); i++)
+    kLoaders[i]->NormalizeGOP(tmp_bufs[i].data(), kNbFrames, output_bufs[i]);
+}
+
+
+
+std::vector<cv::Mat> GrayVidDataLoader::DecodeGOP(const std::string& kFileName) const {
+  // FIXME: nbframes
+  const size_t kNbFrames = kFramesPerGOP;
+  const size_t kFrameSize = kModelInputDim_ * kModelInputDim_;
+  uint8_t *output_buf = (uint8_t *) malloc(kFrameSize * kNbFrames);
+  VideoDecoder decoder(
+      kFileName,
+      PixelFormat::GRAY, kModelInputDim_,
+      kNbFrames,
+      kRegion_,
+      kCondition_);
+  decoder.DecodeAll(output_buf);
+
+  std::vector<cv::Mat> ret;
+  for (size_t i = 0; i < kNbFrames; i++)
+    ret.push_back(cv::Mat(kModelInputDim_, kModelInputDim_, CV_8UC1, output_buf + i * kFrameSize));
+  return ret;
+}
+
+void GrayVidDataLoader::PreprocessGOP(const std::vector<cv::Mat>& kRawGOP, float *output_buf) const {
+  const size_t kFrameSize = kModelInputDim_ * kModelInputDim_;
+  for (size_t frame = 0, offset = 0; frame < kRawGOP.size(); frame++) {
+    const uint8_t *in = kRawGOP[frame].ptr();
+    for (size_t j = 0; j < kFrameSize; j++)
+      output_buf[offset++] = map_[in[j]];
+  }
+  // Same ownership as NaiveVidDataLoader::DecodeGOP
+  free(kRawGOP[0].data);
+}
+
+void GrayVidDataLoader::DecodeAndPreprocessGOP(const std::string& kFileName, float *output_buf) const {
+  DecodeAndPreprocessGOPs({this}, kFileName, &output_buf);
+}
+
+void GrayVidDataLoader::NormalizeGOP(
+    const uint8_t *kDecoded, const size_t kNbFrames, float *output_buf) const {
+  const size_t kSize = kNbFrames * kModelInputDim_ * kModelInputDim_;
+  for (size_t j = 0; j < kSize; j++)
+    output_buf[j] = map_[kDecoded[j]];
+}
@@ -58,9 +58,18 @@ VideoDecoder::VideoDecoder(
     const size_t kOutputResol, const size_t kNbFrames,
     CropRegion region, LoaderCondition cond,
     const bool kDoResize) :
+    VideoDecoder(kFname, dst_pfmt, std::vector<size_t>(1, kOutputResol), kNbFrames,
+                 region, cond, kDoResize) {}
+
+VideoDecoder::VideoDecoder(
+    const std::string& kFname, const enum PixelFormat dst_pfmt,
+    const std::vector<size_t>& kOutputResols, const size_t kNbFrames,
+    CropRegion region, LoaderCondition cond,
+    const bool kDoResize) :
     dst_pix_fmt_(PixFormat::GetLibavPixelFormat(dst_pfmt)),
     kPlanar_(PixFormat::IsPlanar(dst_pfmt)),
-    kOutWidth_(kOutputResol), kOutHeight_(kOutputResol),
+    kNbChannels_(PixFormat::NbChannels(dst_pfmt)),
+    kOutResols_(kOutputResols.begin(), kOutputResols.end()),
     kNbFrames_(kNbFrames),
     verbose_(false), kCondition_(cond) {
   // open input file, and allocate format context
@@ -88,14 +97,16 @@ VideoDecoder::VideoDecoder(
 
   // FIXME
   // Set up swscale
-  if (kDoResize) {
-    sws_ctx_ = sws_getContext(region.right - region.left,
-                              region.bottom - region.top,
-                              in_pix_fmt_,
-                              kOutWidth_, kOutHeight_, dst_pix_fmt_,
-                              SWS_FAST_BILINEAR, NULL, NULL, NULL);
-  } else {
-    sws_ctx_ = NULL;
+  for (const int kResol : kOutResols_) {
+    if (kDoResize) {
+      sws_ctxs_.push_back(sws_getContext(region.right - region.left,
+                                         region.bottom - region.top,
+                                         in_pix_fmt_,
+                                         kResol, kResol, dst_pix_fmt_,
+                                         SWS_FAST_BILINEAR, NULL, NULL, NULL));
+    } else {
+      sws_ctxs_.push_back(NULL);
+    }
   }
   cropper_ = new Cropper(kInWidth_, kInHeight_, in_pix_fmt_, region);
 }
@@ -114,12 +125,13 @@ VideoDecoder::~VideoDecoder() {
   av_frame_free(&frame_);
 
   av_packet_free(&pkt_);
-  sws_freeContext(sws_ctx_);
+  for (struct SwsContext *sws_ctx : sws_ctxs_)
+    sws_freeContext(sws_ctx);
 }
 
 
 // FIXME: Optimized vs not?
-void VideoDecoder::ProcessFrame(cv::Mat *converted) {
+void VideoDecoder::ProcessFrame(const std::vector<cv::Mat *>& converted) {
   if (kCondition_ == LoaderCondition::DecodeOnly)
     return;
 
@@ -129,46 +141,49 @@ void VideoDecoder::ProcessFrame(cv::Mat *converted) {
     return;
   }
 
-  if (sws_ctx_ != NULL) {
+  for (size_t out = 0; out < sws_ctxs_.size(); out++) {
+    if (sws_ctxs_[out] == NULL) {
+      // TODO: totally fucked
+      /*for (size_t ch = 0; ch < 3; ch++) {
+        for (size_t row = 0; row < cropped->height; row++) {
+          std::copy(cropped->data[ch], cropped->data[ch] + cropped->width,
+                    dst_data_[ch]);
+        }
+      }*/
+      continue;
+    }
+    const int kOutWidth = kOutResols_[out], kOutHeight = kOutResols_[out];
     uint8_t *dst_data[4] = {NULL};
-    int dst_linesize[4] = {kOutWidth_, kOutWidth_ ,kOutWidth_, 0};
-    const size_t kChannelSize = kOutWidth_ * kOutHeight_;
+    int dst_linesize[4] = {kOutWidth, kOutWidth ,kOutWidth, 0};
+    const size_t kChannelSize = kOutWidth * kOutHeight;
     if (kPlanar_) {
-      for (size_t ch = 0; ch < 3; ch++) {
+      for (size_t ch = 0; ch < kNbChannels_; ch++) {
         size_t offset = ch * kChannelSize;
-        dst_data[ch] = converted->data + offset;
+        dst_data[ch] = converted[out]->data + offset;
       }
     } else {
-      dst_data[0] = converted->data;
+      dst_data[0] = converted[out]->data;
     }
-    sws_scale(sws_ctx_,
+    sws_scale(sws_ctxs_[out],
               (const uint8_t * const*) cropped->data,
               cropped->linesize, 0, cropped->height,
               dst_data, dst_linesize);
 
-    /*cv::Mat c1(kOutWidth_, kOutHeight_, CV_8UC1, converted->data);
-    cv::Mat c2(kOutWidth_, kOutHeight_, CV_8UC1, converted->data + kChannelSize);
-    cv::Mat c3(kOutWidth_, kOutHeight_, CV_8UC1, converted->data + kChannelSize * 2);
+    /*cv::Mat c1(kOutWidth, kOutHeight, CV_8UC1, converted[out]->data);
+    cv::Mat c2(kOutWidth, kOutHeight, CV_8UC1, converted[out]->data + kChannelSize);
+    cv::Mat c3(kOutWidth, kOutHeight, CV_8UC1, converted[out]->data + kChannelSize * 2);
     cv::Mat channels[3] = {c1, c2, c3};
     cv::Mat output;
     cv::merge(channels, 3, output);
     cv::imwrite("/afs/cs.stanford.edu/u/ddkang/test.png", output);
     throw std::runtime_error("hi");*/
-  } else {
-    // TODO: totally fucked
-    /*for (size_t ch = 0; ch < 3; ch++) {
-      for (size_t row = 0; row < cropped->height; row++) {
-        std::copy(cropped->data[ch], cropped->data[ch] + cropped->width,
-                  dst_data_[ch]);
-      }
-    }*/
   }
   av_frame_unref(cropped);
   if (kCondition_ == LoaderCondition::DecodeResize)
     return;
 }
 
-void VideoDecoder::DecodePacket(AVPacket *pkt, std::vector<cv::Mat> &return_frames) {
+void VideoDecoder::DecodePacket(AVPacket *pkt, std::vector<std::vector<cv::Mat> > &return_frames) {
   int ret = avcodec_send_packet(video_dec_ctx_, pkt);
   if (ret < 0)
     throw std::runtime_error("Error decoding frame");
@@ -181,26 +196,38 @@ void VideoDecoder::DecodePacket(AVPacket *pkt, std::vector<cv::Mat> &return_fram
       throw std::runtime_error("Error decoding frame");
     if (frame_->width != kInWidth_ || frame_->height != kInHeight_ || frame_->format != in_pix_fmt_)
       throw std::runtime_error("Frame {width,height,pix_fmt} changed");
-    if (video_frame_count_ < return_frames.size())
-      ProcessFrame(&return_frames[video_frame_count_]);
+    if (video_frame_count_ < kNbFrames_) {
+      std::vector<cv::Mat *> converted(return_frames.size());
+      for (size_t out = 0; out < return_frames.size(); out++)
+        converted[out] = &return_frames[out][video_frame_count_];
+      ProcessFrame(converted);
+    }
     video_frame_count_++;
     av_frame_unref(frame_);
   }
 }
 
 void VideoDecoder::DecodeAll(uint8_t *output) {
-  std::vector<cv::Mat> return_frames(kNbFrames_);
-  int got_frame;
-  int sizes[3];
-  if (kPlanar_) {
-    sizes[0] = 3; sizes[1] = kOutHeight_; sizes[2] = kOutWidth_;
-  } else {
-    sizes[0] = kOutHeight_; sizes[1] = kOutWidth_; sizes[2] = 3;
-  }
-  const size_t kFrameSize = 3 * kOutWidth_ * kOutHeight_;
-  for (size_t i = 0; i < return_frames.size(); i++) {
-    uint8_t *data = output + kFrameSize * i;
-    return_frames[i] = cv::Mat(3, sizes, CV_8UC1, data);
+  DecodeAll(std::vector<uint8_t *>(1, output));
+}
+
+void VideoDecoder::DecodeAll(const std::vector<uint8_t *>& outputs) {
+  if (outputs.size() != kOutResols_.size())
+    throw std::invalid_argument("Need one output per resolution");
+  std::vector<std::vector<cv::Mat> > return_frames(outputs.size(), std::vector<cv::Mat>(kNbFrames_));
+  for (size_t out = 0; out < outputs.size(); out++) {
+    const int kOutWidth = kOutResols_[out], kOutHeight = kOutResols_[out];
+    int sizes[3];
+    if (kPlanar_) {
+      sizes[0] = kNbChannels_; sizes[1] = kOutHeight; sizes[2] = kOutWidth;
+    } else {
+      sizes[0] = kOutHeight; sizes[1] = kOutWidth; sizes[2] = kNbChannels_;
+    }
+    const size_t kFrameSize = kNbChannels_ * kOutWidth * kOutHeight;
+    for (size_t i = 0; i < kNbFrames_; i++) {
+      uint8_t *data = outputs[out] + kFrameSize * i;
+      return_frames[out][i] = cv::Mat(3, sizes, CV_8UC1, data);
+    }
   }
 
   while (av_read_frame(fmt_ctx_, pkt_) >= 0) {
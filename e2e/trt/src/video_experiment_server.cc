@@ -1,11 +1,21 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "video_experiment_server.h"
+#include "live_metrics.h"
+#include "memory_stats.h"
+#include "queue_monitor.h"
+#include "stage_timer.h"
 
 // void VideoExperimentServer::RunInferenceOnFiles(
 //     const std::vector<std::string>& kFileNames,
@@ -31,7 +41,7 @@
 
 void VideoExperimentServer::RunInferenceOnFiles(
     const std::vector<std::string>& kFileNames,
-    std::vector<float> *output) {
+    std::vector<float> *output, OutputSink *sink) {
 
   /*std::vector<std::future<void> > async_results;
   for (size_t i = 0; i < kFileNames.size(); i++) {
@@ -56,29 +66,81 @@ void VideoExperimentServer::RunInferenceOnFiles(
   }
   for (size_t i = 0; i < async_results.size(); i++)
     async_results[i].get();*/
+  if (output == NULL && sink == NULL)
+    throw std::invalid_argument("Video runs need an output or a sink");
+  const bool kNeedsCallback = sink != NULL || kPreFilter_ != NULL;
+  std::atomic<size_t> nb_pending(0);
   #pragma omp parallel for
   for (size_t i = 0; i < kFileNames.size(); i++) {
+    TraceSpan span("gop", i);
     Batch batch;
-    batch_queue_.blockingRead(batch);
+    StageTimer wait_timer(TimedStage::BatchWait);
+    MonitoredRead(&batch_queue_, batch, QueueKind::Batch);
+    wait_timer.Stop();
 
-    kLoader_.DecodeAndPreprocessGOP(kFileNames[i], batch.get()->data());
-    if (kRunInfer_) {
-      kInfer_->RunInference(
-          std::make_tuple(
-              std::move(batch), kBatchSize_,
-              output->data() + i * kBatchSize_ * kOutputSingle_,
-              kBatchSize_ * kOutputSingle_,
-              &batch_queue_));
+    // Sinks get a buffer per GOP, freed once its rows are written
+    std::shared_ptr<std::vector<float> > gop_buf;
+    float *gop_output;
+    if (sink == NULL) {
+      gop_output = output->data() + i * kBatchSize_ * kOutputSingle_;
     } else {
-      batch_queue_.blockingWrite(std::move(batch));
+      gop_buf = std::make_shared<std::vector<float> >(kBatchSize_ * kOutputSingle_);
+      gop_output = gop_buf->data();
+    }
+    std::vector<bool> accepted;
+    bool skip_infer = false;
+    if (kPreFilter_ == NULL) {
+      kLoader_.DecodeAndPreprocessGOP(kFileNames[i], batch.get()->data());
+    } else {
+      kLoader_.FilterAndPreprocessGOP(kFileNames[i], batch.get()->data(), *kPreFilter_, &accepted);
+      accepted.resize(kBatchSize_, false);
+      const size_t kNbAccepted = std::count(accepted.begin(), accepted.end(), true);
+      nb_dropped_ += kBatchSize_ - kNbAccepted;
+      skip_infer = kNbAccepted == 0;
+    }
+    // Overwrites the dropped frames' outputs once the batch is done
+    auto on_done = [this, gop_output, gop_buf, accepted, sink, i]() {
+      for (size_t j = 0; j < accepted.size(); j++) {
+        if (!accepted[j])
+          kPreFilter_->FillDefault(gop_output + j * kOutputSingle_, kOutputSingle_);
+      }
+      if (sink != NULL)
+        sink->Write(i * kBatchSize_, gop_output, kBatchSize_, kOutputSingle_);
+      LiveMetrics::AddImages(0, kBatchSize_);
+    };
+    if (kRunInfer_ && !skip_infer) {
+      QueueData data = std::make_tuple(
+          std::move(batch), kBatchSize_, gop_output, kBatchSize_ * kOutputSingle_, &batch_queue_);
+      // Callbacks make the stream wait for every batch, so plain runs go without
+      if (kNeedsCallback) {
+        nb_pending++;
+        kInfer_->RunInference(std::move(data), [on_done, &nb_pending]() {
+          on_done();
+          nb_pending--;
+        });
+      } else {
+        LiveMetrics::AddImages(0, kBatchSize_);
+        kInfer_->RunInference(std::move(data));
+      }
+    } else {
+      if (skip_infer)
+        on_done();
+      else
+        LiveMetrics::AddImages(0, kBatchSize_);
+      TraceSpan span("batch-queue-write");
+      MonitoredWrite(&batch_queue_, std::move(batch), QueueKind::Batch);
     }
   }
 
   kInfer_->Sync();
+  // Sync doesn't wait for the callbacks
+  while (nb_pending.load() > 0)
+    std::this_thread::yield();
 }
 
 std::pair<float, std::vector<float> > VideoExperimentServer::TimeEndToEnd(const std::vector<std::string>& kFileNames) {
   std::vector<float> output(kFileNames.size() * kOutputSingle_ * kBatchSize_);
+  MemoryCharge output_charge(MemoryOwner::Output, output.size() * sizeof(float));
 
   auto start = std::chrono::high_resolution_clock::now();
   RunInferenceOnFiles(kFileNames, &output);
@@ -86,3 +148,12 @@ std::pair<float, std::vector<float> > VideoExperimentServer::TimeEndToEnd(const
   std::chrono::duration<double, std::milli> diff = end - start;
   return std::make_pair(diff.count() / 1000.0, output);
 }
+
+float VideoExperimentServer::TimeEndToEnd(
+    const std::vector<std::string>& kFileNames, OutputSink *sink) {
+  auto start = std::chrono::high_resolution_clock::now();
+  RunInferenceOnFiles(kFileNames, NULL, sink);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::milli> diff = end - start;
+  return diff.count() / 1000.0;
+}
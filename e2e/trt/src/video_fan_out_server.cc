@@ -0,0 +1,79 @@
+#include <chrono>
+#include <stdexcept>
+
+#include "live_metrics.h"
+#include "memory_stats.h"
+#include "stage_timer.h"
+#include "video_fan_out_server.h"
+
+VideoFanOutServer::VideoFanOutServer(
+    const std::vector<const VideoDataLoader *>& kLoaders,
+    const std::vector<InferenceServer *>& kInfers,
+    const size_t kBatchSize, const bool kRunInfer) :
+    kLoaders_(kLoaders), kInfers_(kInfers), kBatchSize_(kBatchSize), kRunInfer_(kRunInfer) {
+  if (kLoaders_.size() != kInfers_.size())
+    throw std::invalid_argument("Need one loader per model");
+  VideoDataLoader::CheckSharedDecode(kLoaders_);
+  for (const VideoDataLoader *loader : kLoaders_) {
+    batch_queues_.push_back(
+        std::make_unique<folly::MPMCQueue<Batch> >(omp_get_max_threads() * 3));
+    queue_registrations_.push_back(
+        std::make_unique<QueueRegistration>(QueueKind::Batch, batch_queues_.back().get()));
+    for (size_t i = 0; i < omp_get_max_threads() * 3; i++)
+      batch_queues_.back()->blockingWrite(
+          std::make_unique<BatchBase>(kBatchSize_ * loader->GetImSize()));
+  }
+}
+
+void VideoFanOutServer::RunInferenceOnFiles(
+    const std::vector<std::string>& kFileNames,
+    std::vector<std::vector<float> > *outputs) {
+  const size_t kNbModels = kInfers_.size();
+  #pragma omp parallel for
+  for (size_t i = 0; i < kFileNames.size(); i++) {
+    TraceSpan span("gop", i);
+    std::vector<Batch> batches(kNbModels);
+    std::vector<float *> bufs(kNbModels);
+    for (size_t m = 0; m < kNbModels; m++) {
+      StageTimer wait_timer(TimedStage::BatchWait);
+      MonitoredRead(batch_queues_[m].get(), batches[m], QueueKind::Batch);
+      wait_timer.Stop();
+      bufs[m] = batches[m].get()->data();
+    }
+    VideoDataLoader::DecodeAndPreprocessGOPs(kLoaders_, kFileNames[i], bufs.data());
+    LiveMetrics::AddImages(0, kBatchSize_);
+    for (size_t m = 0; m < kNbModels; m++) {
+      if (!kRunInfer_) {
+        TraceSpan span("batch-queue-write");
+        MonitoredWrite(batch_queues_[m].get(), std::move(batches[m]), QueueKind::Batch);
+        continue;
+      }
+      const size_t kOutputSingle = kInfers_[m]->GetOutputSingle();
+      kInfers_[m]->RunInference(
+          std::make_tuple(std::move(batches[m]), kBatchSize_,
+                          (*outputs)[m].data() + i * kBatchSize_ * kOutputSingle,
+                          kBatchSize_ * kOutputSingle,
+                          batch_queues_[m].get()));
+    }
+  }
+  for (InferenceServer *infer : kInfers_)
+    infer->Sync();
+}
+
+std::pair<float, std::vector<std::vector<float> > > VideoFanOutServer::TimeEndToEnd(
+    const std::vector<std::string>& kFileNames) {
+  std::vector<std::vector<float> > outputs;
+  size_t output_bytes = 0;
+  for (InferenceServer *infer : kInfers_) {
+    outputs.emplace_back(kFileNames.size() * kBatchSize_ * infer->GetOutputSingle());
+    output_bytes += outputs.back().size() * sizeof(float);
+  }
+  MemoryCharge output_charge(MemoryOwner::Output, output_bytes);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  RunInferenceOnFiles(kFileNames, &outputs);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::milli> diff = end - start;
+  float time = diff.count() / 1000.0;
+  return std::make_pair(time, outputs);
+}
@@ -1,5 +1,8 @@
+#include <chrono>
 #include <fstream>
+#include <memory>
 #include <string>
+#include <tuple>
 #include <vector>
 #include <experimental/filesystem>
 
@@ -7,7 +10,15 @@
 
 #include "include/video_data_loader.h"
 #include "include/inference_server.h"
+#include "include/live_metrics.h"
+#include "include/memory_stats.h"
 #include "include/video_experiment_server.h"
+#include "include/video_fan_out_server.h"
+#include "include/pre_filter.h"
+#include "include/queue_monitor.h"
+#include "include/output_sink.h"
+#include "include/stage_timer.h"
+#include "include/trials.h"
 
 // Expects a validation directory as in pytorch
 std::vector<std::string> GetFileNames(const std::string& vid_dir) {
@@ -34,6 +45,18 @@ std::vector<std::string> GetFileNames(const std::string& vid_dir) {
   return str_paths;
 }
 
+// FIXME: 256
+static VideoDataLoader *MakeLoader(const std::string& kType, const size_t kModelInputDim,
+                                   const CropRegion region, const LoaderCondition cond) {
+  if (kType == "opt")
+    return new OptimizedVidDataLoader(256, kModelInputDim, region, cond);
+  else if (kType == "naive")
+    return new NaiveVidDataLoader(256, kModelInputDim, region, cond);
+  else if (kType == "gray")
+    return new GrayVidDataLoader(256, kModelInputDim, region, cond);
+  throw std::invalid_argument("Loader cfg wrong");
+}
+
 int main(int argc, char *argv[]) {
   // auto paths = GetFileNames("/lfs/1/ddkang/blazeit/data/svideo/jackson-town-square/2017-12-17");
   // auto paths = GetFileNames("/lfs/1/ddkang/blazeit/data/svideo/jackson-town-square/short");
@@ -47,14 +70,47 @@ int main(int argc, char *argv[]) {
   const bool kWriteOut = cfg["experiment-config"]["write-out"].as<bool>();
   const bool kRunInfer = cfg["experiment-config"]["run-infer"].as<bool>();
   const bool kDoMemcpy = cfg["infer-config"]["do-memcpy"].as<bool>();
-
-  // Video only has one model
-  auto model_cfg = cfg["model-config"]["model-single"];
-  const std::string kOnnxPath = model_cfg["onnx-path"].as<std::string>();
-  const std::string kEnginePath = model_cfg["engine-path"].as<std::string>();
-  const std::string kDataPath =  model_cfg["data-path"].as<std::string>();
-  const size_t kBatchSize = model_cfg["batch-size"].as<size_t>();
-  const size_t kModelInputDim = model_cfg["input-dim"][0].as<size_t>();
+  // Per stage histograms, written as JSON at the end of the run
+  const std::string kTimingPath = cfg["experiment-config"]["timing-json"] ?
+      cfg["experiment-config"]["timing-json"].as<std::string>() : "";
+  // Chrome trace of every timed stage and GOP, keeping the latest events of each thread
+  const std::string kTracePath = cfg["experiment-config"]["trace-json"] ?
+      cfg["experiment-config"]["trace-json"].as<std::string>() : "";
+  const size_t kTraceEvents = cfg["experiment-config"]["trace-events-per-thread"] ?
+      cfg["experiment-config"]["trace-events-per-thread"].as<size_t>() : 1 << 16;
+  // Cycles, instructions, LLC and branch misses per stage, from perf_event_open
+  const bool kPerfCounters = cfg["experiment-config"]["perf-counters"] ?
+      cfg["experiment-config"]["perf-counters"].as<bool>() : false;
+  const std::string kQueuePath = cfg["experiment-config"]["queue-json"] ?
+      cfg["experiment-config"]["queue-json"].as<std::string>() : "";
+  const std::chrono::microseconds kQueuePeriod(cfg["experiment-config"]["queue-sample-us"] ?
+      cfg["experiment-config"]["queue-sample-us"].as<size_t>() : 1000);
+  const size_t kQueueSamples = cfg["experiment-config"]["queue-max-samples"] ?
+      cfg["experiment-config"]["queue-max-samples"].as<size_t>() : 1 << 20;
+  const bool kMemoryStats = cfg["experiment-config"]["memory-stats"] ?
+      cfg["experiment-config"]["memory-stats"].as<bool>() : false;
+  // Unix socket a local scraper can poll for progress while the run goes on
+  const std::string kMetricsSocket = cfg["experiment-config"]["metrics-socket"] ?
+      cfg["experiment-config"]["metrics-socket"].as<std::string>() : "";
+  // Timed runs in this process and the page cache state of the videos before each
+  const size_t kNbTrials = cfg["experiment-config"]["trials"] ?
+      cfg["experiment-config"]["trials"].as<size_t>() : 1;
+  const CacheMode kCacheMode = ParseCacheMode(cfg["experiment-config"]["cache-mode"] ?
+      cfg["experiment-config"]["cache-mode"].as<std::string>() : "any");
+
+  // Fan-out runs every model over the first model's videos, decoding each GOP once for all of
+  // them; otherwise there is one model
+  const bool kFanOut = cfg["experiment-type"] &&
+      cfg["experiment-type"].as<std::string>() == "fan-out";
+  std::vector<YAML::Node> model_cfgs;
+  if (kFanOut) {
+    for (const auto& kEntry : cfg["model-config"])
+      model_cfgs.push_back(kEntry.second);
+  } else {
+    model_cfgs.push_back(cfg["model-config"]["model-single"]);
+  }
+  const std::string kDataPath =  model_cfgs[0]["data-path"].as<std::string>();
+  const size_t kBatchSize = model_cfgs[0]["batch-size"].as<size_t>();
 
   auto paths = GetFileNames(kDataPath);
   std::cerr << "Processing " << paths.size() << " files" << std::endl;
@@ -66,41 +122,108 @@ int main(int argc, char *argv[]) {
   const size_t ymax = crop_cfg["ymax"].as<size_t>();
   const CropRegion region(xmin, ymin, xmax, ymax);
 
-  // FIXME: 256
-  VideoDataLoader *loader = NULL;
-  const std::string kLoaderType = model_cfg["data-loader"].as<std::string>();
   std::string cond_str = cfg["experiment-config"]["exp-type"].as<std::string>();
   LoaderCondition cond = LoaderCondition::GetVal(cond_str);
-  if (kLoaderType == "opt") {
-    loader = new OptimizedVidDataLoader(256, kModelInputDim, region, cond);
-  } else if (kLoaderType == "naive") {
-    loader = new NaiveVidDataLoader(256, kModelInputDim, region, cond);
-  } else {
-    throw std::invalid_argument("Loader cfg wrong");
+  std::vector<const VideoDataLoader *> loaders;
+  std::vector<InferenceServer *> infers;
+  for (const YAML::Node& kModelCfg : model_cfgs) {
+    if (kModelCfg["batch-size"].as<size_t>() != kBatchSize)
+      throw std::invalid_argument("Fan-out models need the same batch size");
+    const std::string kEnginePath = kModelCfg["engine-path"].as<std::string>();
+    const size_t kModelInputDim = kModelCfg["input-dim"][0].as<size_t>();
+    VideoDataLoader *loader = MakeLoader(
+        kModelCfg["data-loader"].as<std::string>(), kModelInputDim, region, cond);
+    OnnxInferenceServer *infer;
+    namespace fs = std::experimental::filesystem;
+    if (fs::exists(kEnginePath)) {
+      infer = new OnnxInferenceServer(kEnginePath, kBatchSize, kDoMemcpy);
+    } else {
+      infer = new OnnxInferenceServer(
+          kModelCfg["onnx-path"].as<std::string>(), "", kEnginePath, kBatchSize, kDoMemcpy,
+          loader, paths,
+          kModelCfg["do-int8"].as<bool>());
+    }
+    loaders.push_back(loader);
+    infers.push_back(infer);
   }
-  OnnxInferenceServer *infer;
-  namespace fs = std::experimental::filesystem;
-  if (fs::exists(kEnginePath)) {
-    infer = new OnnxInferenceServer(kEnginePath, kBatchSize, kDoMemcpy);
-  } else {
-    infer = new OnnxInferenceServer(
-        kOnnxPath, "", kEnginePath, kBatchSize, kDoMemcpy,
-        loader, paths,
-        model_cfg["do-int8"].as<bool>());
+  const PreFilter *pre_filter = ParsePreFilter(cfg["pre-filter"]);
+  if (pre_filter != NULL && kFanOut)
+    throw std::invalid_argument("The pre-filter doesn't support fan-out");
+  // The pre-filter sees the frames through the shared decode path
+  if (pre_filter != NULL)
+    VideoDataLoader::CheckSharedDecode(loaders);
+  std::unique_ptr<VideoExperimentServer> server;
+  std::unique_ptr<VideoFanOutServer> fan_out;
+  if (kFanOut)
+    fan_out.reset(new VideoFanOutServer(loaders, infers, kBatchSize, kRunInfer));
+  else
+    server.reset(new VideoExperimentServer(*loaders[0], infers[0], kBatchSize, kRunInfer,
+                                           pre_filter));
+
+  for (size_t i = 0; i < infers.size(); i++)
+    static_cast<OnnxInferenceServer *>(infers[i])->warmup(loaders[i]->GetResol());
+
+  // One row per frame, written as each GOP finishes
+  std::unique_ptr<OutputSink> sink;
+  if (kWriteOut && !kFanOut) {
+    const OutputFormat kFormat = ParseOutputFormat(cfg["experiment-config"]["output-format"] ?
+        cfg["experiment-config"]["output-format"].as<std::string>() : "fp32");
+    const size_t kTopK = cfg["experiment-config"]["output-top-k"] ?
+        cfg["experiment-config"]["output-top-k"].as<size_t>() : 5;
+    sink.reset(new MmapOutputSink("preds.out", paths.size() * kBatchSize,
+                                  infers[0]->GetOutputSingle(), kFormat, kTopK));
   }
-  VideoExperimentServer server(*loader, infer, kBatchSize, kRunInfer);
-
-  infer->warmup(kModelInputDim);
-
-  float time;
-  std::vector<float> output;
-  std::tie(time, output) = server.TimeEndToEnd(paths);
-  std::cerr << "Runtime: " << time << std::endl;
 
-  if (kWriteOut) {
-    std::ofstream fout("preds.out", std::ios::out | std::ios::binary);
-    fout.write((char *) output.data(), output.size() * sizeof(float));
-    fout.close();
+  StageTimers::Enable(!kTimingPath.empty());
+  if (kMemoryStats)
+    MemoryStats::Enable();
+  if (!kQueuePath.empty())
+    QueueMonitor::Enable(kQueuePeriod, kQueueSamples);
+  if (!kMetricsSocket.empty())
+    LiveMetrics::Enable(kMetricsSocket);
+  if (!kTracePath.empty())
+    Tracer::Enable(kTraceEvents);
+  if (kPerfCounters) {
+    const std::string kError = PerfCounters::Enable();
+    if (!kError.empty())
+      std::cerr << "Hardware counters are off, " << kError << std::endl;
+  }
+  std::vector<std::vector<float> > outputs;
+  const TrialStats kTrials = RunTrials(kNbTrials, kCacheMode, paths, [&]() {
+    // Without a sink the outputs need somewhere to land
+    if (!kFanOut && sink)
+      return server->TimeEndToEnd(paths, sink.get());
+    if (!kFanOut)
+      return server->TimeEndToEnd(paths).first;
+    float time;
+    std::tie(time, outputs) = fan_out->TimeEndToEnd(paths);
+    return time;
+  });
+  LiveMetrics::Disable();
+  PrintTrials(std::cerr, kTrials);
+  std::cerr << "Runtime: " << kTrials.mean << std::endl;
+  if (pre_filter != NULL)
+    std::cerr << "Pre-filter dropped frames: " << server->GetNbDropped() / kNbTrials << std::endl;
+  // Per frame
+  if (PerfCounters::IsEnabled())
+    StageTimers::PrintCounters(std::cerr, paths.size() * kBatchSize * kNbTrials);
+  if (MemoryStats::IsEnabled())
+    MemoryStats::Print(std::cerr, paths.size() * kBatchSize * kNbTrials);
+  if (!kTimingPath.empty()) {
+    std::ofstream fout(kTimingPath);
+    StageTimers::WriteJson(fout);
+  }
+  if (!kTracePath.empty())
+    Tracer::WriteJson(kTracePath);
+  if (QueueMonitor::IsEnabled()) {
+    QueueMonitor::Disable();
+    QueueMonitor::PrintSummary(std::cerr);
+    QueueMonitor::WriteJson(kQueuePath);
+  }
+  // One file per model, as the runner's fan-out writes them
+  for (size_t i = 0; kWriteOut && i < outputs.size(); i++) {
+    std::ofstream fout("preds_" + std::to_string(i) + ".out", std::ios::out | std::ios::binary);
+    fout.write((char *) outputs[i].data(), outputs[i].size() * sizeof(float));
   }
 
   return 0;